@@ -0,0 +1,78 @@
+#include "balance_board.h"
+
+#include <cstring>
+
+namespace wiipp {
+
+namespace {
+
+int32_t slope(uint16_t from, uint16_t to) {
+    int32_t span = static_cast<int32_t>(to) - from;
+    if (span <= 0) {
+        return 0;
+    }
+    return ((17000 << 16) + span / 2) / span;
+}
+
+// Reports are split into blocks. Each block is first gathered into per sensor arrays, then
+// converted one sensor at a time in fixed length loops over contiguous data, which the
+// compiler vectorizes. The unused tail of the last block is converted too and discarded.
+constexpr size_t BLOCK = 64;
+
+void convert(const uint16_t (&raw)[BLOCK], uint16_t (&out)[BLOCK], const BalanceBoardCalibration::Sensor& c) {
+    for (size_t i = 0; i < BLOCK; ++i) {
+        out[i] = BalanceBoardCalibration::grams(raw[i], c);
+    }
+}
+
+}  // namespace
+
+BalanceBoardCalibration BalanceBoardCalibration::fromRaw(const std::array<uint16_t, 12>& raw,
+                                                         uint8_t referenceTemperature) {
+    BalanceBoardCalibration calibration;
+    for (size_t i = 0; i < 4; ++i) {
+        calibration.sensors[i] = Sensor{
+            .zero = raw[i],
+            .mid = raw[i + 4],
+            .slopeLow = slope(raw[i], raw[i + 4]),
+            .slopeHigh = slope(raw[i + 4], raw[i + 8]),
+        };
+    }
+    calibration.referenceTemperature = referenceTemperature;
+    return calibration;
+}
+
+size_t decodeBalanceBoardReports(std::span<const uint8_t> reports, const BalanceBoardCalibration& calibration,
+                                 const BalanceBoardSamples& out, size_t stride) {
+    if (stride < 15) {
+        return 0;
+    }
+    size_t count = reports.size() / stride;
+    uint16_t* outputs[4] = {out.tr, out.br, out.tl, out.bl};
+    uint16_t raw[4][BLOCK] = {};
+    uint16_t converted[BLOCK];
+
+    for (size_t first = 0; first < count; first += BLOCK) {
+        size_t n = count - first < BLOCK ? count - first : BLOCK;
+        const uint8_t* report = reports.data() + first * stride;
+        for (size_t i = 0; i < n; ++i, report += stride) {
+            const uint8_t* mem = report + 4;
+            // The four big endian sensor values in one load, the ESP32 and our hosts are little endian
+            uint64_t values;
+            memcpy(&values, mem, sizeof(values));
+            values = __builtin_bswap64(values);
+            for (size_t s = 0; s < 4; ++s) {
+                raw[s][i] = values >> (48 - 16 * s);
+            }
+            out.temperature[first + i] = mem[8];
+            out.batteryLevel[first + i] = mem[10];
+        }
+        for (size_t s = 0; s < 4; ++s) {
+            convert(raw[s], converted, calibration.sensors[s]);
+            memcpy(outputs[s] + first, converted, n * sizeof(uint16_t));
+        }
+    }
+    return count;
+}
+
+}  // namespace wiipp
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+namespace wiipp {
+
+// Balance board calibration as integer line segments per sensor, 0-17kg and 17kg and up.
+// The slopes are grams per raw unit in Q16, so converting a sample takes no division.
+// Sensors are ordered top right, bottom right, top left, bottom left, as in the reports.
+struct BalanceBoardCalibration {
+    struct Sensor {
+        uint16_t zero;  // Raw value at 0kg
+        uint16_t mid;   // Raw value at 17kg
+        int32_t slopeLow;
+        int32_t slopeHigh;
+    };
+
+    std::array<Sensor, 4> sensors{};
+    uint8_t referenceTemperature{0};
+
+    // `raw` is the 0kg, 17kg and 34kg blocks read from 0xA40024, four sensors each
+    static BalanceBoardCalibration fromRaw(const std::array<uint16_t, 12>& raw, uint8_t referenceTemperature);
+
+    // Raw sensor value to grams, clamped at 0 below the 0kg point and extrapolated above 34kg.
+    // The Q16 product is split in two so everything stays in 32 bits, the result is the same
+    // as the 64 bit product shifted down.
+    static int32_t grams(uint16_t raw, const Sensor& c) {
+        bool high = raw >= c.mid;
+        uint32_t delta = raw - (high ? c.mid : c.zero);
+        uint32_t slope = high ? c.slopeHigh : c.slopeLow;
+        uint32_t weight = (high ? 17000 : 0) + delta * (slope >> 16) + ((delta * (slope & 0xFFFF)) >> 16);
+        return raw < c.zero ? 0 : static_cast<int32_t>(weight);
+    }
+};
+
+// What a board's calibration is kept as between connections, the raw blocks and reference
+// temperature as read from the board
+struct StoredCalibration {
+    static constexpr uint8_t VERSION = 1;
+
+    uint8_t version;
+    uint8_t referenceTemperature;
+    std::array<uint16_t, 12> raw;
+};
+
+// Structure of arrays output for decodeBalanceBoardReports, each array holds at least as
+// many elements as there are reports.
+struct BalanceBoardSamples {
+    uint16_t* tr;
+    uint16_t* br;
+    uint16_t* tl;
+    uint16_t* bl;
+    uint8_t* temperature;
+    uint8_t* batteryLevel;
+};
+
+// Size of a 0x34 input report as received on the interrupt channel, 0xA1 prefix included
+constexpr size_t BALANCE_BOARD_REPORT_SIZE = 23;
+
+// Converts back to back 0x34 input reports, each `stride` bytes and starting with the 0xA1
+// 0x34 header, the same way live reports are converted. Report types are not checked.
+// Returns the number of reports decoded.
+size_t decodeBalanceBoardReports(std::span<const uint8_t> reports, const BalanceBoardCalibration& calibration,
+                                 const BalanceBoardSamples& out, size_t stride = BALANCE_BOARD_REPORT_SIZE);
+
+}  // namespace wiipp
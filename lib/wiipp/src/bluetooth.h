@@ -1,13 +1,20 @@
 #pragma once
 
+#include <array>
 #include <cstdint>
 #include <functional>
 #include <string_view>
 #include <variant>
 #include <span>
 
+#include "completion.h"
+
 namespace wiipp {
 
+// The L2CAP MTU the host offers when configuring a channel, the L2CAP default. Frames
+// split over several ACL packets are reassembled up to this size.
+constexpr uint16_t L2CAP_MTU = 672;
+
 struct HCIInquiryResult {
     uint64_t bdaddr;
     uint8_t psrm;
@@ -36,6 +43,7 @@ struct HCIDisconnected {
     uint8_t reason;
 };
 
+// Only for successful requests, a failure shows in the requestRemoteName() completion
 struct HCIRemoteName {
     HCIInquiryResult inquiry;
     std::string_view remoteName;
@@ -48,9 +56,18 @@ struct HCIConnectionRequest {
 
 struct HCILinkKeyRequest {
     uint64_t bdaddr;
+};
+
+// A new link key after pairing, to be given back with linkKeyReply on the next Link Key Request
+struct HCILinkKeyNotification {
+    uint64_t bdaddr;
+    std::array<uint8_t, 16> linkKey;
     uint8_t keyType;
-    uint8_t *linkKeyData;
-    size_t size;
+};
+
+struct LinkKey {
+    std::array<uint8_t, 16> key;
+    uint8_t type;
 };
 
 struct HCIPINRequest {
@@ -81,14 +98,35 @@ struct ACLConnectionEstablished {
     bool accepted;
 };
 
+// The L2CAP payload is a view into the receive buffer and is only valid for the
+// duration of the listener call.
 struct ACLData {
     uint16_t handle;
     uint16_t channelId;
-    uint8_t* data;
-    size_t len;
+    std::span<const uint8_t> data;
+};
+
+// Receives the data frames of one L2CAP channel straight from the receive path,
+// without going through onACLEvent. `data` is only valid for the duration of the call.
+struct DataSink {
+    void (*receive)(void* context, uint16_t handle, std::span<const uint8_t> data);
+    void* context;
+};
+
+// Limits for a single Bluetooth::process() call. Processing stops after `packets`
+// received packets or once `micros` has elapsed, whichever comes first. A zero
+// `micros` disables the time limit.
+struct ProcessBudget {
+    size_t packets;
+    uint32_t micros;
+};
+
+struct ProcessResult {
+    size_t handled;
+    size_t queued;
 };
 
-using HCIEvent = std::variant<HCIInquiryComplete, HCIInquiryResult, HCIConnectionEstablished, HCIConnectionFailed, HCIDisconnected, HCIRemoteName, HCILinkKeyRequest, HCIPINRequest>;
+using HCIEvent = std::variant<HCIInquiryComplete, HCIInquiryResult, HCIConnectionEstablished, HCIConnectionFailed, HCIDisconnected, HCIRemoteName, HCILinkKeyRequest, HCILinkKeyNotification, HCIPINRequest>;
 using ACLEvent = std::variant<ACLDisconnected, ACLConnectionFailed, ACLConnectionEstablished, ACLData>;
 
 class Bluetooth {
@@ -101,28 +139,40 @@ public:
     // Device
     virtual std::span<uint8_t, 6> macAddress() = 0;
     virtual void onReady(const std::function<void(Bluetooth*)>&) = 0;
-    // Call from loop/dispatcher
-    virtual void process() = 0;
+    // Call from loop/dispatcher, drains received packets within the process budget
+    virtual ProcessResult process() = 0;
+    virtual void setProcessBudget(const ProcessBudget& budget) = 0;
 
     // HCI
     virtual void onHCIEvent(const std::function<void(Bluetooth*, const HCIEvent&)>&) = 0;
     virtual void onHCIConnectionRequest(const std::function<bool(Bluetooth*, const HCIConnectionRequest&)>& listener) = 0;
 
-    virtual void scan() = 0;
-    virtual void requestRemoteName(const HCIInquiryResult& result) = 0;
-    virtual void connect(const HCIInquiryResult& result) = 0;
-    virtual void auth(uint16_t handle) = 0;
-    virtual void negativeReply(uint64_t bdaddr) = 0;
-    virtual void disconnect(uint16_t handle) = 0;
-    virtual void sendPinReply(uint64_t bdaddr, uint8_t* pinData, size_t len) = 0;
+    // Commands resolve on their follow-up event: scan on Inquiry Complete, requestRemoteName on
+    // Remote Name Request Complete, connect on Connection Complete (with the handle), auth on
+    // Authentication Complete and disconnect on Disconnection Complete. The replies resolve on
+    // their Command Complete.
+    virtual Completion scan() = 0;
+    virtual Completion requestRemoteName(const HCIInquiryResult& result) = 0;
+    virtual Completion connect(const HCIInquiryResult& result) = 0;
+    virtual Completion auth(uint16_t handle) = 0;
+    virtual Completion negativeReply(uint64_t bdaddr) = 0;
+    virtual Completion linkKeyReply(uint64_t bdaddr, std::span<const uint8_t, 16> linkKey) = 0;
+    virtual Completion disconnect(uint16_t handle) = 0;
+    virtual Completion sendPinReply(uint64_t bdaddr, uint8_t* pinData, size_t len) = 0;
 
     // ACL
     virtual void onACLEvent(const std::function<void(Bluetooth*, const ACLEvent&)>& acl) = 0;
     virtual void onACLConnectionRequest(const std::function<bool(Bluetooth*, const ACLConnectionRequest&)>& listener) = 0;
 
+    // `mtu` is the largest SDU we accept on the channel, at most L2CAP_MTU
     virtual void l2cap_connect(uint16_t handle, uint16_t psm, uint16_t mtu) = 0;
     virtual void l2cap_disconnect(uint16_t handle, uint16_t psm) = 0;
     virtual void l2send_data(uint16_t handle, uint16_t psm, uint8_t* data, size_t len) = 0;
+    // Routes data frames of the (handle, psm) channel to `sink` instead of onACLEvent until
+    // the channel is closed. Returns false if there is no such channel.
+    virtual bool setDataSink(uint16_t handle, uint16_t psm, const DataSink& sink) = 0;
+    // ACL packets queued for the handle, waiting for controller buffer credits
+    virtual size_t aclQueueDepth(uint16_t handle) = 0;
 };
 
 }
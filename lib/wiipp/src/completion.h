@@ -0,0 +1,98 @@
+#pragma once
+
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <utility>
+
+namespace wiipp {
+
+// CommandResult::status is an HCI error code, or one of these
+constexpr uint8_t STATUS_SUCCESS = 0x00;
+constexpr uint8_t STATUS_NO_RESOURCES = 0x07;       // HCI Memory Capacity Exceeded, the command could not be queued
+constexpr uint8_t STATUS_COMMAND_DISALLOWED = 0x0C;  // HCI Command Disallowed, e.g. scanning before ready
+constexpr uint8_t STATUS_TIMEOUT = 0xFF;             // Not part of HCI, no completion within the command timeout
+
+struct CommandResult {
+    uint8_t status;
+    uint16_t handle;  // Connection handle, for commands that have one
+
+    bool ok() const { return status == STATUS_SUCCESS; }
+};
+
+// The outcome of an HCI command, resolved once from Bluetooth::process() when the
+// matching Command Complete, Command Status or follow-up event arrives, or when the
+// command times out. Either register a callback with then() or co_await it:
+//
+//     wiipp::Task pair(wiipp::Bluetooth* bt, wiipp::HCIInquiryResult board) {
+//         auto connected = co_await bt->connect(board);
+//         if (connected.ok()) {
+//             co_await bt->auth(connected.handle);
+//         }
+//     }
+class Completion {
+    struct State {
+        bool done{false};
+        CommandResult result{};
+        std::function<void(const CommandResult&)> callback;
+        std::coroutine_handle<> waiter;
+    };
+    std::shared_ptr<State> state;
+
+public:
+    Completion() : state(std::make_shared<State>()) {}
+
+    static Completion resolved(const CommandResult& result) {
+        Completion completion;
+        completion.resolve(result);
+        return completion;
+    }
+
+    bool done() const { return state->done; }
+    const CommandResult& result() const { return state->result; }
+
+    // Called once with the result, right away if the command already completed
+    void then(std::function<void(const CommandResult&)> callback) {
+        if (state->done) {
+            callback(state->result);
+        } else {
+            state->callback = std::move(callback);
+        }
+    }
+
+    // For Bluetooth implementations
+    void resolve(const CommandResult& result) {
+        auto keep = state;  // The awaiting coroutine may own the last other reference
+        if (keep->done) {
+            return;
+        }
+        keep->done = true;
+        keep->result = result;
+        if (keep->callback) {
+            keep->callback(keep->result);
+        }
+        if (keep->waiter) {
+            std::exchange(keep->waiter, nullptr).resume();
+        }
+    }
+
+    bool await_ready() const noexcept { return state->done; }
+    void await_suspend(std::coroutine_handle<> handle) { state->waiter = handle; }
+    CommandResult await_resume() const { return state->result; }
+};
+
+// Fire and forget coroutine. It runs until its first co_await right away and frees
+// itself when it finishes.
+struct Task {
+    struct promise_type {
+        Task get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+}  // namespace wiipp
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+#include "storage.h"
+
+namespace wiipp {
+
+struct KnownDevice {
+    uint64_t bdaddr;
+    uint32_t classOfDevice;
+    uint32_t lastUsed;  // Cache clock when last seen, the oldest entry makes room for a new one
+    std::array<char, 32> name;  // Zero terminated
+
+    std::string_view nameView() const { return {name.data(), strnlen(name.data(), name.size())}; }
+};
+
+// Remote names of devices seen before, so they can be connected without paging them for a
+// name first. Kept in a single Storage blob that is only written when a device is new or
+// its name changed.
+class DeviceCache {
+public:
+    static constexpr size_t CAPACITY = 16;
+    static constexpr const char* KEY = "devices";
+
+private:
+    static constexpr uint8_t VERSION = 1;
+
+    struct Blob {
+        uint8_t version;
+        uint8_t count;
+        uint32_t clock;
+        std::array<KnownDevice, CAPACITY> devices;
+    };
+
+    Storage* storage{nullptr};
+    Blob blob{VERSION, 0, 0, {}};
+
+    void save() {
+        if (storage != nullptr) {
+            storage->store(KEY, {reinterpret_cast<const uint8_t*>(&blob), sizeof(blob)});
+        }
+    }
+
+public:
+    // Replaces the cache with what `storage` holds and writes changes back there from now on
+    void load(Storage* from) {
+        storage = from;
+        blob = Blob{VERSION, 0, 0, {}};
+        if (storage == nullptr) {
+            return;
+        }
+        Blob loaded;
+        size_t size = storage->load(KEY, {reinterpret_cast<uint8_t*>(&loaded), sizeof(loaded)});
+        if (size == sizeof(loaded) && loaded.version == VERSION && loaded.count <= CAPACITY) {
+            blob = loaded;
+        }
+    }
+
+    const KnownDevice* find(uint64_t bdaddr) {
+        auto end = blob.devices.begin() + blob.count;
+        auto itr = std::find_if(blob.devices.begin(), end, [bdaddr](const KnownDevice& d) { return d.bdaddr == bdaddr; });
+        if (itr == end) {
+            return nullptr;
+        }
+        itr->lastUsed = ++blob.clock;
+        return &*itr;
+    }
+
+    void remember(uint64_t bdaddr, uint32_t classOfDevice, std::string_view name) {
+        KnownDevice device{.bdaddr = bdaddr, .classOfDevice = classOfDevice, .lastUsed = ++blob.clock, .name = {}};
+        std::copy_n(name.begin(), std::min(name.size(), device.name.size() - 1), device.name.begin());
+
+        auto end = blob.devices.begin() + blob.count;
+        auto itr = std::find_if(blob.devices.begin(), end, [bdaddr](const KnownDevice& d) { return d.bdaddr == bdaddr; });
+        if (itr != end) {
+            bool changed = itr->classOfDevice != classOfDevice || itr->nameView() != device.nameView();
+            *itr = device;
+            if (changed) {
+                save();
+            }
+            return;
+        }
+        if (blob.count < CAPACITY) {
+            blob.devices[blob.count++] = device;
+        } else {
+            *std::min_element(blob.devices.begin(), blob.devices.end(),
+                              [](const KnownDevice& a, const KnownDevice& b) { return a.lastUsed < b.lastUsed; }) = device;
+        }
+        save();
+    }
+};
+
+}  // namespace wiipp
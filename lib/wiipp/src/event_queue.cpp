@@ -0,0 +1,115 @@
+#include "event_queue.h"
+
+#include <stdexcept>
+
+namespace wiipp {
+
+EventQueue::EventQueue(size_t capacity, OverflowPolicy policy)
+    : m_cells(new Cell[capacity]), m_mask(capacity - 1), m_policy(policy) {
+    if (capacity < 2 || (capacity & (capacity - 1)) != 0) {
+        throw std::runtime_error("Event queue capacity must be a power of two");
+    }
+    for (size_t i = 0; i < capacity; ++i) {
+        m_cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+}
+
+// A cell is free for position `pos` when its sequence is `pos`, and holds the event of
+// `pos` once its sequence is `pos + 1`. Popping sets it to `pos + capacity`, the next lap.
+bool EventQueue::tryPush(const WiiEvent& event) {
+    size_t pos = m_enqueuePos.load(std::memory_order_relaxed);
+    while (true) {
+        Cell& cell = m_cells[pos & m_mask];
+        size_t sequence = cell.sequence.load(std::memory_order_acquire);
+        intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+        if (diff == 0) {
+            if (m_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                cell.event = event;
+                cell.sequence.store(pos + 1, std::memory_order_release);
+                break;
+            }
+        } else if (diff < 0) {
+            return false;  // Still holds the event from a lap ago, full
+        } else {
+            pos = m_enqueuePos.load(std::memory_order_relaxed);
+        }
+    }
+
+    m_pushed.fetch_add(1, std::memory_order_relaxed);
+    // The consumer can be past `pos` already
+    size_t dequeued = m_dequeuePos.load(std::memory_order_relaxed);
+    size_t depth = pos + 1 > dequeued ? pos + 1 - dequeued : 0;
+    size_t max = m_maxDepth.load(std::memory_order_relaxed);
+    while (depth > max && !m_maxDepth.compare_exchange_weak(max, depth, std::memory_order_relaxed)) {
+    }
+    return true;
+}
+
+void EventQueue::countDrop(const WiiEvent& event) {
+    m_dropped.fetch_add(1, std::memory_order_relaxed);
+    m_droppedByType[event.index()].fetch_add(1, std::memory_order_relaxed);
+}
+
+bool EventQueue::push(const WiiEvent& event) {
+    if (tryPush(event)) {
+        return true;
+    }
+    if (m_policy == OverflowPolicy::DropNewest) {
+        countDrop(event);
+        return false;
+    }
+    // Make room, the consumer may have made some meanwhile, then try again. Another
+    // producer can take the freed slot first, so give up after a few rounds.
+    for (int attempt = 0; attempt < 4; ++attempt) {
+        WiiEvent oldest;
+        if (pop(&oldest)) {
+            countDrop(oldest);
+        }
+        if (tryPush(event)) {
+            return true;
+        }
+    }
+    countDrop(event);
+    return false;
+}
+
+bool EventQueue::pop(WiiEvent* out) {
+    size_t pos = m_dequeuePos.load(std::memory_order_relaxed);
+    while (true) {
+        Cell& cell = m_cells[pos & m_mask];
+        size_t sequence = cell.sequence.load(std::memory_order_acquire);
+        intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos + 1);
+        if (diff == 0) {
+            if (m_dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                *out = cell.event;
+                cell.sequence.store(pos + m_mask + 1, std::memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            return false;  // Not written yet, empty
+        } else {
+            pos = m_dequeuePos.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+size_t EventQueue::size() const {
+    size_t enqueued = m_enqueuePos.load(std::memory_order_acquire);
+    size_t dequeued = m_dequeuePos.load(std::memory_order_acquire);
+    return enqueued > dequeued ? enqueued - dequeued : 0;
+}
+
+EventQueueStats EventQueue::stats() const {
+    EventQueueStats stats{
+        .pushed = m_pushed.load(std::memory_order_relaxed),
+        .dropped = m_dropped.load(std::memory_order_relaxed),
+        .droppedByType = {},
+        .maxDepth = m_maxDepth.load(std::memory_order_relaxed),
+    };
+    for (size_t i = 0; i < WIIEVENT_TYPES; ++i) {
+        stats.droppedByType[i] = m_droppedByType[i].load(std::memory_order_relaxed);
+    }
+    return stats;
+}
+
+}  // namespace wiipp
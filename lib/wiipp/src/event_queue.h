@@ -0,0 +1,100 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <variant>
+
+#include "wiipp.h"
+
+namespace wiipp {
+
+// Events are copied into the queue as they are, they must stay plain data
+static_assert(std::is_trivially_copyable_v<WiiEvent>, "WiiEvent alternatives must be trivially copyable");
+
+constexpr size_t WIIEVENT_TYPES = std::variant_size_v<WiiEvent>;
+
+// Position of T in WiiEvent, e.g. to look up EventQueueStats::droppedByType
+template <typename T, size_t I = 0>
+constexpr size_t eventIndex() {
+    if constexpr (std::is_same_v<std::variant_alternative_t<I, WiiEvent>, T>) {
+        return I;
+    } else {
+        return eventIndex<T, I + 1>();
+    }
+}
+
+// What push() does when the queue is full
+enum class OverflowPolicy : uint8_t {
+    DropNewest,  // The event being pushed is dropped
+    DropOldest,  // The oldest queued event is dropped to make room
+};
+
+struct EventQueueStats {
+    uint32_t pushed;   // Events that went into the queue
+    uint32_t dropped;  // Events lost to overflow, by either policy
+    std::array<uint32_t, WIIEVENT_TYPES> droppedByType;  // Indexed by WiiEvent::index()
+    size_t maxDepth;  // Most events queued at once
+};
+
+// Bounded lock-free queue of WiiEvents for handing them to another task or core, so slow
+// listeners do not hold up Bluetooth processing. Any number of producers may push; one
+// consumer pops. Slots carry a sequence number that a producer claims with a compare and
+// swap on the enqueue position, so neither side ever waits on a lock. The dequeue side is
+// safe against concurrent pops, DropOldest relies on that to pop from the producer side.
+//
+// There is no blocking pop, the consumer polls and sleeps or yields when it finds nothing.
+class EventQueue {
+    struct Cell {
+        std::atomic<size_t> sequence;
+        WiiEvent event;
+    };
+
+    std::unique_ptr<Cell[]> m_cells;
+    size_t m_mask;
+    OverflowPolicy m_policy;
+
+    alignas(32) std::atomic<size_t> m_enqueuePos{0};
+    alignas(32) std::atomic<size_t> m_dequeuePos{0};
+
+    alignas(32) std::atomic<uint32_t> m_pushed{0};
+    std::atomic<uint32_t> m_dropped{0};
+    std::array<std::atomic<uint32_t>, WIIEVENT_TYPES> m_droppedByType{};
+    std::atomic<size_t> m_maxDepth{0};
+
+    bool tryPush(const WiiEvent& event);
+    void countDrop(const WiiEvent& event);
+
+public:
+    // `capacity` must be a power of two
+    explicit EventQueue(size_t capacity, OverflowPolicy policy = OverflowPolicy::DropNewest);
+    EventQueue(EventQueue&) = delete;
+    EventQueue& operator=(const EventQueue&) = delete;
+
+    // Returns false when `event` itself was dropped
+    bool push(const WiiEvent& event);
+    // Returns false when the queue is empty
+    bool pop(WiiEvent* out);
+
+    // Pops up to `max` events into `f`, returns how many
+    template <typename F>
+    size_t drain(F&& f, size_t max = SIZE_MAX) {
+        WiiEvent event;
+        size_t count = 0;
+        while (count < max && pop(&event)) {
+            f(event);
+            count++;
+        }
+        return count;
+    }
+
+    size_t capacity() const { return m_mask + 1; }
+    // Only a snapshot while producers and the consumer are running
+    size_t size() const;
+    EventQueueStats stats() const;
+};
+
+}  // namespace wiipp
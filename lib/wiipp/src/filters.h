@@ -0,0 +1,186 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+
+namespace wiipp {
+
+enum class FilterType : uint8_t {
+    None,
+    MovingAverage,  // Mean of the last `window` samples
+    Exponential,    // y += alpha * (x - y)
+    Median,         // Median of the last `window` samples, drops single sample spikes
+    Kalman,         // 1D Kalman filter for a constant value with random walk
+};
+
+// Which BalanceBoardData events Wii emits once a filter is set
+enum class FilterOutput : uint8_t {
+    Filtered,  // Only filtered samples
+    Both,      // The raw sample followed by the filtered one
+};
+
+struct FilterConfig {
+    static constexpr uint8_t MAX_WINDOW = 15;
+
+    FilterType type{FilterType::None};
+    FilterOutput output{FilterOutput::Filtered};
+    uint8_t window{8};       // MovingAverage and Median, 1 to MAX_WINDOW samples
+    uint16_t alpha{0x2000};  // Exponential, weight of a new sample in Q16
+    uint32_t processNoise{100};      // Kalman, grams^2 the load may drift per sample
+    uint32_t measurementNoise{2500};  // Kalman, grams^2 of sensor noise
+};
+
+// One channel of integer samples. Every filter keeps fixed size state and costs a bounded
+// amount of work per sample, at most MAX_WINDOW steps for the median.
+class SampleFilter {
+    FilterConfig config;
+    bool primed{false};
+
+    // Moving average and median window, oldest sample at `next` once full
+    std::array<int32_t, FilterConfig::MAX_WINDOW> window{};
+    uint8_t count{0};
+    uint8_t next{0};
+    int32_t sum{0};
+
+    // Median, the window contents kept sorted
+    std::array<int32_t, FilterConfig::MAX_WINDOW> sorted{};
+
+    // Exponential state in Q8, Kalman estimate in Q8 and variance in grams^2
+    int32_t estimate{0};
+    uint32_t variance{0};
+
+    int32_t movingAverage(int32_t sample) {
+        if (count == config.window) {
+            sum -= window[next];
+        } else {
+            count++;
+        }
+        window[next] = sample;
+        next = (next + 1) % config.window;
+        sum += sample;
+        return sum / count;
+    }
+
+    int32_t median(int32_t sample) {
+        size_t size = count;
+        if (count == config.window) {
+            // Drop the oldest sample from the sorted copy
+            int32_t oldest = window[next];
+            auto at = std::lower_bound(sorted.begin(), sorted.begin() + size, oldest);
+            std::copy(at + 1, sorted.begin() + size, at);
+            size--;
+        } else {
+            count++;
+        }
+        window[next] = sample;
+        next = (next + 1) % config.window;
+
+        auto at = std::upper_bound(sorted.begin(), sorted.begin() + size, sample);
+        std::copy_backward(at, sorted.begin() + size, sorted.begin() + size + 1);
+        *at = sample;
+        return sorted[count / 2];
+    }
+
+    int32_t exponential(int32_t sample) {
+        if (!primed) {
+            estimate = sample << 8;
+            primed = true;
+        } else {
+            estimate += static_cast<int32_t>((int64_t{(sample << 8) - estimate} * config.alpha) >> 16);
+        }
+        return estimate >> 8;
+    }
+
+    int32_t kalman(int32_t sample) {
+        if (!primed) {
+            estimate = sample << 8;
+            variance = config.measurementNoise;
+            primed = true;
+            return sample;
+        }
+        uint32_t predicted = variance + config.processNoise;
+        // Gain in Q16
+        uint32_t gain = (uint64_t{predicted} << 16) / (uint64_t{predicted} + config.measurementNoise);
+        estimate += static_cast<int32_t>((int64_t{(sample << 8) - estimate} * gain) >> 16);
+        variance = (uint64_t{predicted} * (65536 - gain)) >> 16;
+        return estimate >> 8;
+    }
+
+public:
+    SampleFilter() = default;
+    explicit SampleFilter(const FilterConfig& config) { configure(config); }
+
+    void configure(const FilterConfig& filterConfig) {
+        *this = SampleFilter();
+        config = filterConfig;
+        config.window = std::clamp<uint8_t>(config.window, 1, FilterConfig::MAX_WINDOW);
+    }
+
+    int32_t add(int32_t sample) {
+        switch (config.type) {
+            case FilterType::MovingAverage:
+                return movingAverage(sample);
+            case FilterType::Exponential:
+                return exponential(sample);
+            case FilterType::Median:
+                return median(sample);
+            case FilterType::Kalman:
+                return kalman(sample);
+            case FilterType::None:
+                break;
+        }
+        return sample;
+    }
+};
+
+struct DeadBandConfig {
+    uint16_t sensorEpsilon{0};  // Grams any one sensor has to move, 0 to ignore sensors
+    uint16_t totalEpsilon{0};   // Grams the total has to move, 0 to ignore the total
+    uint32_t heartbeatMillis{1000};  // A sample gets through at least this often, 0 for never
+
+    bool enabled() const { return sensorEpsilon != 0 || totalEpsilon != 0; }
+};
+
+// Lets a sample through when it moved more than an epsilon away from the last one that got
+// through, or when the heartbeat is due. Everything passes while no epsilon is set.
+class DeadBand {
+    DeadBandConfig config;
+    bool primed{false};
+    std::array<int32_t, 4> last{};
+    uint64_t lastMicros{0};
+
+    static bool moved(int32_t value, int32_t from, uint16_t epsilon) {
+        return epsilon != 0 && (value > from + epsilon || value < from - epsilon);
+    }
+
+public:
+    void configure(const DeadBandConfig& deadBandConfig) {
+        *this = DeadBand();
+        config = deadBandConfig;
+    }
+
+    const DeadBandConfig& configuration() const { return config; }
+
+    bool pass(const std::array<int32_t, 4>& sample, uint64_t micros) {
+        if (!config.enabled()) {
+            return true;
+        }
+        bool due = !primed || (config.heartbeatMillis != 0 && micros - lastMicros >= uint64_t{config.heartbeatMillis} * 1000);
+        int32_t total = sample[0] + sample[1] + sample[2] + sample[3];
+        int32_t lastTotal = last[0] + last[1] + last[2] + last[3];
+        bool changed = moved(total, lastTotal, config.totalEpsilon);
+        for (size_t i = 0; i < sample.size() && !changed; ++i) {
+            changed = moved(sample[i], last[i], config.sensorEpsilon);
+        }
+        if (!due && !changed) {
+            return false;
+        }
+        primed = true;
+        last = sample;
+        lastMicros = micros;
+        return true;
+    }
+};
+
+}  // namespace wiipp
@@ -0,0 +1,172 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+namespace wiipp {
+
+// What an input report is for, Data covers the reporting modes 0x30 to 0x3F
+enum class ReportKind : uint8_t {
+    Unknown,
+    Status,       // 0x20
+    ReadReply,    // 0x21
+    Acknowledge,  // 0x22
+    Data,
+    COUNT,
+};
+
+// Where the parts of an input report are, as offsets from its 0xA1 prefix. A size of 0 means
+// the report does not have that part.
+struct ReportLayout {
+    ReportKind kind;
+    uint8_t size;  // Whole report, 0xA1 and the report ID included
+    uint8_t buttons;  // Core buttons, two bytes, in every report but 0x3D
+    bool hasButtons;
+    uint8_t accelerometer;  // Three bytes, the low bits are in the button bytes
+    bool hasAccelerometer;
+    uint8_t ir;
+    uint8_t irSize;
+    uint8_t extension;
+    uint8_t extensionSize;
+};
+
+constexpr uint8_t FIRST_INPUT_REPORT = 0x20;
+constexpr size_t INPUT_REPORT_COUNT = 0x20;  // 0x20 to 0x3F
+
+constexpr ReportLayout inputReportLayout(uint8_t id) {
+    // Reports with buttons start them right after the ID, and everything else follows
+    // in the order accelerometer, IR, extension
+    auto data = [](uint8_t accelerometer, uint8_t ir, uint8_t extension) {
+        uint8_t offset = 4;
+        ReportLayout layout{ReportKind::Data, 0, 2, true, 0, false, 0, 0, 0, 0};
+        if (accelerometer) {
+            layout.accelerometer = offset;
+            layout.hasAccelerometer = true;
+            offset += 3;
+        }
+        layout.ir = ir ? offset : 0;
+        layout.irSize = ir;
+        offset += ir;
+        layout.extension = extension ? offset : 0;
+        layout.extensionSize = extension;
+        offset += extension;
+        layout.size = offset;
+        return layout;
+    };
+    switch (id) {
+        case 0x20:
+            return {ReportKind::Status, 8, 2, true, 0, false, 0, 0, 0, 0};
+        case 0x21:
+            return {ReportKind::ReadReply, 23, 2, true, 0, false, 0, 0, 0, 0};
+        case 0x22:
+            return {ReportKind::Acknowledge, 6, 2, true, 0, false, 0, 0, 0, 0};
+        case 0x30:
+            return data(0, 0, 0);
+        case 0x31:
+            return data(3, 0, 0);
+        case 0x32:
+            return data(0, 0, 8);
+        case 0x33:
+            return data(3, 12, 0);
+        case 0x34:
+            return data(0, 0, 19);
+        case 0x35:
+            return data(3, 0, 16);
+        case 0x36:
+            return data(0, 10, 9);
+        case 0x37:
+            return data(3, 10, 6);
+        case 0x3D:
+            return {ReportKind::Data, 23, 0, false, 0, false, 0, 0, 2, 21};
+        case 0x3E:
+        case 0x3F:
+            // Interleaved halves of the full IR format, with one accelerometer axis each
+            return {ReportKind::Data, 23, 2, true, 0, false, 5, 18, 0, 0};
+    }
+    return {ReportKind::Unknown, 0, 0, false, 0, false, 0, 0, 0, 0};
+}
+
+// Layouts of 0x20 to 0x3F indexed by ID - FIRST_INPUT_REPORT, built at compile time
+inline constexpr auto INPUT_REPORT_LAYOUTS = [] {
+    std::array<ReportLayout, INPUT_REPORT_COUNT> layouts{};
+    for (size_t i = 0; i < layouts.size(); ++i) {
+        layouts[i] = inputReportLayout(static_cast<uint8_t>(FIRST_INPUT_REPORT + i));
+    }
+    return layouts;
+}();
+
+// Whether the table has `id` at the given offsets and sizes, an accelerometer offset of 0 for
+// none. Used to check it against the report formats listed on wiibrew.
+constexpr bool hasLayout(uint8_t id, uint8_t size, uint8_t accelerometer, uint8_t ir, uint8_t irSize,
+                         uint8_t extension, uint8_t extensionSize) {
+    const ReportLayout& layout = INPUT_REPORT_LAYOUTS[id - FIRST_INPUT_REPORT];
+    return layout.kind == ReportKind::Data && layout.size == size && layout.hasAccelerometer == (accelerometer != 0) &&
+           layout.accelerometer == accelerometer && layout.ir == ir && layout.irSize == irSize &&
+           layout.extension == extension && layout.extensionSize == extensionSize;
+}
+
+static_assert(hasLayout(0x30, 4, 0, 0, 0, 0, 0));
+static_assert(hasLayout(0x31, 7, 4, 0, 0, 0, 0));
+static_assert(hasLayout(0x32, 12, 0, 0, 0, 4, 8));
+static_assert(hasLayout(0x33, 19, 4, 7, 12, 0, 0));
+static_assert(hasLayout(0x34, 23, 0, 0, 0, 4, 19));
+static_assert(hasLayout(0x35, 23, 4, 0, 0, 7, 16));
+static_assert(hasLayout(0x36, 23, 0, 4, 10, 14, 9));
+static_assert(hasLayout(0x37, 23, 4, 7, 10, 17, 6));
+static_assert(hasLayout(0x3D, 23, 0, 0, 0, 2, 21));
+static_assert(hasLayout(0x3E, 23, 0, 5, 18, 0, 0));
+static_assert(hasLayout(0x3F, 23, 0, 5, 18, 0, 0));
+static_assert(!INPUT_REPORT_LAYOUTS[0x3D - FIRST_INPUT_REPORT].hasButtons);
+
+struct InputReport {
+    uint8_t id;
+    ReportKind kind;
+    uint16_t buttons;  // Core buttons only, the accelerometer bits masked out
+    std::array<uint16_t, 3> acceleration;  // 10 bit x, y and z, zero when the report has none
+    std::span<const uint8_t> report;  // All of it, from the 0xA1 prefix
+    std::span<const uint8_t> ir;
+    std::span<const uint8_t> extension;
+};
+
+constexpr uint16_t CORE_BUTTONS = 0x1F9F;
+
+// Splits an input report, 0xA1 prefix included, into its parts by table lookup. False for
+// anything that is not a known input report or is too short for its layout.
+inline bool decodeInputReport(std::span<const uint8_t> data, InputReport* out) {
+    if (data.size() < 2 || data[0] != 0xA1) {
+        return false;
+    }
+    size_t index = static_cast<uint8_t>(data[1] - FIRST_INPUT_REPORT);
+    if (index >= INPUT_REPORT_COUNT) {
+        return false;
+    }
+    const ReportLayout& layout = INPUT_REPORT_LAYOUTS[index];
+    if (layout.kind == ReportKind::Unknown || data.size() < layout.size) {
+        return false;
+    }
+    out->id = data[1];
+    out->kind = layout.kind;
+    out->report = data.first(layout.size);
+    out->ir = data.subspan(layout.ir, layout.irSize);
+    out->extension = data.subspan(layout.extension, layout.extensionSize);
+    out->buttons = 0;
+    out->acceleration = {};
+    if (layout.hasButtons) {
+        out->buttons = (data[layout.buttons] << 8 | data[layout.buttons + 1]) & CORE_BUTTONS;
+    }
+    if (layout.hasAccelerometer) {
+        const uint8_t* b = data.data() + layout.buttons;
+        const uint8_t* a = data.data() + layout.accelerometer;
+        // x has two low bits in the first button byte, y and z one each in the second
+        out->acceleration = {
+            static_cast<uint16_t>(a[0] << 2 | ((b[0] >> 5) & 0x03)),
+            static_cast<uint16_t>(a[1] << 2 | ((b[1] >> 4) & 0x02)),
+            static_cast<uint16_t>(a[2] << 2 | ((b[1] >> 5) & 0x02)),
+        };
+    }
+    return true;
+}
+
+}  // namespace wiipp
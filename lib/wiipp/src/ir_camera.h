@@ -0,0 +1,102 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+namespace wiipp {
+
+// One of the four IR sources the Wii remote camera tracks, in camera pixels, x 0-1023 and
+// y 0-767. Slots without a source come in as all ones and are not visible.
+struct IrDot {
+    uint16_t x;
+    uint16_t y;
+    uint8_t size;  // 0-15, extended format only
+    bool visible;
+};
+
+using IrDots = std::array<IrDot, 4>;
+
+// Camera data formats, as written to register 0xB00033. Reports 0x36 and 0x37 have room for
+// the 10 byte basic format, 0x33 for the 12 byte extended one. Full needs the interleaved
+// 0x3E/0x3F reports and is not decoded.
+enum class IrFormat : uint8_t {
+    Basic = 1,
+    Extended = 3,
+    Full = 5,
+};
+
+constexpr size_t IR_BASIC_SIZE = 10;
+constexpr size_t IR_EXTENDED_SIZE = 12;
+
+constexpr IrFormat irFormatFor(uint8_t reportingMode) {
+    return reportingMode == 0x33 ? IrFormat::Extended : IrFormat::Basic;
+}
+
+// Camera sensitivity for 0xB00000 and 0xB0001A. Not one of the five Wii levels but the
+// widely used custom high sensitivity block, which picks up dimmer sources than any of them.
+// Wii level 3 would be 02 00 00 71 01 00 AA 00 64 and 63 03.
+constexpr std::array<uint8_t, 9> IR_SENSITIVITY_BLOCK1 = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x90, 0x00, 0xC0};
+constexpr std::array<uint8_t, 2> IR_SENSITIVITY_BLOCK2 = {0x40, 0x00};
+
+// Where each dot's bits are in the IR bytes of a report. Every coordinate is a low byte
+// plus two high bits from a shared byte, so both formats go through the same code and only
+// the offsets and shifts differ.
+struct IrLayout {
+    std::array<uint8_t, 4> x;       // Low 8 bits of x
+    std::array<uint8_t, 4> y;       // Low 8 bits of y
+    std::array<uint8_t, 4> high;    // Byte with the high bits, and the size in extended
+    std::array<uint8_t, 4> xShift;  // Of the two high x bits in `high`
+    std::array<uint8_t, 4> yShift;
+    uint8_t sizeMask;
+};
+
+// Two groups of 5 bytes, x1 y1 (y1 x1 y2 x2 high bits) x2 y2
+constexpr IrLayout IR_BASIC_LAYOUT = {
+    .x = {0, 3, 5, 8},
+    .y = {1, 4, 6, 9},
+    .high = {2, 2, 7, 7},
+    .xShift = {4, 0, 4, 0},
+    .yShift = {6, 2, 6, 2},
+    .sizeMask = 0x00,
+};
+
+// 3 bytes per dot, x y (y x high bits, size)
+constexpr IrLayout IR_EXTENDED_LAYOUT = {
+    .x = {0, 3, 6, 9},
+    .y = {1, 4, 7, 10},
+    .high = {2, 5, 8, 11},
+    .xShift = {4, 4, 4, 4},
+    .yShift = {6, 6, 6, 6},
+    .sizeMask = 0x0F,
+};
+
+// Unpacks all four dots of one format in a fixed loop without a branch. With the layout a
+// constant the loop unrolls into straight shifts and masks.
+template <const IrLayout& layout>
+inline void decodeIr(const uint8_t* in, IrDots& out) {
+    for (size_t i = 0; i < 4; ++i) {
+        uint8_t high = in[layout.high[i]];
+        uint16_t x = in[layout.x[i]] | ((high >> layout.xShift[i]) & 0x03) << 8;
+        uint16_t y = in[layout.y[i]] | ((high >> layout.yShift[i]) & 0x03) << 8;
+        out[i] = IrDot{
+            .x = x,
+            .y = y,
+            .size = static_cast<uint8_t>(high & layout.sizeMask),
+            .visible = y < 768,
+        };
+    }
+}
+
+// The format is picked once per report by the size of `ir`, which must be IR_BASIC_SIZE or
+// IR_EXTENDED_SIZE bytes
+inline void decodeIr(std::span<const uint8_t> ir, IrDots& out) {
+    if (ir.size() == IR_EXTENDED_SIZE) {
+        decodeIr<IR_EXTENDED_LAYOUT>(ir.data(), out);
+    } else {
+        decodeIr<IR_BASIC_LAYOUT>(ir.data(), out);
+    }
+}
+
+}  // namespace wiipp
@@ -0,0 +1,156 @@
+#include "memory_access.h"
+
+#include <algorithm>
+#include <utility>
+
+#include "log.h"
+
+namespace wiipp {
+
+void MemoryAccess::attach(Bluetooth* bluetooth, uint16_t connection) {
+    bt = bluetooth;
+    handle = connection;
+    clear();
+}
+
+void MemoryAccess::clear() {
+    for (size_t i = 0; i < count; ++i) {
+        at(i).callback = nullptr;
+    }
+    head = count = sent = 0;
+    reading = false;
+}
+
+bool MemoryAccess::read(uint8_t space, uint32_t address, uint16_t size, Callback callback) {
+    if (size == 0 || size > MAX_READ) {
+        log_e("Cannot read %u bytes, at most %zu", size, MAX_READ);
+        return false;
+    }
+    return push(Request{.read = true, .space = space, .address = address, .size = size, .received = 0, .data = {},
+                        .callback = std::move(callback), .deadline = 0});
+}
+
+bool MemoryAccess::write(uint8_t space, uint32_t address, std::span<const uint8_t> data, Callback callback) {
+    if (data.size() == 0 || data.size() > MAX_WRITE) {
+        log_e("Cannot write %zu bytes, at most %zu", data.size(), MAX_WRITE);
+        return false;
+    }
+    Request request{.read = false, .space = space, .address = address, .size = static_cast<uint16_t>(data.size()),
+                    .received = 0, .data = {}, .callback = std::move(callback), .deadline = 0};
+    std::copy(data.begin(), data.end(), request.data.begin());
+    return push(std::move(request));
+}
+
+bool MemoryAccess::push(Request&& request) {
+    if (count == QUEUE_SIZE) {
+        log_e("Memory request queue full");
+        return false;
+    }
+    at(count++) = std::move(request);
+    pump();
+    return true;
+}
+
+void MemoryAccess::send(Request& request) {
+    uint8_t report[23] = {
+        0xA2,
+        static_cast<uint8_t>(request.read ? 0x17 : 0x16),
+        request.space,
+        static_cast<uint8_t>((request.address >> 16) & 0xFF),
+        static_cast<uint8_t>((request.address >> 8) & 0xFF),
+        static_cast<uint8_t>(request.address & 0xFF),
+    };
+    if (request.read) {
+        report[6] = request.size >> 8;
+        report[7] = request.size & 0xFF;
+        bt->l2send_data(handle, 0x0013, report, 8);
+    } else {
+        report[6] = request.size;
+        std::copy_n(request.data.begin(), request.size, report + 7);
+        bt->l2send_data(handle, 0x0013, report, sizeof(report));
+    }
+}
+
+void MemoryAccess::pump() {
+    while (sent < count && !reading) {
+        Request& request = at(sent++);
+        reading = request.read;
+        send(request);
+    }
+}
+
+void MemoryAccess::complete(uint8_t error) {
+    Request& request = at(0);
+    Callback callback = std::move(request.callback);
+    std::array<uint8_t, MAX_READ> data = request.data;
+    uint16_t size = request.read ? request.received : 0;
+    // Only a read holds back the requests behind it, a write may finish while one is out
+    if (request.read) {
+        reading = false;
+    }
+    head = (head + 1) % QUEUE_SIZE;
+    count--;
+    sent--;
+    pump();
+    // Called last, so it can queue more requests
+    if (callback) {
+        callback(error, {data.data(), size});
+    }
+}
+
+bool MemoryAccess::receive(std::span<const uint8_t> report) {
+    if (report.size() < 6 || report[0] != 0xA1 || (report[1] != 0x21 && report[1] != 0x22)) {
+        return false;
+    }
+    if (sent == 0) {
+        log_w("Unexpected memory reply %02X", report[1]);
+        return true;
+    }
+    Request& request = at(0);
+
+    if (report[1] == 0x22) {
+        // Acknowledgements of other output reports are of no interest here
+        if (report[4] == 0x16 && !request.read) {
+            complete(report[5]);
+        }
+        return true;
+    }
+
+    if (report.size() < 23 || !request.read) {
+        log_w("Unexpected read reply");
+        return true;
+    }
+    uint8_t error = report[4] & 0x0F;
+    uint16_t size = (report[4] >> 4) + 1;
+    uint16_t offset = static_cast<uint16_t>((report[5] << 8 | report[6]) - request.address);
+    if (error != 0) {
+        complete(error);
+        return true;
+    }
+    if (offset != request.received || offset + size > request.size) {
+        log_w("Read reply for offset %u, expected %u", offset, request.received);
+        complete(ERROR_BAD_REPLY);
+        return true;
+    }
+    std::copy_n(report.begin() + 7, size, request.data.begin() + offset);
+    request.received += size;
+    if (request.received == request.size) {
+        complete(0);
+    }
+    return true;
+}
+
+void MemoryAccess::poll(uint64_t micros) {
+    if (sent == 0) {
+        return;
+    }
+    Request& request = at(0);
+    if (request.deadline == 0) {
+        request.deadline = micros + TIMEOUT_MICROS;
+    } else if (micros >= request.deadline) {
+        log_w("Memory %s of %06X timed out", request.read ? "read" : "write", static_cast<unsigned>(request.address));
+        complete(ERROR_TIMEOUT);
+    }
+}
+
+}  // namespace wiipp
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <span>
+#include <utility>
+
+#include "bluetooth.h"
+
+namespace wiipp {
+
+// Memory and register access of one Wii remote or balance board: writes (output report 0x16)
+// and reads (0x17) in a queue, matched to their acknowledgements (input report 0x22) and
+// read replies (0x21). Writes go out back to back. A read is only sent once everything before
+// it is out and holds back what follows until its last reply is in, as the remote does not
+// take a new request while it is answering a read. Replies of up to MAX_READ bytes are put
+// together from their 16 byte reports. A request the device does not answer within
+// TIMEOUT_MICROS of reaching the front of the queue fails, so the ones behind it still go out.
+class MemoryAccess {
+public:
+    static constexpr uint8_t EEPROM = 0x00;
+    static constexpr uint8_t REGISTERS = 0x04;
+    static constexpr size_t QUEUE_SIZE = 8;
+    static constexpr size_t MAX_READ = 64;
+    static constexpr size_t MAX_WRITE = 16;
+    static constexpr uint64_t TIMEOUT_MICROS = 1000000;
+
+    // Failures of our own, outside the error codes the device sends
+    static constexpr uint8_t ERROR_BAD_REPLY = 0xFE;  // A read reply for another address
+    static constexpr uint8_t ERROR_TIMEOUT = 0xFF;
+
+    // `error` is 0 on success, the error of the 0x21 or 0x22 reply or one of the above
+    // otherwise. `data` is only valid during the call and empty for writes.
+    using Callback = std::function<void(uint8_t error, std::span<const uint8_t> data)>;
+
+private:
+    struct Request {
+        bool read;
+        uint8_t space;
+        uint32_t address;
+        uint16_t size;
+        uint16_t received;
+        std::array<uint8_t, MAX_READ> data;
+        Callback callback;
+        uint64_t deadline;  // Set by poll() once the request is sent and at the front, 0 before
+    };
+
+    Bluetooth* bt{nullptr};
+    uint16_t handle{0};
+    std::array<Request, QUEUE_SIZE> requests;
+    size_t head{0};
+    size_t count{0};
+    size_t sent{0};  // Requests from head on that went out
+    bool reading{false};
+
+    Request& at(size_t index) { return requests[(head + index) % QUEUE_SIZE]; }
+    bool push(Request&& request);
+    void send(Request& request);
+    void pump();
+    void complete(uint8_t error);
+
+public:
+    // Starts over for the connection `handle`, dropping whatever was queued without callbacks
+    void attach(Bluetooth* bluetooth, uint16_t connection);
+    void clear();
+
+    // Return false when the queue is full or the request too large
+    bool read(uint8_t space, uint32_t address, uint16_t size, Callback callback);
+    bool write(uint8_t space, uint32_t address, std::span<const uint8_t> data, Callback callback = {});
+    bool write(uint8_t space, uint32_t address, std::initializer_list<uint8_t> data, Callback callback = {}) {
+        return write(space, address, std::span<const uint8_t>(data.begin(), data.size()), std::move(callback));
+    }
+
+    // Takes 0x21 and 0x22 reports, returns false for any other report
+    bool receive(std::span<const uint8_t> report);
+    // Fails the request at the front once it is overdue, `micros` is a monotonic clock
+    void poll(uint64_t micros);
+};
+
+}  // namespace wiipp
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <span>
+
+namespace wiipp {
+
+// Small persistent blobs by key, for what Wii remembers across restarts. Keys are at most
+// 15 characters, the NVS limit.
+class Storage {
+public:
+    virtual ~Storage() {}
+
+    // Copies the value into `out` and returns its size, 0 if there is no value or it does
+    // not fit
+    virtual size_t load(const char* key, std::span<uint8_t> out) = 0;
+    virtual bool store(const char* key, std::span<const uint8_t> value) = 0;
+    virtual void erase(const char* key) = 0;
+};
+
+// A fixed size value per device, one Storage entry each so updating a device writes only
+// its own entry. Keys are a prefix of at most 3 characters and the address in hex. Without
+// storage nothing is found and nothing is kept.
+template <typename T>
+class DeviceStore {
+    const char* prefix;
+    Storage* storage{nullptr};
+
+    std::array<char, 16> key(uint64_t bdaddr) const {
+        std::array<char, 16> name;
+        snprintf(name.data(), name.size(), "%.3s%012llx", prefix,
+                 static_cast<unsigned long long>(bdaddr & 0xFFFFFFFFFFFFull));
+        return name;
+    }
+
+public:
+    explicit DeviceStore(const char* prefix) : prefix(prefix) {}
+
+    void setStorage(Storage* to) { storage = to; }
+
+    bool find(uint64_t bdaddr, T* out) const {
+        return storage != nullptr &&
+               storage->load(key(bdaddr).data(), {reinterpret_cast<uint8_t*>(out), sizeof(T)}) == sizeof(T);
+    }
+
+    void remember(uint64_t bdaddr, const T& value) {
+        if (storage != nullptr) {
+            storage->store(key(bdaddr).data(), {reinterpret_cast<const uint8_t*>(&value), sizeof(T)});
+        }
+    }
+
+    void forget(uint64_t bdaddr) {
+        if (storage != nullptr) {
+            storage->erase(key(bdaddr).data());
+        }
+    }
+};
+
+}  // namespace wiipp
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <cstdint>
+
+namespace wiipp {
+
+// Posture metrics for one balance board, updated with every sample. Lengths are in
+// tenths of a millimetre from the centre of the board, x to the right and y to the front.
+struct BalanceBoardMetrics {
+    uint16_t handle;
+    int32_t weight;         // Grams, the sum of the four sensors
+    bool onBoard;           // Enough weight for a centre of pressure, the rest is only valid when set
+    int16_t copX;           // Centre of pressure
+    int16_t copY;
+    uint32_t pathLength;    // Distance the centre of pressure travelled since the last reset
+    uint32_t meanVelocity;  // pathLength per second, in 0.1 mm/s
+    uint32_t swayArea;      // 95% confidence ellipse of the centre of pressure, mm^2
+    uint32_t samples;       // Samples with someone on the board since the last reset
+};
+
+// Accumulates BalanceBoardMetrics in integer arithmetic. Per sample it costs two divides
+// for the centre of pressure and two integer square roots, one for the step length and
+// one for the ellipse area.
+class SwayMetrics {
+public:
+    // Sensor spacing of the balance board, in 0.1 mm
+    static constexpr int32_t SENSOR_SPACING_X = 4330;
+    static constexpr int32_t SENSOR_SPACING_Y = 2380;
+    // Below this there is nobody on the board and the centre of pressure is noise
+    static constexpr int32_t MIN_WEIGHT = 2000;
+
+private:
+    uint32_t samples{0};
+    int32_t originX{0};  // First centre of pressure, sums are kept relative to it to stay small
+    int32_t originY{0};
+    bool hasLast{false};  // Previous sample had someone on the board, no step across stepping off
+    int32_t lastX{0};
+    int32_t lastY{0};
+    int64_t sumX{0};
+    int64_t sumY{0};
+    int64_t sumXX{0};
+    int64_t sumYY{0};
+    int64_t sumXY{0};
+    uint64_t pathLength{0};  // Q4, whole units lose too much to rounding on small steps
+    uint64_t firstMicros{0};
+    uint64_t lastMicros{0};
+
+    static uint64_t isqrt(uint64_t value) {
+        uint64_t result = 0;
+        uint64_t bit = uint64_t{1} << 62;
+        while (bit > value) {
+            bit >>= 2;
+        }
+        while (bit != 0) {
+            if (value >= result + bit) {
+                value -= result + bit;
+                result = (result >> 1) + bit;
+            } else {
+                result >>= 1;
+            }
+            bit >>= 2;
+        }
+        return result;
+    }
+
+    // Area of the 95% confidence ellipse, pi * chi2(2, 0.95) * sqrt(det(covariance))
+    uint32_t area() const {
+        if (samples < 2) {
+            return 0;
+        }
+        // Means in Q4 and (co)variances in Q8, of 0.1 mm and 0.01 mm^2
+        int64_t n = samples;
+        int64_t meanX = (sumX << 4) / n;
+        int64_t meanY = (sumY << 4) / n;
+        int64_t varX = (sumXX << 8) / n - meanX * meanX;
+        int64_t varY = (sumYY << 8) / n - meanY * meanY;
+        int64_t covXY = (sumXY << 8) / n - meanX * meanY;
+        int64_t det = varX * varY - covXY * covXY;
+        if (det <= 0) {
+            return 0;
+        }
+        // sqrt(det) is in Q8 of 0.01 mm^2, pi * 5.991 = 18.82 is 4818 in Q8
+        return static_cast<uint32_t>(((isqrt(det) * 4818) >> 16) / 100);
+    }
+
+public:
+    void reset() { *this = SwayMetrics(); }
+
+    void add(BalanceBoardMetrics* out, int32_t tr, int32_t br, int32_t tl, int32_t bl, uint64_t micros) {
+        int32_t weight = tr + br + tl + bl;
+        out->weight = weight;
+        out->onBoard = weight >= MIN_WEIGHT;
+        if (!out->onBoard) {
+            out->copX = out->copY = 0;
+            hasLast = false;
+        } else {
+            int32_t x = static_cast<int32_t>(int64_t{(tr + br) - (tl + bl)} * (SENSOR_SPACING_X / 2) / weight);
+            int32_t y = static_cast<int32_t>(int64_t{(tr + tl) - (br + bl)} * (SENSOR_SPACING_Y / 2) / weight);
+            out->copX = x;
+            out->copY = y;
+
+            if (samples == 0) {
+                originX = x;
+                originY = y;
+                firstMicros = micros;
+            }
+            if (hasLast) {
+                int64_t dx = x - lastX;
+                int64_t dy = y - lastY;
+                pathLength += isqrt((dx * dx + dy * dy) << 8);
+            }
+            hasLast = true;
+            lastX = x;
+            lastY = y;
+            lastMicros = micros;
+
+            int64_t rx = x - originX;
+            int64_t ry = y - originY;
+            sumX += rx;
+            sumY += ry;
+            sumXX += rx * rx;
+            sumYY += ry * ry;
+            sumXY += rx * ry;
+            samples++;
+        }
+
+        uint64_t elapsed = lastMicros - firstMicros;
+        out->pathLength = static_cast<uint32_t>(pathLength >> 4);
+        out->meanVelocity = elapsed ? static_cast<uint32_t>((pathLength >> 4) * 1000000 / elapsed) : 0;
+        out->swayArea = area();
+        out->samples = samples;
+    }
+};
+
+}  // namespace wiipp
@@ -1,25 +1,214 @@
 #include "wiipp.h"
 #include "log.h"
 
+#include "balance_board.h"
 #include "bluetooth.h"
+#include "event_queue.h"
+#include "hid_reports.h"
+#include "ir_camera.h"
+#include "memory_access.h"
 
+#include <algorithm>
 #include <bitset>
 #include <array>
+#include <chrono>
 #include <cstring>
+#include <utility>
 #include "utils.h"
 
 namespace wiipp {
 
+constexpr std::string_view BALANCE_BOARD_NAME = "Nintendo RVL-WBC-01";
+constexpr std::string_view WIIMOTE_NAME = "Nintendo RVL-CNT-01";
+
+static bool isWiiDevice(std::string_view name) {
+    return name == BALANCE_BOARD_NAME || name == WIIMOTE_NAME;
+}
+
+static uint64_t now() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 class Wii::BalanceBoard {
+    // Samples summed up for a subscriber below the full rate. The dead-band holds back
+    // averages that barely moved, so it sees what the subscriber would get.
+    struct Window {
+        std::array<uint32_t, 4> sums{};
+        uint32_t temperature{0};
+        uint32_t count{0};
+        uint64_t deadline{0};
+        DeadBand deadBand;
+    };
+
     Bluetooth *bt;
-    int queryState;
+    DeviceStore<StoredCalibration>& calibrations;
+    const std::vector<Subscriber>& subscribers;
+    std::vector<Window> windows;  // One per subscriber, in the same order
+    FilterConfig filterConfig;
+    std::array<SampleFilter, 4> filters;
+    DeadBand deadBand;  // For full rate subscribers, the averaging ones have their own
+    bool metricsEnabled;
+    SwayMetrics metrics;
+    MemoryAccess memory;
+    bool settingUp;  // Extension setup and calibration underway
     uint16_t handle;
+    uint64_t bdaddr;  // 0 when unknown, the calibration is then neither cached nor looked up
     std::array<uint16_t, 12> calibration;
 
     uint8_t referenceTemperature{0};
-  
+
+    bool consumed() const {
+        return metricsEnabled || std::any_of(subscribers.begin(), subscribers.end(),
+                                             [](const Subscriber& s) { return s.samples; });
+    }
+
+    void average(Window& window, const Subscriber& subscriber, const BalanceBoardData& data,
+                 const BalanceBoardMetrics& latest, uint64_t micros) {
+        if (window.count == 0 && micros >= window.deadline) {
+            window.deadline = micros + subscriber.intervalMicros;
+        }
+        window.sums[0] += data.tr;
+        window.sums[1] += data.br;
+        window.sums[2] += data.tl;
+        window.sums[3] += data.bl;
+        window.temperature += data.temperature;
+        window.count++;
+        if (micros < window.deadline) {
+            return;
+        }
+
+        uint32_t half = window.count / 2;
+        BalanceBoardData out = data;
+        out.tr = (window.sums[0] + half) / window.count;
+        out.br = (window.sums[1] + half) / window.count;
+        out.tl = (window.sums[2] + half) / window.count;
+        out.bl = (window.sums[3] + half) / window.count;
+        out.temperature = (window.temperature + half) / window.count;
+        // Keep to the grid unless we fell more than a whole interval behind
+        window.deadline += subscriber.intervalMicros;
+        if (window.deadline <= micros) {
+            window.deadline = micros + subscriber.intervalMicros;
+        }
+        window.sums = {};
+        window.temperature = 0;
+        window.count = 0;
+        if (!window.deadBand.pass({out.tr, out.br, out.tl, out.bl}, micros)) {
+            return;
+        }
+        subscriber.listener(out);
+        if (metricsEnabled) {
+            subscriber.listener(latest);
+        }
+    }
+
 public:
-    BalanceBoard(Bluetooth *bt, uint16_t handle) : bt(bt), handle(handle), queryState(0) {
+    BalanceBoard(Bluetooth *bt, DeviceStore<StoredCalibration>& calibrations, const std::vector<Subscriber>& subscribers)
+        : bt(bt), calibrations(calibrations), subscribers(subscribers), windows(subscribers.size()),
+          metricsEnabled(false), settingUp(false), handle(0), bdaddr(0) {
+    }
+
+    // Starts over for a newly connected board, without giving up any memory
+    void connect(uint16_t handle, uint64_t bdaddr, const FilterConfig& filterConfig,
+                 const DeadBandConfig& deadBandConfig, bool metricsEnabled) {
+        this->handle = handle;
+        this->bdaddr = bdaddr;
+        settingUp = false;
+        memory.attach(bt, handle);
+        calibration = {};
+        referenceTemperature = 0;
+        converter = {};
+        std::fill(windows.begin(), windows.end(), Window{});
+        setFilter(filterConfig);
+        setDeadBand(deadBandConfig);
+        setMetrics(metricsEnabled);
+    }
+
+    // DataSink for the interrupt channel, input reports come straight here
+    static void receive(void* context, uint16_t handle, std::span<const uint8_t> data) {
+        static_cast<BalanceBoard*>(context)->receive(data);
+    }
+
+    void receive(std::span<const uint8_t> data) {
+        BalanceBoardData out;
+        if (!onData(&out, data, consumed())) {
+            return;
+        }
+        BalanceBoardData raw = out;
+        if (filterConfig.type != FilterType::None) {
+            out.tr = filters[0].add(out.tr);
+            out.br = filters[1].add(out.br);
+            out.tl = filters[2].add(out.tl);
+            out.bl = filters[3].add(out.bl);
+            out.filtered = true;
+        }
+
+        uint64_t micros = now();
+        // Metrics follow the filtered sample when a filter is set, and see every sample
+        BalanceBoardMetrics latest;
+        if (metricsEnabled) {
+            latest.handle = handle;
+            metrics.add(&latest, out.tr, out.br, out.tl, out.bl, micros);
+        }
+        // Averages take in every sample and are dead-banded once they are due
+        bool passed = deadBand.pass({out.tr, out.br, out.tl, out.bl}, micros);
+        // Unfiltered samples only go to full rate subscribers, the others average filtered ones
+        if (passed && out.filtered && filterConfig.output == FilterOutput::Both) {
+            for (const auto& subscriber : subscribers) {
+                if (subscriber.samples && subscriber.intervalMicros == 0) {
+                    subscriber.listener(raw);
+                }
+            }
+        }
+        for (size_t i = 0; i < subscribers.size(); ++i) {
+            const auto& subscriber = subscribers[i];
+            if (!subscriber.samples) {
+                continue;
+            }
+            if (subscriber.intervalMicros != 0) {
+                average(windows[i], subscriber, out, latest, micros);
+                continue;
+            }
+            if (!passed) {
+                continue;
+            }
+            subscriber.listener(out);
+            if (metricsEnabled) {
+                subscriber.listener(latest);
+            }
+        }
+    }
+
+    void poll(uint64_t micros) {
+        memory.poll(micros);
+    }
+
+    void setDeadBand(const DeadBandConfig& config) {
+        deadBand.configure(config);
+        for (auto& window : windows) {
+            window.deadBand.configure(config);
+        }
+    }
+
+    void setMetrics(bool enabled) {
+        metricsEnabled = enabled;
+        metrics.reset();
+    }
+
+    void subscribed() {
+        windows.emplace_back();
+        windows.back().deadBand.configure(deadBand.configuration());
+    }
+
+    void unsubscribed(size_t index) {
+        windows.erase(windows.begin() + index);
+    }
+
+    void setFilter(const FilterConfig& config) {
+        filterConfig = config;
+        for (auto& filter : filters) {
+            filter.configure(config);
+        }
     }
 
     void setLeds(wiipp::Bluetooth* bt, uint16_t handle, const std::bitset<4>& bits) {
@@ -42,167 +231,388 @@ public:
         bt->l2send_data(handle, 0x0013, data, 4);
     }
 
-    void write_memory(uint16_t handle, uint8_t addressSpace, uint32_t offset, std::initializer_list<uint8_t> memData) {
-      uint8_t data[] = {
-        0xA2,
-        0x16,
-        addressSpace,
-        (uint8_t)((offset >> 16) & 0xFF),
-        (uint8_t)((offset >>  8) & 0xFF),
-        (uint8_t)((offset      ) & 0xFF),
-        (uint8_t)(memData.size()),
-        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
-      };
-      std::copy(memData.begin(), memData.end(), data+7);
+    BalanceBoardCalibration converter;
+    StoredCalibration cached;  // Used once the extension ID confirms a balance board
+    bool hasCached{false};
+
+    static constexpr uint8_t BALANCE_BOARD_ID[] = {0x00, 0x00, 0xA4, 0x20, 0x04, 0x02};
+
+    // Everything up to the ID read goes out at once, the calibration read follows the ID reply
+    void setUpExtension() {
+        settingUp = true;
+        hasCached = bdaddr != 0 && calibrations.find(bdaddr, &cached) && cached.version == StoredCalibration::VERSION;
+        auto failed = [this](uint8_t error, std::span<const uint8_t>) {
+            if (error != 0) {
+                log_w("Enabling the extension failed with %02X", error);
+                memory.clear();
+                settingUp = false;
+            }
+        };
+        memory.write(MemoryAccess::REGISTERS, 0xA400F0, {0x55}, failed);  // Disable encryption 1
+        memory.write(MemoryAccess::REGISTERS, 0xA400FB, {0x00}, failed);  // Disable encryption 2
+        memory.read(MemoryAccess::REGISTERS, 0xA400FA, 6, [this](uint8_t error, std::span<const uint8_t> id) {
+            identified(error, id);
+        });
+    }
 
-      bt->l2send_data(handle, 0x0013, data, 23);
+    void identified(uint8_t error, std::span<const uint8_t> id) {
+        if (error != 0 || !std::equal(id.begin(), id.end(), std::begin(BALANCE_BOARD_ID), std::end(BALANCE_BOARD_ID))) {
+            if (error == 0 && hasCached) {
+                // Read fine but no balance board there, whatever we cached is stale
+                calibrations.forget(bdaddr);
+            }
+            settingUp = false;
+            return;
+        }
+        if (hasCached) {
+            log_d("Calibration data from cache");
+            calibrated(cached.raw, cached.referenceTemperature);
+            return;
+        }
+        // 0kg, 17kg and 34kg blocks at 0x24, 0x2C and 0x34, the reference temperature at 0x60
+        memory.read(MemoryAccess::REGISTERS, 0xA40024, 0x3E, [this](uint8_t error, std::span<const uint8_t> mem) {
+            if (error != 0) {
+                log_w("Reading calibration failed with %02X", error);
+                settingUp = false;
+                return;
+            }
+            log_d("Calibration data");
+            std::array<uint16_t, 12> raw;
+            for (size_t i = 0; i < raw.size(); ++i) {
+                raw[i] = mem[2 * i] * 256 + mem[2 * i + 1];
+            }
+            uint8_t temperature = mem[0x60 - 0x24];
+            if (bdaddr != 0) {
+                calibrations.remember(bdaddr, StoredCalibration{
+                    .version = StoredCalibration::VERSION,
+                    .referenceTemperature = temperature,
+                    .raw = raw,
+                });
+            }
+            calibrated(raw, temperature);
+        });
     }
 
-    void read_memory(uint16_t handle, uint8_t addressSpace, uint32_t offset, uint16_t size) {
-        uint8_t data[] = {
-            0xA2,
-            0x17,
-            addressSpace,
-            (uint8_t)((offset >> 16) & 0xFF),
-            (uint8_t)((offset >> 8) & 0xFF),
-            (uint8_t)((offset) & 0xFF),
-            (uint8_t)((size >> 8) & 0xFF),
-            (uint8_t)((size) & 0xFF)
+    void calibrated(const std::array<uint16_t, 12>& raw, uint8_t temperature) {
+        calibration = raw;
+        referenceTemperature = temperature;
+        converter = BalanceBoardCalibration::fromRaw(calibration, referenceTemperature);
+        set_reporting_mode(handle, 0x34, false);
+        settingUp = false;
+    }
+
+    // Handlers by ReportKind, each returns true when it put a sample in `out`. Samples are only
+    // converted when `convert` is set, the other reports are always handled.
+    using ReportHandler = bool (BalanceBoard::*)(BalanceBoardData* out, const InputReport& report, bool convert);
+    static const std::array<ReportHandler, static_cast<size_t>(ReportKind::COUNT)> HANDLERS;
+
+    bool onUnknown(BalanceBoardData*, const InputReport&, bool) {
+        return false;
+    }
+
+    bool onStatus(BalanceBoardData*, const InputReport& report, bool) {
+        // An extension connected
+        if (report.report[4] & 0x02 && !settingUp) {
+            setUpExtension();
+        }
+        return false;
+    }
+
+    bool onMemory(BalanceBoardData*, const InputReport& report, bool) {
+        memory.receive(report.report);
+        return false;
+    }
+
+    bool onSamples(BalanceBoardData* out, const InputReport& report, bool convert) {
+        // A non-zero reference temperature means we have calibrated. Only 0x34 is asked for,
+        // but any mode with 11 extension bytes carries the sensors, temperature and battery.
+        if (referenceTemperature == 0 || !convert || report.extension.size() < 11) {
+            return false;
+        }
+        const uint8_t* mem = report.extension.data();
+
+        uint16_t values[4]={
+            static_cast<uint16_t>(mem[0] * 256 + mem[1]), // tr
+            static_cast<uint16_t>(mem[2] * 256 + mem[3]), // br
+            static_cast<uint16_t>(mem[4] * 256 + mem[5]), // tl
+            static_cast<uint16_t>(mem[6] * 256 + mem[7]), // bl
         };
-        bt->l2send_data(handle, 0x0013, data, 8);
 
-        uint16_t data_len = 8;
+        out->handle = handle;
+        out->filtered = false;
+        out->tr = BalanceBoardCalibration::grams(values[0], converter.sensors[0]);
+        out->br = BalanceBoardCalibration::grams(values[1], converter.sensors[1]);
+        out->tl = BalanceBoardCalibration::grams(values[2], converter.sensors[2]);
+        out->bl = BalanceBoardCalibration::grams(values[3], converter.sensors[3]);
+        out->temperature = mem[8];
+        out->batteryLevel = mem[10];
+        out->referenceTemperature = referenceTemperature;
+        return true;
+    }
+
+    bool onData(BalanceBoardData* out, std::span<const uint8_t> data, bool convert) {
+        InputReport report;
+        if (!decodeInputReport(data, &report)) {
+            return false;
+        }
+        return (this->*HANDLERS[static_cast<size_t>(report.kind)])(out, report, convert);
+    }
+};
+
+const std::array<Wii::BalanceBoard::ReportHandler, static_cast<size_t>(ReportKind::COUNT)>
+    Wii::BalanceBoard::HANDLERS = [] {
+        std::array<ReportHandler, static_cast<size_t>(ReportKind::COUNT)> handlers;
+        handlers.fill(&BalanceBoard::onUnknown);
+        handlers[static_cast<size_t>(ReportKind::Status)] = &BalanceBoard::onStatus;
+        handlers[static_cast<size_t>(ReportKind::ReadReply)] = &BalanceBoard::onMemory;
+        handlers[static_cast<size_t>(ReportKind::Acknowledge)] = &BalanceBoard::onMemory;
+        handlers[static_cast<size_t>(ReportKind::Data)] = &BalanceBoard::onSamples;
+        return handlers;
+    }();
+
+class Wii::Remote {
+    Bluetooth* bt;
+    const std::vector<Subscriber>& subscribers;
+    std::vector<uint64_t> deadlines;  // Of the next WiimoteData per subscriber, in the same order
+    MemoryAccess memory;
+    uint16_t handle{0};
+    WiimoteReporting reporting{WiimoteReporting::AccelerometerIr};
+    IrFormat cameraFormat{IrFormat::Extended};  // What the camera was last set to
+    bool cameraReady{false};
+
+    void send(std::span<uint8_t> report) {
+        bt->l2send_data(handle, 0x0013, report.data(), report.size());
+    }
+
+    void sendReportingMode() {
+        // Continuous, IR positions change without a button being pressed
+        uint8_t mode[] = {0xA2, 0x12, 0x04, static_cast<uint8_t>(reporting)};
+        send(mode);
     }
 
-    int32_t interpolate(uint8_t pos, uint16_t *values) {
-        uint16_t *cal = calibration.data();
-        float weight = 0;
+    // Clock and camera on, then the register writes in the order the camera needs them.
+    // Reports start once the last write is acknowledged.
+    void enableCamera() {
+        uint8_t clock[] = {0xA2, 0x13, 0x04};
+        uint8_t camera[] = {0xA2, 0x1A, 0x04};
+        send(clock);
+        send(camera);
+
+        auto failed = [this](uint8_t error, std::span<const uint8_t>) {
+            if (error != 0) {
+                log_w("IR camera setup failed with %02X", error);
+                memory.clear();
+            }
+        };
+        cameraFormat = irFormatFor(static_cast<uint8_t>(reporting));
+        memory.write(MemoryAccess::REGISTERS, 0xB00030, {0x08}, failed);
+        memory.write(MemoryAccess::REGISTERS, 0xB00000, IR_SENSITIVITY_BLOCK1, failed);
+        memory.write(MemoryAccess::REGISTERS, 0xB0001A, IR_SENSITIVITY_BLOCK2, failed);
+        memory.write(MemoryAccess::REGISTERS, 0xB00033, {static_cast<uint8_t>(cameraFormat)}, failed);
+        memory.write(MemoryAccess::REGISTERS, 0xB00030, {0x08}, [this](uint8_t error, std::span<const uint8_t>) {
+            if (error != 0) {
+                log_w("IR camera setup failed with %02X", error);
+                return;
+            }
+            log_d("IR camera enabled");
+            cameraReady = true;
+            applyReporting();
+        });
+    }
 
-        if(values[pos] < cal[pos]) {//0kg
-            weight = 0;
+    // Switches the camera format first if the reporting mode needs another one
+    void applyReporting() {
+        IrFormat format = irFormatFor(static_cast<uint8_t>(reporting));
+        if (format == cameraFormat) {
+            sendReportingMode();
+            return;
         }
-        else if(values[pos] < cal[pos+4]) {//17kg
-            weight = 17 * (float)(values[pos]-cal[pos])/(float)(cal[pos+4]-cal[pos]);
+        cameraFormat = format;
+        memory.write(MemoryAccess::REGISTERS, 0xB00033, {static_cast<uint8_t>(format)},
+                     [this](uint8_t error, std::span<const uint8_t>) {
+                         if (error != 0) {
+                             log_w("Setting the IR format failed with %02X", error);
+                             return;
+                         }
+                         sendReportingMode();
+                     });
+    }
+
+public:
+    Remote(Bluetooth* bt, const std::vector<Subscriber>& subscribers)
+        : bt(bt), subscribers(subscribers), deadlines(subscribers.size()) {
+    }
+
+    // Starts over for a newly connected remote, `player` picks the LED
+    void connect(uint16_t handle, size_t player, WiimoteReporting reporting) {
+        this->handle = handle;
+        this->reporting = reporting;
+        cameraReady = false;
+        memory.attach(bt, handle);
+        std::fill(deadlines.begin(), deadlines.end(), 0);
+        uint8_t leds[] = {0xA2, 0x11, static_cast<uint8_t>(0x10 << (player % 4))};
+        send(leds);
+        enableCamera();
+    }
+
+    void setReporting(WiimoteReporting to) {
+        reporting = to;
+        // Before that the end of the camera setup picks it up
+        if (cameraReady) {
+            applyReporting();
         }
-        else {//34kg
-            weight = 17 + 17 * (float)(values[pos]-cal[pos+4])/(float)(cal[pos+8]-cal[pos+4]);
+    }
+
+    void subscribed() {
+        deadlines.emplace_back(0);
+    }
+
+    void unsubscribed(size_t index) {
+        deadlines.erase(deadlines.begin() + index);
+    }
+
+    static void receive(void* context, uint16_t handle, std::span<const uint8_t> data) {
+        static_cast<Remote*>(context)->receive(data);
+    }
+
+    void receive(std::span<const uint8_t> data) {
+        InputReport report;
+        if (decodeInputReport(data, &report)) {
+            (this->*HANDLERS[static_cast<size_t>(report.kind)])(report);
         }
+    }
 
-        return weight * 1000;
+    void poll(uint64_t micros) {
+        memory.poll(micros);
     }
 
-    void readCalibrationData(uint8_t* data, size_t len) {
-        switch (queryState) {
-            case 0:
-                if(data[1] == 0x20 && data[4] & 0x02) {
-                    write_memory(handle, 0x04, 0xA400F0, {0x55}); // Disable encryption 1
-                    queryState = 1;
-                }
-                break;
-            case 1:
-                if (data[1]==0x22 && data[4]==0x16) {
-                    if (data[5]==0x00) {
-                        write_memory(handle, 0x04, 0xA400FB, {0x00}); // Disable encryption 2
-                        queryState = 2;
-                    } else {
-                        queryState = 0;
-                    }
-                }
-                break;
-            case 2:
-                if (data[1]==0x22 && data[4]==0x16) {
-                    if (data[5]==0x00) {
-                        read_memory(handle, 0x04, 0xA400FA, 6);
-                        queryState = 3;
-                    } else {
-                        queryState = 0;
-                    }
-                }
-                break;
-            case 3:
-                if (data[1] == 0x21) {
-                    // Wii Balance Board
-                    if (memcmp(data+5, (const uint8_t[]){0x00, 0xFA, 0x00, 0x00, 0xA4, 0x20, 0x04, 0x02}, 8) == 0) {
-                        read_memory(handle, 0x04, 0xA40024, 16); // read calibration 0 kg and 17kg
-                        queryState = 4;
-                    } else {
-                        queryState = 0;
-                    } 
-                }
-                break;
-            case 4:
-                {
-                    log_d("Calibration data 0kg and 17kg");
-                    uint8_t* mem = data+7;
-
-                    calibration[0] = mem[0] * 256 + mem[1];//Top Right 0kg 
-                    calibration[1] = mem[2] * 256 + mem[3]; //Bottom Right 0kg
-                    calibration[2] = mem[4] * 256 + mem[5]; //Top Left 0kg
-                    calibration[3] = mem[6] * 256 + mem[7]; //Bottom Left 0kg
-
-                    calibration[4] = mem[8] * 256 + mem[9];//Top Right 17kg 
-                    calibration[5] = mem[10] * 256 + mem[11];//Bottom Right 17kg
-                    calibration[6] = mem[12] * 256 + mem[13];//Top Left 17kg
-                    calibration[7] = mem[14] * 256 + mem[15];//Bottom Left 17kg
+    using ReportHandler = void (Remote::*)(const InputReport& report);
+    static const std::array<ReportHandler, static_cast<size_t>(ReportKind::COUNT)> HANDLERS;
+
+    void onUnknown(const InputReport&) {
+    }
+
+    void onStatus(const InputReport&) {
+        // A status report nobody asked for, e.g. on an extension change, stops the data
+        // reports until the mode is set again
+        if (cameraReady) {
+            sendReportingMode();
+        }
+    }
+
+    void onMemory(const InputReport& report) {
+        memory.receive(report.report);
+    }
+
+    // Decoded at most once, and only when a subscriber is due
+    void onData(const InputReport& report) {
+        if (report.ir.size() != IR_BASIC_SIZE && report.ir.size() != IR_EXTENDED_SIZE) {
+            return;
+        }
+        uint64_t micros = now();
+        WiimoteData out;
+        bool decoded = false;
+        for (size_t i = 0; i < subscribers.size(); ++i) {
+            const auto& subscriber = subscribers[i];
+            if (!subscriber.samples) {
+                continue;
+            }
+            if (subscriber.intervalMicros != 0) {
+                if (micros < deadlines[i]) {
+                    continue;
                 }
-                read_memory(handle, 0x04, 0xA40034, 8); // read calibration 34kg
-
-                queryState = 5;
-                break;
-            case 5: 
-                {
-                    log_d("Calibration data 34kg");
-                    uint8_t* mem = data+7;
-                    calibration[8] = mem[0] * 256 + mem[1];//Top Right 34kg 
-                    calibration[9] = mem[2] * 256 + mem[3]; //Bottom Right 34kg
-                    calibration[10] = mem[4] * 256 + mem[5]; //Top Left 34kg
-                    calibration[11] = mem[6] * 256 + mem[7]; //Bottom Left 34kg
+                // Keep to the grid unless we fell more than a whole interval behind
+                deadlines[i] += subscriber.intervalMicros;
+                if (deadlines[i] <= micros) {
+                    deadlines[i] = micros + subscriber.intervalMicros;
                 }
-                read_memory(handle, 0x04, 0xA40060, 2);  // read calibration reference temperature
-
-                queryState = 6;
-                break;
-            case 6:
-                uint8_t *mem = data + 7;
-                log_d("Calibration data reference temperature");
-                referenceTemperature = mem[0];
-                set_reporting_mode(handle, 0x34, false);
-                queryState = 0;
-                break;
+            }
+            if (!decoded) {
+                out.handle = handle;
+                out.reportingMode = report.id;
+                out.buttons = report.buttons;
+                out.acceleration = report.acceleration;
+                decodeIr(report.ir, out.ir);
+                decoded = true;
+            }
+            subscriber.listener(out);
         }
     }
+};
+
+const std::array<Wii::Remote::ReportHandler, static_cast<size_t>(ReportKind::COUNT)> Wii::Remote::HANDLERS = [] {
+    std::array<ReportHandler, static_cast<size_t>(ReportKind::COUNT)> handlers;
+    handlers.fill(&Remote::onUnknown);
+    handlers[static_cast<size_t>(ReportKind::Status)] = &Remote::onStatus;
+    handlers[static_cast<size_t>(ReportKind::ReadReply)] = &Remote::onMemory;
+    handlers[static_cast<size_t>(ReportKind::Acknowledge)] = &Remote::onMemory;
+    handlers[static_cast<size_t>(ReportKind::Data)] = &Remote::onData;
+    return handlers;
+}();
+
+// Device slots, with the handle of each in a separate small array that lookups scan
+template <typename T, size_t N>
+struct Wii::SlotTable {
+    static constexpr uint16_t NO_HANDLE = 0xFFFF;
+
+    std::array<uint16_t, N> handles;
+    std::array<T, N> slots;
+
+    // Every slot is constructed from the same `args`
+    template <typename... Args>
+    explicit SlotTable(Args&... args) : SlotTable(std::make_index_sequence<N>(), args...) {
+        handles.fill(NO_HANDLE);
+    }
 
-    bool onData(BalanceBoardData* out, uint8_t* data, size_t len) {
-        if (data[0] == 0xA1) {
-            // A non-zero reference temperature means we have calibrated
-            if (data[1] == 0x34 && referenceTemperature != 0) {
-                uint8_t* mem = data+4;
-
-                uint16_t values[4]={
-                    static_cast<uint16_t>(mem[0] * 256 + mem[1]), // tr
-                    static_cast<uint16_t>(mem[2] * 256 + mem[3]), // br
-                    static_cast<uint16_t>(mem[4] * 256 + mem[5]), // tl
-                    static_cast<uint16_t>(mem[6] * 256 + mem[7]), // bl
-                };
-
-                out->tr = interpolate(0, values);
-                out->br = interpolate(1, values);
-                out->tl = interpolate(2, values);
-                out->bl = interpolate(3, values);
-                out->temperature = mem[8];
-                out->batteryLevel = mem[10];
-                out->referenceTemperature = referenceTemperature;
-                return true;
-            } else {
-                readCalibrationData(data, len);
+    template <size_t... I, typename... Args>
+    SlotTable(std::index_sequence<I...>, Args&... args) : slots{((void)I, T(args...))...} {}
+
+    T* find(uint16_t handle) {
+        for (size_t i = 0; i < N; ++i) {
+            if (handles[i] == handle) {
+                return &slots[i];
+            }
+        }
+        return nullptr;
+    }
+
+    size_t indexOf(const T* slot) const {
+        return slot - slots.data();
+    }
+
+    // nullptr when every slot is taken
+    T* acquire(uint16_t handle) {
+        T* slot = find(NO_HANDLE);
+        if (slot != nullptr) {
+            handles[indexOf(slot)] = handle;
+        }
+        return slot;
+    }
+
+    void release(uint16_t handle) {
+        for (auto& slotHandle : handles) {
+            if (slotHandle == handle) {
+                slotHandle = NO_HANDLE;
+            }
+        }
+    }
+
+    template <typename F>
+    void forEachConnected(F&& f) {
+        for (size_t i = 0; i < N; ++i) {
+            if (handles[i] != NO_HANDLE) {
+                f(slots[i]);
             }
         }
-        return false;
     }
 };
 
-  Wii::Wii(Bluetooth* bt, std::function<void(const WiiEvent&)> eventListner) : bluetooth(bt), eventListner(std::move(eventListner)) {
+  Wii::Wii(Bluetooth* bt, WiiEventListener eventListner, float rateHz)
+      : bluetooth(bt),
+        boards(std::make_unique<SlotTable<BalanceBoard, MAX_BOARDS>>(bt, calibrations, subscribers)),
+        remotes(std::make_unique<SlotTable<Remote, MAX_REMOTES>>(bt, subscribers)) {
+    subscribe(std::move(eventListner), rateHz);
+
     bt->onHCIConnectionRequest([](wiipp::Bluetooth*, const wiipp::HCIConnectionRequest& result) {
         log_i("Received connection request from %s", formatHex((uint8_t*)&result.bdaddr, 6));
         return result.classOfDevice == 0x042500;  // Return true if wiimote
@@ -212,27 +622,39 @@ public:
         std::visit(overloaded{
                        [this](const wiipp::HCIInquiryComplete&) {
                         // Scan complete
-                        this->eventListner(ScanStopped{});
+                        this->emit(ScanStopped{});
                        },
-                       [bt](const wiipp::HCIInquiryResult& result) {
+                       [this](const wiipp::HCIInquiryResult& result) {
                            if (result.classOfDevice == 0x042500) {
-                               bt->requestRemoteName(result);
+                               discovered(result);
                            }
                        },
-                       [bt](const wiipp::HCIRemoteName& result) {
+                       [this, bt](const wiipp::HCIRemoteName& result) {
                            log_i("Found %s %s", result.remoteName.data(),
                                  formatHex((uint8_t*)&result.inquiry.bdaddr, 6));
-                            // FIXME Set back to wiimote for wiimote testing
-                           if (result.remoteName == "Nintendo RVL-WBC-01") {
+                           deviceCache.remember(result.inquiry.bdaddr, result.inquiry.classOfDevice, result.remoteName);
+                           if (isWiiDevice(result.remoteName)) {
                                bt->connect(result.inquiry);
                            }
                        },
                        [bt](const wiipp::HCIConnectionFailed& result) {
                            log_e("Failed to connect Wiimote %s", formatHex((uint8_t*)&result.bdaddr, 6));
                        },
-                       [bt](const wiipp::HCIConnectionEstablished& result) {
+                       [this, bt](const wiipp::HCIConnectionEstablished& result) {
                            log_i("Wiimote connection %s, handle: %d", result.accepted ? "accepted" : "established",
                                  result.handle);
+                           const KnownDevice* known = deviceCache.find(result.bdaddr);
+                           for (auto& link : links) {
+                               if (!link.used) {
+                                   link = Link{
+                                       .used = true,
+                                       .remote = known != nullptr && known->nameView() == WIIMOTE_NAME,
+                                       .handle = result.handle,
+                                       .bdaddr = result.bdaddr,
+                                   };
+                                   break;
+                               }
+                           }
 
                            if (result.accepted) {
                                // We accepted a connection from an authenticated Wiimote.
@@ -242,17 +664,33 @@ public:
 
                            // Send auth request if pairing
                            log_i("Initiating auth");
-                           bt->auth(result.handle);
+                           uint64_t bdaddr = result.bdaddr;
+                           bt->auth(result.handle).then([this, bdaddr](const CommandResult& auth) {
+                               // Authentication Failure or PIN or Key Missing, the board dropped our key
+                               if (auth.status == 0x05 || auth.status == 0x06) {
+                                   log_w("Authentication failed with %02X, forgetting the link key", auth.status);
+                                   linkKeys.forget(bdaddr);
+                               }
+                           });
 
                            // Establish L2CAP connections
                            // PSM: HID_Control=0x0011, HID_Interrupt=0x0013
-                           // MTU: 672
-                           bt->l2cap_connect(result.handle, 0x0011, 0x40);
-                           bt->l2cap_connect(result.handle, 0x0013, 0x40);
+                           bt->l2cap_connect(result.handle, 0x0011, wiipp::L2CAP_MTU);
+                           bt->l2cap_connect(result.handle, 0x0013, wiipp::L2CAP_MTU);
+                       },
+                       [this, bt](const wiipp::HCILinkKeyRequest& result) {
+                           LinkKey key;
+                           if (linkKeys.find(result.bdaddr, &key)) {
+                               log_i("Link key reply");
+                               bt->linkKeyReply(result.bdaddr, key.key);
+                           } else {
+                               log_i("Negative link reply");
+                               bt->negativeReply(result.bdaddr);
+                           }
                        },
-                       [bt](const wiipp::HCILinkKeyRequest& result) {
-                           log_i("Negative link reply");
-                           bt->negativeReply(result.bdaddr);
+                       [this](const wiipp::HCILinkKeyNotification& result) {
+                           log_i("New link key for %s", formatHex((uint8_t*)&result.bdaddr, 6));
+                           linkKeys.remember(result.bdaddr, LinkKey{.key = result.linkKey, .type = result.keyType});
                        },
                        [bt](const wiipp::HCIPINRequest& result) {
                            uint8_t pin_data[6];
@@ -265,7 +703,17 @@ public:
                            log_i("Sending pin reply");
                            bt->sendPinReply(result.bdaddr, pin_data, 6);
                        },
-                       [bt](const wiipp::HCIDisconnected& result) { log_i("Disconnected %d", result.handle); },
+                       [this](const wiipp::HCIDisconnected& result) {
+                           log_i("Disconnected %d", result.handle);
+                           // A device that powers off or goes out of range only ends the HCI
+                           // link, its interrupt channel is never closed
+                           releaseDevice(result.handle);
+                           for (auto& link : links) {
+                               if (link.used && link.handle == result.handle) {
+                                   link.used = false;
+                               }
+                           }
+                       },
                    },
                    event);
     });
@@ -280,26 +728,20 @@ public:
                        [this](const wiipp::ACLConnectionFailed&) {},
                        [this](const wiipp::ACLDisconnected& info) {
                             if (info.psm == 0x13) {
-                              this->eventListner(BalanceBoardDisconnected{
-                                .handle = info.handle,
-                              });
-                              connectedBoards.erase(info.handle);
-                              bluetooth->disconnect(info.handle);
+                              interruptDisconnected(info.handle);
                             }
                        },
                        [this](const wiipp::ACLConnectionEstablished& conn) {
                             if (conn.psm == 0x0013) {
-                                connectedBoards.emplace(conn.handle, std::make_unique<BalanceBoard>(bluetooth, conn.handle));
-                                connectedBoards[conn.handle]->setLeds(bluetooth, conn.handle, std::bitset<4>(0b0001));
-                                this->eventListner(BalanceBoardConnected{
-                                  .handle = conn.handle,
-                                });
+                              interruptConnected(conn.handle);
                             }
                        },
                        [this](const wiipp::ACLData& data) {
-                          BalanceBoardData out;
-                          if (connectedBoards.at(data.handle)->onData(&out, data.data, data.len)) {
-                            this->eventListner(out);
+                          // Interrupt channel reports go to the device's DataSink, this is whatever else arrives
+                          if (BalanceBoard* board = boards->find(data.handle)) {
+                            board->receive(data.data);
+                          } else if (Remote* remote = remotes->find(data.handle)) {
+                            remote->receive(data.data);
                           }
                        },
                    },
@@ -311,12 +753,192 @@ public:
   }
 
   void Wii::sync() {
-    this->eventListner(ScanStarted{});
+    this->emit(ScanStarted{});
     bluetooth->scan();
   }
+
+  void Wii::setStorage(Storage* storage) {
+    this->storage = storage;
+    deviceCache.load(storage);
+    linkKeys.setStorage(storage);
+    calibrations.setStorage(storage);
+  }
+
+  const Wii::Link* Wii::linkOf(uint16_t handle) const {
+    for (const auto& link : links) {
+      if (link.used && link.handle == handle) {
+        return &link;
+      }
+    }
+    return nullptr;
+  }
+
+  void Wii::interruptConnected(uint16_t handle) {
+    const Link* link = linkOf(handle);
+    if (link != nullptr && link->remote) {
+      Remote* remote = remotes->acquire(handle);
+      if (remote == nullptr) {
+        log_e("No room for Wii remote %d, at most %zu", handle, MAX_REMOTES);
+        bluetooth->disconnect(handle);
+        return;
+      }
+      bluetooth->setDataSink(handle, 0x0013, DataSink{
+        .receive = &Remote::receive,
+        .context = remote,
+      });
+      remote->connect(handle, remotes->indexOf(remote), wiimoteReporting);
+      emit(WiimoteConnected{
+        .handle = handle,
+      });
+      return;
+    }
+
+    BalanceBoard* board = boards->acquire(handle);
+    if (board == nullptr) {
+      log_e("No room for balance board %d, at most %zu", handle, MAX_BOARDS);
+      bluetooth->disconnect(handle);
+      return;
+    }
+    board->connect(handle, link != nullptr ? link->bdaddr : 0, filterConfig, deadBandConfig, metricsEnabled);
+    bluetooth->setDataSink(handle, 0x0013, DataSink{
+      .receive = &BalanceBoard::receive,
+      .context = board,
+    });
+    board->setLeds(bluetooth, handle, std::bitset<4>(0b0001));
+    emit(BalanceBoardConnected{
+      .handle = handle,
+    });
+  }
+
+  void Wii::interruptDisconnected(uint16_t handle) {
+    if (releaseDevice(handle)) {
+      bluetooth->disconnect(handle);
+    }
+  }
+
+  bool Wii::releaseDevice(uint16_t handle) {
+    if (remotes->find(handle) != nullptr) {
+      remotes->release(handle);
+      emit(WiimoteDisconnected{
+        .handle = handle,
+      });
+      return true;
+    }
+    if (boards->find(handle) != nullptr) {
+      boards->release(handle);
+      emit(BalanceBoardDisconnected{
+        .handle = handle,
+      });
+      return true;
+    }
+    return false;
+  }
+
+  void Wii::discovered(const HCIInquiryResult& result) {
+    if (const KnownDevice* known = deviceCache.find(result.bdaddr)) {
+      log_i("Found known %s %s", known->name.data(), formatHex((uint8_t*)&result.bdaddr, 6));
+      if (isWiiDevice(known->nameView())) {
+        bluetooth->connect(result);
+      }
+      return;
+    }
+    nameQueue.push_back(result);
+    requestNames();
+  }
+
+  // Each name request pages the device, which can take seconds. Keep a few going at once
+  // and start the next one as soon as one finishes, successful or not.
+  void Wii::requestNames() {
+    while (namesInFlight < MAX_NAME_REQUESTS && !nameQueue.empty()) {
+      HCIInquiryResult next = nameQueue.front();
+      nameQueue.erase(nameQueue.begin());
+      namesInFlight++;
+      bluetooth->requestRemoteName(next).then([this](const CommandResult&) {
+        namesInFlight--;
+        requestNames();
+      });
+    }
+  }
   
-  void Wii::step() {
-    bluetooth->process();
+  void Wii::emit(const WiiEvent& event) {
+    for (const auto& subscriber : subscribers) {
+      subscriber.listener(event);
+    }
+  }
+
+  uint32_t Wii::subscribe(WiiEventListener listener, float rateHz) {
+    uint32_t id = nextSubscriberId++;
+    subscribers.push_back(Subscriber{
+      .id = id,
+      .listener = std::move(listener),
+      .samples = rateHz >= 0,
+      .intervalMicros = rateHz > 0 ? static_cast<uint32_t>(1e6f / rateHz) : 0,
+    });
+    // Free slots too, so a board connecting later finds its windows in place
+    for (auto& board : boards->slots) {
+      board.subscribed();
+    }
+    for (auto& remote : remotes->slots) {
+      remote.subscribed();
+    }
+    return id;
+  }
+
+  uint32_t Wii::subscribe(EventQueue* queue, float rateHz) {
+    return subscribe([queue](const WiiEvent& event) { queue->push(event); }, rateHz);
+  }
+
+  void Wii::unsubscribe(uint32_t id) {
+    auto itr = std::find_if(subscribers.begin(), subscribers.end(), [id](const Subscriber& s) { return s.id == id; });
+    if (itr == subscribers.end()) {
+      return;
+    }
+    size_t index = itr - subscribers.begin();
+    subscribers.erase(itr);
+    for (auto& board : boards->slots) {
+      board.unsubscribed(index);
+    }
+    for (auto& remote : remotes->slots) {
+      remote.unsubscribed(index);
+    }
+  }
+
+  void Wii::setFilter(const FilterConfig& config) {
+    filterConfig = config;
+    boards->forEachConnected([&](BalanceBoard& board) { board.setFilter(config); });
+  }
+
+  void Wii::setDeadBand(const DeadBandConfig& config) {
+    deadBandConfig = config;
+    boards->forEachConnected([&](BalanceBoard& board) { board.setDeadBand(config); });
+  }
+
+  bool Wii::setDeadBand(uint16_t handle, const DeadBandConfig& config) {
+    BalanceBoard* board = boards->find(handle);
+    if (board == nullptr) {
+      return false;
+    }
+    board->setDeadBand(config);
+    return true;
+  }
+
+  void Wii::setMetrics(bool enabled) {
+    metricsEnabled = enabled;
+    boards->forEachConnected([&](BalanceBoard& board) { board.setMetrics(enabled); });
+  }
+
+  void Wii::setWiimoteReporting(WiimoteReporting mode) {
+    wiimoteReporting = mode;
+    remotes->forEachConnected([&](Remote& remote) { remote.setReporting(mode); });
+  }
+
+  ProcessResult Wii::step() {
+    ProcessResult result = bluetooth->process();
+    // Memory requests the device never answered
+    uint64_t micros = now();
+    boards->forEachConnected([micros](BalanceBoard& board) { board.poll(micros); });
+    remotes->forEachConnected([micros](Remote& remote) { remote.poll(micros); });
+    return result;
   }
   
 }
@@ -1,7 +1,23 @@
 #pragma once
+#include "balance_board.h"
 #include "bluetooth.h"
-#include <unordered_map>
+#include "device_cache.h"
+#include "filters.h"
+#include "ir_camera.h"
+#include "storage.h"
+#include "sway.h"
 #include <memory>
+#include <vector>
+
+// Balance boards Wii keeps state for at once, the controller manages at most 7 links
+#ifndef WIIPP_MAX_BOARDS
+#define WIIPP_MAX_BOARDS 7
+#endif
+
+// Wii remotes Wii keeps state for at once
+#ifndef WIIPP_MAX_REMOTES
+#define WIIPP_MAX_REMOTES 4
+#endif
 
 namespace wiipp {
 
@@ -14,6 +30,7 @@ struct BalanceBoardDisconnected {
 };
 
 struct BalanceBoardData {
+    uint16_t handle;
     uint16_t tr;
     uint16_t br;
     uint16_t tl;
@@ -21,6 +38,31 @@ struct BalanceBoardData {
     uint8_t referenceTemperature;
     uint8_t temperature;
     uint8_t batteryLevel;
+    bool filtered;  // Passed through the filter set with Wii::setFilter
+};
+
+struct WiimoteConnected {
+    uint16_t handle;
+};
+
+struct WiimoteDisconnected {
+    uint16_t handle;
+};
+
+struct WiimoteData {
+    uint16_t handle;
+    uint8_t reportingMode;
+    uint16_t buttons;  // Core buttons, see CORE_BUTTONS
+    std::array<uint16_t, 3> acceleration;  // 10 bit x, y and z, zero in 0x36
+    IrDots ir;
+};
+
+// Wii remote reporting modes with IR. 0x33 gets the IR format with dot sizes, the other
+// two the basic one.
+enum class WiimoteReporting : uint8_t {
+    AccelerometerIr = 0x33,
+    IrExtension = 0x36,
+    AccelerometerIrExtension = 0x37,
 };
 
 struct ScanStarted {
@@ -29,21 +71,109 @@ struct ScanStarted {
 struct ScanStopped {
 };
 
-using WiiEvent = std::variant<BalanceBoardConnected, BalanceBoardDisconnected, BalanceBoardData, ScanStarted, ScanStopped>;
+using WiiEvent = std::variant<BalanceBoardConnected, BalanceBoardDisconnected, BalanceBoardData, BalanceBoardMetrics,
+                              WiimoteConnected, WiimoteDisconnected, WiimoteData, ScanStarted, ScanStopped>;
+using WiiEventListener = std::function<void(const WiiEvent&)>;
+
+class EventQueue;
 
 class Wii {
-    struct BalanceBoard;
+public:
+    // Output rates for subscribe, in BalanceBoardData events per second per board
+    static constexpr float ALL_SAMPLES = 0;
+    static constexpr float NO_SAMPLES = -1;
+    static constexpr size_t MAX_BOARDS = WIIPP_MAX_BOARDS;
+    static constexpr size_t MAX_REMOTES = WIIPP_MAX_REMOTES;
+    // Remote name requests outstanding at once, the rest wait their turn
+    static constexpr size_t MAX_NAME_REQUESTS = 2;
+
+private:
+    class BalanceBoard;
+    class Remote;
+    template <typename T, size_t N>
+    struct SlotTable;
+    struct Subscriber {
+        uint32_t id;
+        WiiEventListener listener;
+        bool samples;             // Receives BalanceBoardData and BalanceBoardMetrics
+        uint32_t intervalMicros;  // Between averaged samples, 0 for every sample
+    };
+
     Bluetooth* bluetooth;
-    std::unordered_map<uint16_t, std::unique_ptr<BalanceBoard>> connectedBoards;
-    std::function<void(const WiiEvent&)> eventListner;
+    std::vector<Subscriber> subscribers;
+    uint32_t nextSubscriberId{0};
+    // Allocated once, devices connecting and leaving reuse their slots
+    std::unique_ptr<SlotTable<BalanceBoard, MAX_BOARDS>> boards;
+    std::unique_ptr<SlotTable<Remote, MAX_REMOTES>> remotes;
+    FilterConfig filterConfig;
+    DeadBandConfig deadBandConfig;
+    bool metricsEnabled{false};
+    WiimoteReporting wiimoteReporting{WiimoteReporting::AccelerometerIr};
+
+    // Addresses of the HCI connections, devices only learn their handle
+    struct Link {
+        bool used;
+        bool remote;  // Known by name as a Wii remote, anything else is taken for a board
+        uint16_t handle;
+        uint64_t bdaddr;
+    };
+    std::array<Link, MAX_BOARDS + MAX_REMOTES> links{};
+
+    Storage* storage{nullptr};
+    DeviceCache deviceCache;
+    DeviceStore<LinkKey> linkKeys{"lk"};
+    DeviceStore<StoredCalibration> calibrations{"cal"};
+    std::vector<HCIInquiryResult> nameQueue;  // Unknown devices waiting for a name request
+    size_t namesInFlight{0};
+
+    void emit(const WiiEvent& event);
+    void discovered(const HCIInquiryResult& result);
+    void requestNames();
+    const Link* linkOf(uint16_t handle) const;
+    void interruptConnected(uint16_t handle);
+    void interruptDisconnected(uint16_t handle);
+    // Frees the board or remote slot of `handle` and emits its Disconnected event. False if
+    // no device had that handle, so whichever of the HCI or L2CAP disconnect comes second
+    // does nothing.
+    bool releaseDevice(uint16_t handle);
 public:
-    Wii(Bluetooth* bluetooth, std::function<void(const WiiEvent&)> eventListner);
+    Wii(Bluetooth* bluetooth, WiiEventListener eventListner, float rateHz = ALL_SAMPLES);
     ~Wii();
     Wii(const Wii&) = delete;
     Wii& operator=(const Wii&) = delete;
 
     void sync();
-    void step();
+    // Keeps what Wii learns about devices in `storage` across restarts, so boards seen before
+    // are connected without asking for their name first, authenticate with the link key
+    // from their first pairing and skip reading their calibration. nullptr keeps names in
+    // memory only and does everything else every time.
+    void setStorage(Storage* storage);
+    // Adds a listener that gets every event, except that BalanceBoardData comes at most `rateHz`
+    // times a second per board, as the average of the samples since the previous one, and
+    // BalanceBoardMetrics only with those. WiimoteData comes at the same rate per remote, as
+    // the latest report. NO_SAMPLES leaves out all three. Samples are only converted while
+    // somebody consumes them. Not to be called from inside a listener.
+    uint32_t subscribe(WiiEventListener listener, float rateHz = ALL_SAMPLES);
+    // The same, but the events go into `queue` for another task to pop, instead of being
+    // handled inside step(). The queue must outlive the subscription.
+    uint32_t subscribe(EventQueue* queue, float rateHz = ALL_SAMPLES);
+    void unsubscribe(uint32_t id);
+    // Smooths the sensor values of every board, current and future. Filter state starts
+    // over on every call.
+    void setFilter(const FilterConfig& config);
+    // Holds back samples that barely changed from every subscriber, on every board current
+    // and future. Metrics are still computed from every sample, and subscribers below the
+    // full rate average every sample and have the averages held back instead.
+    void setDeadBand(const DeadBandConfig& config);
+    // The same for one connected board, until the next setDeadBand for all. False if there
+    // is no board with that handle.
+    bool setDeadBand(uint16_t handle, const DeadBandConfig& config);
+    // Emits a BalanceBoardMetrics event after every BalanceBoardData event. Enabling or
+    // disabling starts path length, velocity and sway area over.
+    void setMetrics(bool enabled);
+    // Reporting mode of every Wii remote, current and future. Remotes start out in 0x33.
+    void setWiimoteReporting(WiimoteReporting mode);
+    ProcessResult step();
 };
 
 };
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <memory>
+
+#include "ring_buffer.h"
+
+namespace wiipp {
+
+// Queues outgoing ACL packets per connection handle and releases them to the
+// controller as it has buffer space. The controller announces its number of ACL
+// buffers in the Read Buffer Size response and hands credits back per handle in
+// Number Of Completed Packets events. Handles with queued data are served round
+// robin, one packet at a time, so a busy link can't starve the others.
+class AclScheduler {
+public:
+    static constexpr size_t MAX_LINKS = 7;
+    static constexpr size_t QUEUE_SIZE = 2048;  // Room for a full L2CAP_MTU frame and then some
+
+private:
+    struct Link {
+        uint16_t handle;
+        bool active;
+        uint16_t inFlight;
+        RingBuffer queue;
+
+        Link() : handle(0), active(false), inFlight(0), queue(QUEUE_SIZE) {}
+    };
+
+    std::array<Link, MAX_LINKS> links;
+    size_t next{0};
+    uint16_t credits{0};
+    uint16_t totalCredits{0};
+    uint16_t maxPacketLength{0};
+
+    Link* find(uint16_t handle) {
+        for (auto& link : links) {
+            if (link.active && link.handle == handle) {
+                return &link;
+            }
+        }
+        return nullptr;
+    }
+
+public:
+    AclScheduler() = default;
+    AclScheduler(const AclScheduler&) = delete;
+    AclScheduler& operator=(const AclScheduler&) = delete;
+
+    // From the HCI Read Buffer Size response
+    void setBufferSize(uint16_t packetLength, uint16_t packets) {
+        maxPacketLength = packetLength;
+        totalCredits = packets;
+        credits = packets;
+        for (auto& link : links) {
+            link.inFlight = 0;
+        }
+    }
+
+    uint16_t packetLength() const { return maxPacketLength; }
+    uint16_t availableCredits() const { return credits; }
+
+    // The queue to enqueue packets for `handle` into, nullptr if all links are taken.
+    RingBuffer* queue(uint16_t handle) {
+        if (Link* link = find(handle)) {
+            return &link->queue;
+        }
+        for (auto& link : links) {
+            if (!link.active) {
+                link.handle = handle;
+                link.active = true;
+                link.inFlight = 0;
+                return &link.queue;
+            }
+        }
+        return nullptr;
+    }
+
+    size_t depth(uint16_t handle) {
+        Link* link = find(handle);
+        return link ? link->queue.pending() : 0;
+    }
+
+    // Number Of Completed Packets for one handle
+    void completed(uint16_t handle, uint16_t count) {
+        if (Link* link = find(handle)) {
+            count = std::min(count, link->inFlight);
+            link->inFlight -= count;
+            credits = std::min<uint16_t>(credits + count, totalCredits);
+        }
+    }
+
+    // The link is gone, the controller drops whatever it still held for it.
+    void remove(uint16_t handle) {
+        if (Link* link = find(handle)) {
+            credits = std::min<uint16_t>(credits + link->inFlight, totalCredits);
+            link->queue.clear();
+            link->active = false;
+            link->inFlight = 0;
+        }
+    }
+
+    // Hands queued packets to `send` round robin across handles while credits last and
+    // `canSend` agrees. Returns the number of packets sent.
+    template <typename CanSend, typename Send>
+    size_t flush(CanSend canSend, Send send) {
+        size_t sent = 0;
+        size_t idle = 0;
+        while (credits > 0 && idle < MAX_LINKS && canSend()) {
+            Link& link = links[next];
+            next = (next + 1) % MAX_LINKS;
+            if (!link.active) {
+                idle++;
+                continue;
+            }
+            if (auto packet = link.queue.read(0)) {
+                send(packet);
+                link.inFlight++;
+                credits--;
+                sent++;
+                idle = 0;
+            } else {
+                idle++;
+            }
+        }
+        return sent;
+    }
+};
+
+}  // namespace wiipp
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+namespace wiipp {
+
+// HCI command flow control. The controller tells the host how many commands it
+// may send with Num_HCI_Command_Packets in every Command Complete and Command
+// Status event; before the first event the host may send one. Sent commands are
+// tracked by opcode until their Command Complete or Command Status arrives.
+class CommandFlow {
+public:
+    static constexpr size_t MAX_IN_FLIGHT = 8;
+
+    struct Command {
+        uint16_t opcode;
+        uint64_t target;  // First 6 parameter bytes, the BD_ADDR or connection handle of most commands
+    };
+
+private:
+    std::array<Command, MAX_IN_FLIGHT> inFlight;
+    size_t count{0};
+    uint8_t credits{1};
+
+public:
+    CommandFlow() = default;
+    CommandFlow(const CommandFlow&) = delete;
+    CommandFlow& operator=(const CommandFlow&) = delete;
+
+    bool canSend() const { return credits > 0 && count < MAX_IN_FLIGHT; }
+    size_t outstanding() const { return count; }
+
+    // `packet` is the H4 command packet as sent
+    void sent(const uint8_t* packet, size_t len) {
+        Command command{.opcode = static_cast<uint16_t>(packet[1] | packet[2] << 8), .target = 0};
+        for (size_t i = 0; i < 6 && 4 + i < len; ++i) {
+            command.target |= uint64_t{packet[4 + i]} << (8 * i);
+        }
+        inFlight[count++] = command;
+        credits--;
+    }
+
+    // Command Complete or Command Status for `opcode`, the oldest outstanding command with that
+    // opcode is removed and stored in `out`. Opcode 0x0000 only updates the credits. Returns false
+    // if no command with that opcode was outstanding.
+    bool completed(uint16_t opcode, uint8_t numCommandPackets, Command* out = nullptr) {
+        credits = numCommandPackets;
+        for (size_t i = 0; i < count && opcode != 0x0000; ++i) {
+            if (inFlight[i].opcode == opcode) {
+                if (out) {
+                    *out = inFlight[i];
+                }
+                for (size_t j = i + 1; j < count; ++j) {
+                    inFlight[j - 1] = inFlight[j];
+                }
+                count--;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // A command that timed out without Command Complete or Command Status. If it is still
+    // outstanding the controller will not answer it any more, so it is dropped and its credit
+    // given back. Returns false if no matching command was outstanding.
+    bool expired(uint16_t opcode, uint64_t target, uint64_t targetMask) {
+        for (size_t i = 0; i < count; ++i) {
+            if (inFlight[i].opcode == opcode && (inFlight[i].target & targetMask) == target) {
+                for (size_t j = i + 1; j < count; ++j) {
+                    inFlight[j - 1] = inFlight[j];
+                }
+                count--;
+                credits++;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void reset() {
+        count = 0;
+        credits = 1;
+    }
+};
+
+}  // namespace wiipp
@@ -1,9 +1,14 @@
-#include <vector>
-#include <algorithm>
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+#include "bluetooth.h"
 
 namespace wiipp {
 
 struct L2CapConnection {
+    uint16_t handle;
     uint16_t localCid;
     uint16_t psm;
     uint16_t remoteCid;
@@ -11,10 +16,40 @@ struct L2CapConnection {
 
     bool localConfigured;
     bool remoteConfigured;
+    DataSink sink;  // Data frames go here rather than to the ACL listener when set
 };
 
+// L2CAP channels in a fixed table of links, each with a few channel slots. Local CIDs
+// are handed out by the store and encode the link and slot, so a lookup by local CID
+// is a direct index. A lookup by PSM checks the slots of the link for the handle.
 class ConnectionStore {
-    std::vector<L2CapConnection> l2CapConnections;
+public:
+    static constexpr size_t MAX_LINKS = 7;
+    static constexpr size_t CHANNELS_PER_LINK = 4;  // HID control and interrupt, with room to spare
+    static constexpr uint16_t FIRST_CID = 0x0040;   // The first dynamically allocated CID
+
+private:
+    struct Slot {
+        bool used;
+        L2CapConnection connection;
+    };
+
+    struct Link {
+        uint16_t handle;
+        uint8_t channels;  // Slots in use, the link is free when 0
+        std::array<Slot, CHANNELS_PER_LINK> slots;
+    };
+
+    std::array<Link, MAX_LINKS> links{};
+
+    Link* findLink(uint16_t handle) {
+        for (auto& link : links) {
+            if (link.channels > 0 && link.handle == handle) {
+                return &link;
+            }
+        }
+        return nullptr;
+    }
 
 public:
     ConnectionStore() {}
@@ -22,32 +57,86 @@ public:
     ConnectionStore& operator=(const ConnectionStore&) = delete;
 
     L2CapConnection* findLocal(uint16_t handle, uint16_t localCid) {
-        auto itr = std::find_if(l2CapConnections.begin(), l2CapConnections.end(), [handle, localCid](const L2CapConnection& connection) {
-            return handle == handle && connection.localCid == localCid;
-        });
-        return &*itr;
+        size_t index = static_cast<uint16_t>(localCid - FIRST_CID);
+        if (index >= MAX_LINKS * CHANNELS_PER_LINK) {
+            return nullptr;
+        }
+        Slot& slot = links[index / CHANNELS_PER_LINK].slots[index % CHANNELS_PER_LINK];
+        if (!slot.used || slot.connection.handle != handle) {
+            return nullptr;
+        }
+        return &slot.connection;
     }
 
     L2CapConnection* findPsm(uint16_t handle, uint16_t psm) {
-        auto itr = std::find_if(l2CapConnections.begin(), l2CapConnections.end(), [handle, psm](const L2CapConnection& connection) {
-            return handle == handle && connection.psm == psm;
-        });
-        return &*itr;
+        Link* link = findLink(handle);
+        if (link == nullptr) {
+            return nullptr;
+        }
+        for (auto& slot : link->slots) {
+            if (slot.used && slot.connection.psm == psm) {
+                return &slot.connection;
+            }
+        }
+        return nullptr;
     }
 
     bool remove(L2CapConnection& connection) {
-        auto itr = std::remove_if(l2CapConnections.begin(), l2CapConnections.end(), [&connection](const L2CapConnection& e) {
-            return &e == &connection;
-        });
-        if (itr == l2CapConnections.end()) {
+        L2CapConnection* found = findLocal(connection.handle, connection.localCid);
+        if (found != &connection) {
             return false;
         }
-        l2CapConnections.erase(itr, l2CapConnections.end());
+        size_t index = connection.localCid - FIRST_CID;
+        links[index / CHANNELS_PER_LINK].slots[index % CHANNELS_PER_LINK].used = false;
+        links[index / CHANNELS_PER_LINK].channels--;
         return true;
     }
 
-    void emplace(L2CapConnection connection) {
-        l2CapConnections.emplace_back(std::move(connection));
+    // The ACL link is gone, and all of its channels with it
+    void removeLink(uint16_t handle) {
+        if (Link* link = findLink(handle)) {
+            for (auto& slot : link->slots) {
+                slot.used = false;
+            }
+            link->channels = 0;
+        }
+    }
+
+    // Allocates a local CID for a new channel. Returns nullptr if the link has no free
+    // slot, or there is no room for another link.
+    L2CapConnection* emplace(uint16_t handle, uint16_t psm, uint16_t remoteCid, uint16_t mtu) {
+        Link* link = findLink(handle);
+        if (link == nullptr) {
+            for (auto& candidate : links) {
+                if (candidate.channels == 0) {
+                    link = &candidate;
+                    link->handle = handle;
+                    break;
+                }
+            }
+        }
+        if (link == nullptr) {
+            return nullptr;
+        }
+        for (size_t i = 0; i < CHANNELS_PER_LINK; ++i) {
+            Slot& slot = link->slots[i];
+            if (!slot.used) {
+                slot.used = true;
+                slot.connection = L2CapConnection{
+                    .handle = handle,
+                    .localCid = static_cast<uint16_t>(FIRST_CID + (link - links.data()) * CHANNELS_PER_LINK + i),
+                    .psm = psm,
+                    .remoteCid = remoteCid,
+                    .mtu = mtu,
+                    .localConfigured = false,
+                    .remoteConfigured = false,
+                    .sink = DataSink{.receive = nullptr, .context = nullptr},
+                };
+                link->channels++;
+                return &slot.connection;
+            }
+        }
+        return nullptr;
     }
 };
 
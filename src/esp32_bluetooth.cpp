@@ -2,13 +2,20 @@
 
 #include <esp32-hal-bt.h>
 #include <esp_bt.h>
+#include <esp_timer.h>
 
+#include <algorithm>
+#include <cstring>
 #include <stdexcept>
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
 #include "log.h"
+#include "acl_scheduler.h"
+#include "command_flow.h"
 #include "connection_store.h"
+#include "l2cap_reassembler.h"
 #include "lowlevel_bt.h"
 #include "ring_buffer.h"
 #include <freertos/semphr.h>
@@ -26,9 +33,17 @@ static_assert(CONFIG_CLASSIC_BT_ENABLED, "Board does not support Bluetooth BR/ED
 namespace wiipp {
 
 static uint8_t g_identifier = 1;
-static uint16_t g_localCid = 0x0040;
 
 struct Esp32Bluetooth::Impl {
+    struct PendingCommand {
+        uint16_t opcode;
+        uint8_t event;  // The event that resolves the command, 0x0E for Command Complete
+        uint64_t key;   // BD_ADDR or connection handle the event must carry
+        uint64_t keyMask;
+        int64_t deadline;
+        Completion completion;
+    };
+
     Bluetooth *bluetooth;
     std::array<uint8_t, 6> macAddress;
     std::function<void(Bluetooth *)> readyListener;
@@ -44,110 +59,199 @@ struct Esp32Bluetooth::Impl {
     std::function<void(Bluetooth *, const ACLEvent &)> aclListener;
 
     RingBuffer rxBuffer;
-    RingBuffer txBuffer;
+    RingBuffer txBuffer;  // HCI commands, ACL data is queued per handle in aclScheduler
+    AclScheduler aclScheduler;
+    L2capReassembler reassembler;
+    CommandFlow commandFlow;
     ConnectionStore connections;
     bool initialized{false};
+    ProcessBudget budget{.packets = 8, .micros = 2000};
     std::unordered_set<uint64_t> discovered;
     std::unordered_set<uint64_t> connectRequests;
     std::unordered_map<uint64_t, HCIInquiryResult> nameRequests;
+    std::vector<PendingCommand> pendingCommands;
 
     Impl(Bluetooth *bluetooth) : bluetooth(bluetooth), rxBuffer(1024), txBuffer(1024) {
         esp_read_mac(macAddress.data(), ESP_MAC_BT);
     }
 
-    void step() {
-        while (esp_vhci_host_check_send_available()) {
+    void flushTx() {
+        while (commandFlow.canSend() && esp_vhci_host_check_send_available()) {
             if (auto txData = txBuffer.read(0)) {
                 log_d("\033[1;42mTX>\033[0m: %s", formatHex(txData.data(), txData.size()));
                 esp_vhci_host_send_packet(txData.data(), txData.size());
+                commandFlow.sent(txData.data(), txData.size());
             } else {
                 break;
             }
         }
+        aclScheduler.flush(esp_vhci_host_check_send_available, [](const RingData &txData) {
+            log_d("\033[1;42mTX>\033[0m: %s", formatHex(txData.data(), txData.size()));
+            esp_vhci_host_send_packet(txData.data(), txData.size());
+        });
+    }
 
-        if (auto rxData = rxBuffer.read(0)) {
-            const char *type;
-            uint8_t typeColor;
-            switch (rxData[0]) {
-                case 0x04:
-                    type = "HCI";
-                    typeColor = 44;
-                    handleHCIEvent(rxData[1], rxData.data() + 3, rxData[2]);
-                    break;
-                case 0x02:
-                    type = "ACL";
-                    typeColor = 43;
-                    {
-                        uint16_t handle = ((rxData[2] & 0x0F) << 8) | rxData[1];
-                        uint8_t packetBoundaryFlag = (rxData[2] & 0x30) >> 4;  // Packet_Boundary_Flag
-                        uint8_t broadcastFlag = (rxData[2] & 0xC0) >> 6;       // Broadcast_Flag
-
-                        if (packetBoundaryFlag != 0b10) {
-                            log_e("unsupported packet_boundary_flag = 0b%02B", packetBoundaryFlag);
-                            break;
-                        }
-
-                        if (broadcastFlag != 0b00) {
-                            log_e("unsupported broadcast_flag 0b%02B", broadcastFlag);
-                            break;
-                        }
-
-                        uint16_t len = (rxData[6] << 8) | rxData[5];
-                        uint16_t channelId = (rxData[8] << 8) | rxData[7];
-                        handleACLEvent(rxData[9], handle, channelId, rxData.data() + 9, len);
-                    }
-                    break;
-                default:
-                    type = "ERR";
-                    typeColor = 41;
-                    break;
+    ProcessResult step() {
+        flushTx();
+        if (!pendingCommands.empty()) {
+            expirePending();
+        }
+
+        size_t handled = 0;
+        int64_t start = esp_timer_get_time();
+        while (handled < budget.packets) {
+            if (auto rxData = rxBuffer.read(0)) {
+                handlePacket(rxData);
+                handled++;
+            } else {
+                break;
+            }
+            if (budget.micros != 0 && esp_timer_get_time() - start >= budget.micros) {
+                break;
             }
-            /*
-            if (rxData.size() > 2) {
-                if (rxData[0] != 0x04 || rxData[1] != 0x02) {
-                    log_d("\033[1;%dm[%s] [core:%d]\033[0m \033[1;43mRX>\033[0m: %s", typeColor, type, xPortGetCoreID(),
-                          formatHex(rxData.data(), rxData.size()));
+        }
+
+        // Send what the handlers queued without waiting for the next call
+        if (handled > 0) {
+            flushTx();
+        }
+        return ProcessResult{.handled = handled, .queued = rxBuffer.pending()};
+    }
+
+    void handlePacket(const RingData &rxData) {
+        const char *type;
+        uint8_t typeColor;
+        switch (rxData[0]) {
+            case 0x04:
+                type = "HCI";
+                typeColor = 44;
+                handleHCIEvent(rxData[1], rxData.data() + 3, rxData[2]);
+                break;
+            case 0x02:
+                type = "ACL";
+                typeColor = 43;
+                {
+                    uint16_t handle = ((rxData[2] & 0x0F) << 8) | rxData[1];
+                    uint8_t packetBoundaryFlag = (rxData[2] & 0x30) >> 4;  // Packet_Boundary_Flag
+                    uint8_t broadcastFlag = (rxData[2] & 0xC0) >> 6;       // Broadcast_Flag
+
+                    if (broadcastFlag != 0b00) {
+                        log_e("unsupported broadcast_flag 0b%02B", broadcastFlag);
+                        break;
+                    }
+
+                    uint16_t aclLen = (rxData[4] << 8) | rxData[3];
+                    auto fragment = rxData.view(5);
+                    if (fragment.size() < aclLen) {
+                        log_e("truncated ACL packet, %d of %d bytes", (int)fragment.size(), aclLen);
+                        break;
+                    }
+
+                    auto frame = reassembler.add(handle, packetBoundaryFlag, fragment.first(aclLen));
+                    if (frame.empty()) {
+                        break;
+                    }
+                    uint16_t channelId = (frame[3] << 8) | frame[2];
+                    handleACLEvent(handle, channelId, frame.subspan(L2capReassembler::HEADER_SIZE));
                 }
+                break;
+            default:
+                type = "ERR";
+                typeColor = 41;
+                break;
+        }
+        /*
+        if (rxData.size() > 2) {
+            if (rxData[0] != 0x04 || rxData[1] != 0x02) {
+                log_d("\033[1;%dm[%s] [core:%d]\033[0m \033[1;43mRX>\033[0m: %s", typeColor, type, xPortGetCoreID(),
+                      formatHex(rxData.data(), rxData.size()));
             }
-            */
         }
+        */
     }
 
     // HCI
-    void handleHCICommandComplete(uint8_t *data, size_t len) {
-        if (data[1] == 0x03 && data[2] == 0x0C) {  // reset
-            if (data[3] == 0x00) {
-                CHECK_RESULT(enqueue_cmd_read_bd_addr(txBuffer));
-            } else {
-                log_e("Reset failed");
-            }
-        } else if (data[1] == 0x09 && data[2] == 0x10) {  // read_bd_addr
-            if (data[3] == 0x00) {                        // OK
-                char name[] = "ESP32-BT-WIIP";
-                CHECK_RESULT(enqueue_cmd_write_local_name(txBuffer, (uint8_t *)name, sizeof(name)));
-            } else {
-                log_e("read_bd_addr failed.");
-            }
-        } else if (data[1] == 0x13 && data[2] == 0x0C) {  // write_local_name
-            if (data[3] == 0x00) {                        // OK
-                uint8_t cod[3] = {0x04, 0x05, 0x00};
-                CHECK_RESULT(enqueue_cmd_write_class_of_device(txBuffer, cod));
-            } else {
-                log_e("write_local_name failed.");
-            }
-        } else if (data[1] == 0x24 && data[2] == 0x0C) {  // write_class_of_device
-            if (data[3] == 0x00) {                        // OK
-                CHECK_RESULT(enqueue_cmd_write_scan_enable(txBuffer, 3));
-            } else {
-                log_e("write_class_of_device failed.");
-            }
-        } else if (data[1] == 0x1A && data[2] == 0x0C) {  // write_scan_enable
-            if (data[3] == 0x00) {                        // OK
-                initialized = true;
-                readyListener(bluetooth);
-            } else {
-                log_e("write_scan_enable failed.");
-            }
+    void handleHCICommandComplete(uint16_t opcode, uint8_t status, uint8_t *data, size_t len) {
+        switch (opcode) {
+            case HCI_RESET:
+                if (status == 0x00) {
+                    CHECK_RESULT(enqueue_cmd_read_buffer_size(txBuffer));
+                } else {
+                    log_e("Reset failed");
+                }
+                break;
+            case HCI_READ_BUFFER_SIZE:
+                if (status == 0x00) {
+                    uint16_t aclLength = (data[1] << 8) | data[0];
+                    uint16_t aclPackets = (data[4] << 8) | data[3];
+                    log_d("Controller ACL buffers: %d x %d bytes", aclPackets, aclLength);
+                    aclScheduler.setBufferSize(aclLength, aclPackets);
+                    CHECK_RESULT(enqueue_cmd_read_bd_addr(txBuffer));
+                } else {
+                    log_e("read_buffer_size failed.");
+                }
+                break;
+            case HCI_READ_BD_ADDR:
+                if (status == 0x00) {
+                    char name[] = "ESP32-BT-WIIP";
+                    CHECK_RESULT(enqueue_cmd_write_local_name(txBuffer, (uint8_t *)name, sizeof(name)));
+                } else {
+                    log_e("read_bd_addr failed.");
+                }
+                break;
+            case HCI_WRITE_LOCAL_NAME:
+                if (status == 0x00) {
+                    uint8_t cod[3] = {0x04, 0x05, 0x00};
+                    CHECK_RESULT(enqueue_cmd_write_class_of_device(txBuffer, cod));
+                } else {
+                    log_e("write_local_name failed.");
+                }
+                break;
+            case HCI_WRITE_CLASS_OF_DEVICE:
+                if (status == 0x00) {
+                    CHECK_RESULT(enqueue_cmd_write_scan_enable(txBuffer, 3));
+                } else {
+                    log_e("write_class_of_device failed.");
+                }
+                break;
+            case HCI_WRITE_SCAN_ENABLE:
+                if (status == 0x00) {
+                    initialized = true;
+                    readyListener(bluetooth);
+                } else {
+                    log_e("write_scan_enable failed.");
+                }
+                break;
+            default:
+                if (status != 0x00) {
+                    log_e("Command %04X failed with status %02X", opcode, status);
+                }
+                break;
+        }
+    }
+
+    // Commands answered with Command Status continue with their own event on success. On
+    // failure that event never comes, so clean up here.
+    void handleHCICommandStatus(const CommandFlow::Command &command, uint8_t status) {
+        if (status == 0x00) {
+            return;
+        }
+        log_e("Command %04X failed with status %02X", command.opcode, status);
+        resolveCommand(command, status, false);
+        uint64_t bdaddr = command.target & 0xFFFFFFFFFFFFull;
+        switch (command.opcode) {
+            case HCI_CREATE_CONNECTION:
+                connectRequests.erase(bdaddr);
+                hciListener(bluetooth, HCIConnectionFailed{
+                                           .bdaddr = bdaddr,
+                                           .handle = 0,
+                                           .reason = status,
+                                           .accepted = false,
+                                       });
+                break;
+            case HCI_REMOTE_NAME_REQUEST:
+                nameRequests.erase(bdaddr);
+                break;
         }
     }
 
@@ -171,15 +275,21 @@ struct Esp32Bluetooth::Impl {
 
     void handleHCIInqueryComplete(uint8_t *data, size_t len) {
         log_d("Scan complete");
+        resolveEvent(0x01, 0, data[0]);
         hciListener(bluetooth, HCIInquiryComplete{});
         discovered.clear();
     }
 
     void handleHCIDisconnect(uint8_t *data, size_t len) {
         uint8_t status = data[0];
+        uint16_t handle = ((data[2] & 0x0F) << 8) | data[1];
+        resolveEvent(0x05, handle, status, handle);
         if (status == 0x00) {
+            aclScheduler.remove(handle);
+            reassembler.remove(handle);
+            connections.removeLink(handle);
             hciListener(bluetooth, HCIDisconnected{
-                .handle = (uint8_t)(data[2] << 8 | data[1]),
+                .handle = handle,
                 .reason = data[3]
             });
         }
@@ -189,7 +299,18 @@ struct Esp32Bluetooth::Impl {
         uint8_t status = data[0];
         char *name = (char *)(data + 7);
         uint64_t bdaddr = *(const uint64_t *)(data + 1) & 0xFFFFFFFFFFFFull;
-        auto &inquiry = nameRequests.at(bdaddr);
+        resolveEvent(0x07, bdaddr, status);
+        auto itr = nameRequests.find(bdaddr);
+        if (itr == nameRequests.end()) {
+            return;
+        }
+        if (status != 0x00) {
+            // Page timeout and the like, the name bytes are undefined
+            log_w("Remote name request for %s failed with %02X", formatHex((uint8_t *)&bdaddr, 6), status);
+            nameRequests.erase(itr);
+            return;
+        }
+        auto &inquiry = itr->second;
         hciListener(bluetooth, HCIRemoteName{.inquiry =
                                                  HCIInquiryResult{
                                                      .bdaddr = inquiry.bdaddr,
@@ -205,6 +326,7 @@ struct Esp32Bluetooth::Impl {
         uint8_t status = data[0];
         uint16_t handle = data[2] << 8 | data[1];
         uint64_t bdaddr = *(const uint64_t *)(data + 3) & 0xFFFFFFFFFFFFull;
+        resolveEvent(0x03, bdaddr, status, handle);
         if (status == 0x00) {
             hciListener(bluetooth,
                         HCIConnectionEstablished{
@@ -241,22 +363,69 @@ struct Esp32Bluetooth::Impl {
 
     void handleHCILinkKeyRequest(uint8_t *data, size_t len) {
         uint64_t bdaddr = *(const uint64_t *)(data)&0xFFFFFFFFFFFFull;
-        uint8_t keyType = data[22];
 
-        hciListener(bluetooth, HCILinkKeyRequest{
-                                   .bdaddr = bdaddr,
-                                   .keyType = keyType,
-                                   .linkKeyData = data+6,
-                                   .size = 16,
-                               });
+        hciListener(bluetooth, HCILinkKeyRequest{.bdaddr = bdaddr});
+    }
+
+    void handleHCILinkKeyNotification(uint8_t *data, size_t len) {
+        if (len < 23) {
+            return;
+        }
+        HCILinkKeyNotification notification{
+            .bdaddr = *(const uint64_t *)(data)&0xFFFFFFFFFFFFull,
+            .linkKey = {},
+            .keyType = data[22],
+        };
+        memcpy(notification.linkKey.data(), data + 6, notification.linkKey.size());
+        hciListener(bluetooth, notification);
+    }
+
+    void handleHCIAuthenticationComplete(uint8_t *data, size_t len) {
+        uint16_t handle = ((data[2] & 0x0F) << 8) | data[1];
+        resolveEvent(0x06, handle, data[0], handle);
+    }
+
+    void handleHCINumberOfCompletedPackets(uint8_t *data, size_t len) {
+        uint8_t handles = data[0];
+        for (uint8_t i = 0; i < handles && 1 + 4 * (i + 1u) <= len; ++i) {
+            uint8_t *entry = data + 1 + 4 * i;
+            uint16_t handle = ((entry[1] & 0x0F) << 8) | entry[0];
+            uint16_t count = (entry[3] << 8) | entry[2];
+            aclScheduler.completed(handle, count);
+        }
     }
 
     void handleHCIEvent(uint8_t eventCode, uint8_t *data, size_t len) {
         switch (eventCode) {
-            case 0x0E:
+            case 0x0E: {
                 // Command complete event
-                handleHCICommandComplete(data, len);
+                if (len < 3) {
+                    log_w("Command complete event too short, %zu bytes", len);
+                    break;
+                }
+                uint16_t opcode = (data[2] << 8) | data[1];
+                CommandFlow::Command command{.opcode = opcode, .target = 0};
+                if (!commandFlow.completed(opcode, data[0], &command) && opcode != 0x0000) {
+                    log_w("Command complete for %04X, which was not sent", opcode);
+                }
+                // No status or return parameters, as in the NOP that only hands out credits
+                if (len < 4) {
+                    break;
+                }
+                handleHCICommandComplete(opcode, data[3], data + 4, len - 4);
+                resolveCommand(command, data[3], true);
+                break;
+            }
+            case 0x0F: {
+                // Command status event
+                uint16_t opcode = (data[3] << 8) | data[2];
+                CommandFlow::Command command{.opcode = opcode, .target = 0};
+                if (!commandFlow.completed(opcode, data[1], &command) && opcode != 0x0000) {
+                    log_w("Command status for %04X, which was not sent", opcode);
+                }
+                handleHCICommandStatus(command, data[0]);
                 break;
+            }
             case 0x02:
                 handleHCIInqueryResult(data, len);
                 break;
@@ -278,49 +447,145 @@ struct Esp32Bluetooth::Impl {
             case 0x17:
                 handleHCILinkKeyRequest(data, len);
                 break;
+            case 0x18:
+                handleHCILinkKeyNotification(data, len);
+                break;
             case 0x16:
                 handleHCIPINRequest(data, len);
                 break;
+            case 0x13:
+                handleHCINumberOfCompletedPackets(data, len);
+                break;
+            case 0x06:
+                handleHCIAuthenticationComplete(data, len);
+                break;
+        }
+    }
+
+    void sendHCIReset() {
+        commandFlow.reset();
+        CHECK_RESULT(enqueue_cmd_reset(txBuffer));
+    }
+
+    // Completions
+    static constexpr uint64_t BDADDR_KEY = 0xFFFFFFFFFFFFull;
+    static constexpr uint64_t HANDLE_KEY = 0x0FFFull;
+
+    Completion track(bool queued, uint16_t opcode, uint8_t event, uint64_t key, uint64_t keyMask,
+                     uint32_t timeoutMs) {
+        if (!queued) {
+            log_e("Failed to queue command %04X", opcode);
+            return Completion::resolved(CommandResult{.status = STATUS_NO_RESOURCES, .handle = 0});
+        }
+        Completion completion;
+        pendingCommands.push_back(PendingCommand{
+            .opcode = opcode,
+            .event = event,
+            .key = key & keyMask,
+            .keyMask = keyMask,
+            .deadline = esp_timer_get_time() + int64_t{timeoutMs} * 1000,
+            .completion = completion,
+        });
+        return completion;
+    }
+
+    // Resolves the oldest pending command matching `match`. Removed before resolving, as the
+    // continuation may well queue further commands.
+    template <typename Match>
+    void resolvePending(Match match, const CommandResult &result) {
+        for (auto itr = pendingCommands.begin(); itr != pendingCommands.end(); ++itr) {
+            if (match(*itr)) {
+                Completion completion = std::move(itr->completion);
+                pendingCommands.erase(itr);
+                completion.resolve(result);
+                return;
+            }
         }
     }
 
-    void sendHCIReset() { CHECK_RESULT(enqueue_cmd_reset(txBuffer)); }
+    void resolveEvent(uint8_t event, uint64_t key, uint8_t status, uint16_t handle = 0) {
+        resolvePending([event, key](const PendingCommand &p) { return p.event == event && p.key == (key & p.keyMask); },
+                       CommandResult{.status = status, .handle = handle});
+    }
 
-    void sendHCIDisconnect(uint16_t handle) { CHECK_RESULT(enqueue_cmd_disconnect(txBuffer, handle)); }
+    // Command Complete, or a failed Command Status, for a sent command
+    void resolveCommand(const CommandFlow::Command &command, uint8_t status, bool commandComplete) {
+        resolvePending(
+            [&command, commandComplete](const PendingCommand &p) {
+                return p.opcode == command.opcode && (p.event == 0x0E) == commandComplete &&
+                       p.key == (command.target & p.keyMask);
+            },
+            CommandResult{.status = status, .handle = 0});
+    }
 
-    void sendHCIScan() {
+    // Resolves every overdue command, one at a time as continuations may add or resolve others
+    void expirePending() {
+        int64_t now = esp_timer_get_time();
+        while (true) {
+            auto itr = std::find_if(pendingCommands.begin(), pendingCommands.end(),
+                                    [now](const PendingCommand &p) { return p.deadline <= now; });
+            if (itr == pendingCommands.end()) {
+                return;
+            }
+            log_w("Command %04X timed out", itr->opcode);
+            commandFlow.expired(itr->opcode, itr->key, itr->keyMask);
+            Completion completion = std::move(itr->completion);
+            pendingCommands.erase(itr);
+            completion.resolve(CommandResult{.status = STATUS_TIMEOUT, .handle = 0});
+        }
+    }
+
+    Completion sendHCIDisconnect(uint16_t handle) {
+        return track(enqueue_cmd_disconnect(txBuffer, handle), HCI_DISCONNECT, 0x05, handle, HANDLE_KEY, 5000);
+    }
+
+    Completion sendHCIScan() {
         if (!initialized) {
             log_e("Cannot sync, bluetooth not initialized");
-            return;
+            return Completion::resolved(CommandResult{.status = STATUS_COMMAND_DISALLOWED, .handle = 0});
         }
 
         uint8_t timeout = 0x10;  // Sync for 20.48 seconds (0x10 * 1.28s)
 
-        CHECK_RESULT(enqueue_cmd_inquiry(txBuffer, 0x9E8B33, timeout, 0x00));
+        return track(enqueue_cmd_inquiry(txBuffer, 0x9E8B33, timeout, 0x00), HCI_INQUIRY, 0x01, 0, 0, 30000);
     }
 
-    void sendHCIRequestRemoteName(const HCIInquiryResult &result) {
+    Completion sendHCIRequestRemoteName(const HCIInquiryResult &result) {
         nameRequests.emplace(result.bdaddr, result);
-        CHECK_RESULT(enqueue_cmd_remote_name_request(txBuffer, result.bdaddr, result.psrm, result.clkOffset));
+        return track(enqueue_cmd_remote_name_request(txBuffer, result.bdaddr, result.psrm, result.clkOffset),
+                     HCI_REMOTE_NAME_REQUEST, 0x07, result.bdaddr, BDADDR_KEY, 15000);
     }
 
-    void sendHCIConnect(const HCIInquiryResult &result) {
+    Completion sendHCIConnect(const HCIInquiryResult &result) {
         connectRequests.emplace(result.bdaddr);
-        CHECK_RESULT(
-            enqueue_cmd_create_connection(txBuffer, result.bdaddr, 0x0008, result.psrm, result.clkOffset, 0x00));
+        return track(
+            enqueue_cmd_create_connection(txBuffer, result.bdaddr, 0x0008, result.psrm, result.clkOffset, 0x00),
+            HCI_CREATE_CONNECTION, 0x03, result.bdaddr, BDADDR_KEY, 15000);
     }
 
-    void sendHCINegativeReply(uint64_t bdaddr) { CHECK_RESULT(enqueue_cmd_negative_reply(txBuffer, bdaddr)); }
+    Completion sendHCINegativeReply(uint64_t bdaddr) {
+        return track(enqueue_cmd_negative_reply(txBuffer, bdaddr), HCI_NEGATIVE_REPLY, 0x0E, bdaddr, BDADDR_KEY,
+                     5000);
+    }
 
-    void sendHCIPINReply(uint64_t bdaddr, uint8_t* pinData, size_t len) {
+    Completion sendHCILinkKeyReply(uint64_t bdaddr, std::span<const uint8_t, 16> linkKey) {
+        return track(enqueue_cmd_link_key_reply(txBuffer, bdaddr, linkKey.data()), HCI_LINK_KEY_REPLY, 0x0E, bdaddr,
+                     BDADDR_KEY, 5000);
+    }
+
+    Completion sendHCIPINReply(uint64_t bdaddr, uint8_t* pinData, size_t len) {
         if (len > 16) {
             log_e("PIN too long, max 16 characters");
-            return;
+            return Completion::resolved(CommandResult{.status = STATUS_COMMAND_DISALLOWED, .handle = 0});
         }
-        CHECK_RESULT(enqueue_cmd_pin_reply(txBuffer, bdaddr, pinData, len));
+        return track(enqueue_cmd_pin_reply(txBuffer, bdaddr, pinData, len), HCI_PIN_REPLY, 0x0E, bdaddr, BDADDR_KEY,
+                     5000);
     }
 
-    void sendHCIAuth(uint16_t handle) { CHECK_RESULT(enqueue_cmd_auth_request(txBuffer, handle)); }
+    Completion sendHCIAuth(uint16_t handle) {
+        return track(enqueue_cmd_auth_request(txBuffer, handle), HCI_AUTHENTICATION, 0x06, handle, HANDLE_KEY,
+                     30000);
+    }
 
     // ACL
     void handleL2ConfigurationRequest(uint16_t handle, uint8_t *data) {
@@ -348,30 +613,12 @@ struct Esp32Bluetooth::Impl {
         if (data[8] == 0x01 && data[9] == 0x02) {  // MTU
             uint16_t mtu = (data[11] << 8) | data[10];
             connection->mtu = mtu;
-            uint8_t packetBoundaryFlag = 0b10;  // Packet_Boundary_Flag
-            uint8_t broadcastFlag = 0b00;       // Broadcast_Flag
-            uint16_t channelId = 0x0001;
             uint16_t sourceCid = connection->remoteCid;
-            uint8_t data[] = {
-                0x05,        // CONFIGURATION RESPONSE
-                identifier,  // Identifier
-                0x0A,
-                0x00,  // Length: 0x000A
-                (uint8_t)(sourceCid & 0xFF),
-                (uint8_t)(sourceCid >> 8),  // Source CID
-                0x00,
-                0x00,  // Flags
-                0x00,
-                0x00,  // Res
-                0x01,
-                0x02,
-                (uint8_t)(mtu & 0xFF),
-                (uint8_t)(mtu >> 8)  // type=01 len=02 value=xx xx
-            };
-
-            uint16_t dataLen = 14;
-            CHECK_RESULT(enqueue_acl_l2cap_single_packet(txBuffer, handle, packetBoundaryFlag, broadcastFlag, channelId,
-                                                         data, dataLen));
+            sendL2Signal(handle, 0x05, identifier,  // CONFIGURATION RESPONSE
+                         U16{sourceCid},            // Source CID
+                         U16{0x0000},               // Flags
+                         U16{0x0000},               // Result: Success
+                         U8{0x01}, U8{0x02}, U16{mtu});  // type=01 len=02 value=xx xx
             connection->remoteConfigured = true;
             if (connection->remoteConfigured && connection->localConfigured) {
                 aclListener(bluetooth, ACLConnectionEstablished{
@@ -387,8 +634,6 @@ struct Esp32Bluetooth::Impl {
         uint8_t identifier = data[1];
         uint16_t destinationCid = (data[5] << 8) | data[4];
         uint16_t sourceCid = (data[7] << 8) | data[6];
-        uint32_t key = handle << 16 | destinationCid;
-        
         L2CapConnection* connection = connections.findLocal(handle, destinationCid);
         if (connection == nullptr) {
             // Send command reject rsp
@@ -396,18 +641,9 @@ struct Esp32Bluetooth::Impl {
         }
         log_d("Sending disconnect response");
         if (connection->remoteCid == sourceCid) {
-            uint8_t response[] = {
-                0x07,          // Disconnect response
-                identifier,  // Identifier
-                0x04,
-                0x00,  // Length: 0x0004
-                (uint8_t)(connection->localCid & 0xFF),
-                (uint8_t)(connection->localCid >> 8),  // Destination CID
-                (uint8_t)(connection->remoteCid & 0xFF),
-                (uint8_t)(connection->remoteCid >> 8),  // Source CID
-            };
-
-            sendL2DataChannel(handle, 0x0001, response, 8);
+            sendL2Signal(handle, 0x07, identifier,        // Disconnect response
+                         U16{connection->localCid},   // Destination CID
+                         U16{connection->remoteCid});  // Source CID
             connections.remove(*connection);
         } else {
             log_d("Mismatch");
@@ -444,9 +680,13 @@ struct Esp32Bluetooth::Impl {
     void handleL2ConfigurationResponse(uint16_t handle, uint8_t *data) {
         uint16_t sourceCid = (data[5] << 8) | data[4];
         auto * connection = connections.findLocal(handle, sourceCid);
+        if (connection == nullptr) {
+            log_w("Unexpected configuration response");
+            return;
+        }
 
         connection->localConfigured = true;
-        if (connection && connection->localConfigured && connection->remoteConfigured) {
+        if (connection->localConfigured && connection->remoteConfigured) {
             aclListener(bluetooth, ACLConnectionEstablished{
                                         .handle = handle,
                                         .sourceCid = sourceCid,
@@ -475,35 +715,36 @@ struct Esp32Bluetooth::Impl {
             .sourceCid = sourceCid,
             .psm = psm
         });
-        auto localCid = g_localCid++;
+        uint16_t localCid = 0x0000;
         if (accepted) {
-            connections.emplace(L2CapConnection{
-                .localCid = localCid,
-                .psm = psm,
-                .remoteCid = sourceCid,
-                .mtu = 0x00B9,
-                .localConfigured = false,
-                .remoteConfigured = false,
-            });
+            if (auto *connection = connections.emplace(handle, psm, sourceCid, L2CAP_MTU)) {
+                localCid = connection->localCid;
+            } else {
+                log_w("No free channel for PSM %04X on handle %d", psm, handle);
+                accepted = false;
+            }
         }
-        uint16_t result = accepted? 0x00 : 0x04; // Connection refused if idx == -1.
-        uint8_t response[] = {
-            0x03,
-            data[1], // Request identifier
-            0x08, 0x00,
-            (uint8_t)(localCid & 0xFF), (uint8_t)(localCid >> 8),
-            (uint8_t)(sourceCid & 0xFF), (uint8_t)(sourceCid >> 8),
-            (uint8_t)(result & 0xFF), (uint8_t)(result >> 8),
-            0x00, 0x00, // No status
-        };
-        sendL2DataChannel(handle, 0x0001, response, 12);
+        uint16_t result = accepted? 0x00 : 0x04; // Connection refused, no resources
+        sendL2Signal(handle, 0x03, data[1],  // CONNECTION RESPONSE to the request identifier
+                     U16{localCid},          // Destination CID
+                     U16{sourceCid},         // Source CID
+                     U16{result},
+                     U16{0x0000});           // No status
         if (accepted) { // Send config request
-            sendL2Configure(handle, sourceCid, 0x00B9);
+            sendL2Configure(handle, sourceCid, L2CAP_MTU);
         }
     }
 
-    void handleACLEvent(uint8_t event, uint16_t handle, uint16_t channelId, uint8_t *data, size_t len) {
-        switch (event) {
+    void handleACLEvent(uint16_t handle, uint16_t channelId, std::span<const uint8_t> payload) {
+        if (payload.empty()) {
+            return;
+        }
+        if (channelId != 0x0001) {
+            handleL2Data(handle, channelId, payload);
+            return;
+        }
+        uint8_t *data = const_cast<uint8_t *>(payload.data());
+        switch (payload[0]) {
             case 0x02:
                 handleL2ConnectionRequest(handle, data);
                 break;
@@ -523,63 +764,44 @@ struct Esp32Bluetooth::Impl {
                 handleL2DisconnectResponse(handle, data);
                 break;
             default:
-                aclListener(bluetooth, ACLData{
-                                           .handle = handle,
-                                           .channelId = channelId,
-                                           .data = data,
-                                           .len = len,
-                                       });
+                log_d("Unhandled signalling command %02X", payload[0]);
                 break;
         }
     }
 
-    void sendL2Configure(uint16_t handle, uint16_t destinationCid, uint16_t mtu) {
-        uint8_t data[] = {
-            0x04,          // CONFIGURATION REQUEST
-            g_identifier++,  // Identifier
-            0x08,
-            0x00,  // Length: 0x0008
-            (uint8_t)(destinationCid & 0xFF),
-            (uint8_t)(destinationCid >> 8),  // Destination CID
-            0x00,
-            0x00,  // Flags
-            0x01,
-            0x02,
-            (uint8_t)(mtu & 0xFF),
-            (uint8_t)(mtu >> 8)  // type=01 len=02 value=2 bytes mtu
-        };
+    // Data frames, the per report path. Channels with a sink skip the ACL listener.
+    void handleL2Data(uint16_t handle, uint16_t channelId, std::span<const uint8_t> payload) {
+        auto *connection = connections.findLocal(handle, channelId);
+        if (connection && connection->sink.receive) {
+            connection->sink.receive(connection->sink.context, handle, payload);
+            return;
+        }
+        aclListener(bluetooth, ACLData{
+                                   .handle = handle,
+                                   .channelId = channelId,
+                                   .data = payload,
+                               });
+    }
 
-        sendL2DataChannel(handle, 0x0001, data, 12);
+    void sendL2Configure(uint16_t handle, uint16_t destinationCid, uint16_t mtu) {
+        sendL2Signal(handle, 0x04, g_identifier++,  // CONFIGURATION REQUEST
+                     U16{destinationCid},           // Destination CID
+                     U16{0x0000},                   // Flags
+                     U8{0x01}, U8{0x02}, U16{mtu});  // type=01 len=02 value=2 bytes mtu
     }
 
     void sendL2Connect(uint16_t connection_handle, uint16_t psm, uint16_t mtu) {
-        uint8_t data[] = {0x02,        // CONNECTION REQUEST
-                          g_identifier,  // Identifier
-                          0x04,
-                          0x00,  // Length:     0x0004
-                          (uint8_t)(psm & 0xFF),
-                          (uint8_t)(psm >> 8),
-                          (uint8_t)(g_localCid & 0xFF),
-                          (uint8_t)(g_localCid >> 8)};
-        uint16_t data_len = 8;
-
-        sendL2DataChannel(connection_handle, 0x0001, data, 8);
-
-        // FIX the key to be concise independent on who is connecting.
-        connections.emplace(L2CapConnection{
-                                .localCid = g_localCid,
-                                .psm = psm,
-                                .remoteCid = 0,
-                                .mtu = mtu,
-                                .localConfigured = false,
-                                .remoteConfigured = false,
-        });
-        g_identifier++;
-        g_localCid++;
+        auto *connection = connections.emplace(connection_handle, psm, 0, mtu);
+        if (connection == nullptr) {
+            log_e("No free channel for PSM %04X on handle %d", psm, connection_handle);
+            return;
+        }
+        sendL2Signal(connection_handle, 0x02, g_identifier++,  // CONNECTION REQUEST
+                     U16{psm},
+                     U16{connection->localCid});  // Source CID
     }
 
     void sendL2Data(uint16_t handle, uint16_t psm, uint8_t *data, size_t len) {
-        uint32_t hp = (handle << 16) | psm;
         auto *connection = connections.findPsm(handle, psm);
         if (connection == nullptr) {
             log_e("Cannot send L2 data, handle/psm connection not found");
@@ -591,35 +813,65 @@ struct Esp32Bluetooth::Impl {
     void sendL2Disconnect(uint16_t handle, uint16_t psm) {
         auto *connection = connections.findPsm(handle, psm);
         if (connection) {
-            uint8_t data[] = {
-                0x06,          // Disconnect REQUEST
-                g_identifier++,  // Identifier
-                0x04,
-                0x00,  // Length: 0x0004
-                (uint8_t)(connection->remoteCid & 0xFF),
-                (uint8_t)(connection->remoteCid >> 8),
-                (uint8_t)(connection->localCid & 0xFF),
-                (uint8_t)(connection->localCid >> 8),
-            };
+            sendL2Signal(handle, 0x06, g_identifier++,    // Disconnect REQUEST
+                         U16{connection->remoteCid},  // Destination CID
+                         U16{connection->localCid});   // Source CID
+        }
+    }
 
-            sendL2DataChannel(handle, 0x0001, data, 8);
+    // L2CAP signalling command on CID 0x0001, encoded straight into the ACL queue
+    template <typename... Fields>
+    void sendL2Signal(uint16_t handle, uint8_t code, uint8_t identifier, const Fields &...fields) {
+        RingBuffer *queue = aclScheduler.queue(handle);
+        if (queue == nullptr) {
+            log_e("No ACL queue available for handle %d", handle);
+            return;
         }
+        constexpr uint16_t len = encode::size_of<Fields...>;
+        CHECK_RESULT(enqueue_acl_l2cap_fields(*queue, handle, 0b10, 0b00, 0x0001, maxAclLength(), U8{code},
+                                              U8{identifier}, U16{len}, fields...));
     }
 
     void sendL2DataChannel(uint16_t handle, uint16_t channelId, uint8_t* data, size_t len) {
         uint8_t packetBoundaryFlag = 0b10;  // Packet_Boundary_Flag
         uint8_t broadcastFlag = 0b00;       // Broadcast_Flag
 
-        CHECK_RESULT(enqueue_acl_l2cap_single_packet(txBuffer, handle, packetBoundaryFlag, broadcastFlag, channelId,
-                                                     data, len));
+        sendACL(handle, packetBoundaryFlag, broadcastFlag, channelId, data, len);
+    }
+
+    // Until the controller reports its ACL buffer size, fragment to the smallest it may have
+    static constexpr uint16_t DEFAULT_ACL_LENGTH = 27;
+
+    uint16_t maxAclLength() const {
+        return aclScheduler.packetLength() ? aclScheduler.packetLength() : DEFAULT_ACL_LENGTH;
+    }
+
+    void sendACL(uint16_t handle, uint8_t packetBoundaryFlag, uint8_t broadcastFlag, uint16_t channelId, uint8_t *data,
+                 size_t len) {
+        RingBuffer *queue = aclScheduler.queue(handle);
+        if (queue == nullptr) {
+            log_e("No ACL queue available for handle %d", handle);
+            return;
+        }
+        CHECK_RESULT(enqueue_acl_l2cap_packet(*queue, handle, packetBoundaryFlag, broadcastFlag, channelId, data, len,
+                                              maxAclLength()));
     }
 };
 
-std::function<int(uint8_t *data, size_t len)> gListener;
+// The VHCI callback runs on the controller task. The packet is copied once, straight into
+// an rx ring slot, and parsed in place from there by step().
+static RingBuffer *g_rxBuffer = nullptr;
 
 static void sendReady() {}
 
-static int recv(uint8_t *data, uint16_t len) { return gListener(data, len); }
+static int recv(uint8_t *data, uint16_t len) {
+    if (auto buffer = g_rxBuffer->allocate(len, portMAX_DELAY)) {
+        memcpy(buffer.data(), data, len);
+    } else {
+        log_w("Buffer error, dropping packets.");
+    }
+    return ESP_OK;
+}
 
 static const esp_vhci_host_callback_t callback = {sendReady, recv};
 
@@ -628,16 +880,7 @@ Esp32Bluetooth::Esp32Bluetooth() : m_impl(std::make_unique<Esp32Bluetooth::Impl>
         throw std::runtime_error("Failed to initialize Bluetooth");
     }
 
-    auto *impl = m_impl.get();
-    gListener = [impl](uint8_t *data, size_t len) {
-        if (auto buffer = impl->rxBuffer.allocate(len, portMAX_DELAY)) {
-            memcpy(buffer.data(), data, len);
-            return ESP_OK;
-        }
-        log_w("Buffer error, dropping packets.");
-        return ESP_OK;
-    };
-
+    g_rxBuffer = &m_impl->rxBuffer;
     esp_vhci_host_register_callback(&callback);
     m_impl->sendHCIReset();
 }
@@ -646,7 +889,20 @@ Esp32Bluetooth::~Esp32Bluetooth() { log_e("Shut down"); }
 
 void Esp32Bluetooth::onReady(const std::function<void(Bluetooth *)> &listener) { m_impl->readyListener = listener; }
 
-void Esp32Bluetooth::process() { m_impl->step(); }
+ProcessResult Esp32Bluetooth::process() { return m_impl->step(); }
+
+bool Esp32Bluetooth::setDataSink(uint16_t handle, uint16_t psm, const DataSink &sink) {
+    auto *connection = m_impl->connections.findPsm(handle, psm);
+    if (connection == nullptr) {
+        return false;
+    }
+    connection->sink = sink;
+    return true;
+}
+
+size_t Esp32Bluetooth::aclQueueDepth(uint16_t handle) { return m_impl->aclScheduler.depth(handle); }
+
+void Esp32Bluetooth::setProcessBudget(const ProcessBudget &budget) { m_impl->budget = budget; }
 
 // HCI
 void Esp32Bluetooth::onHCIEvent(const std::function<void(Bluetooth *, const HCIEvent &)> &listener) {
@@ -658,13 +914,13 @@ void Esp32Bluetooth::onHCIConnectionRequest(
     m_impl->connectionRequestListener = listener;
 }
 
-void Esp32Bluetooth::requestRemoteName(const HCIInquiryResult &result) { m_impl->sendHCIRequestRemoteName(result); }
+Completion Esp32Bluetooth::requestRemoteName(const HCIInquiryResult &result) { return m_impl->sendHCIRequestRemoteName(result); }
 
-void Esp32Bluetooth::connect(const HCIInquiryResult &result) { m_impl->sendHCIConnect(result); }
+Completion Esp32Bluetooth::connect(const HCIInquiryResult &result) { return m_impl->sendHCIConnect(result); }
 
-void Esp32Bluetooth::scan() { m_impl->sendHCIScan(); }
+Completion Esp32Bluetooth::scan() { return m_impl->sendHCIScan(); }
 
-void Esp32Bluetooth::disconnect(uint16_t handle) { m_impl->sendHCIDisconnect(handle); }
+Completion Esp32Bluetooth::disconnect(uint16_t handle) { return m_impl->sendHCIDisconnect(handle); }
 
 // ACL
 void Esp32Bluetooth::l2cap_connect(uint16_t handle, uint16_t psm, uint16_t mtu) {
@@ -675,12 +931,15 @@ void Esp32Bluetooth::onACLEvent(const std::function<void(Bluetooth *, const ACLE
     m_impl->aclListener = listener;
 }
 
-void Esp32Bluetooth::auth(uint16_t handle) { m_impl->sendHCIAuth(handle); }
+Completion Esp32Bluetooth::auth(uint16_t handle) { return m_impl->sendHCIAuth(handle); }
 
-void Esp32Bluetooth::negativeReply(uint64_t bdaddr) { m_impl->sendHCINegativeReply(bdaddr); }
+Completion Esp32Bluetooth::negativeReply(uint64_t bdaddr) { return m_impl->sendHCINegativeReply(bdaddr); }
+Completion Esp32Bluetooth::linkKeyReply(uint64_t bdaddr, std::span<const uint8_t, 16> linkKey) {
+    return m_impl->sendHCILinkKeyReply(bdaddr, linkKey);
+}
 
-void Esp32Bluetooth::sendPinReply(uint64_t bdaddr, uint8_t* pinData, size_t len) {
-    m_impl->sendHCIPINReply(bdaddr, pinData, len);
+Completion Esp32Bluetooth::sendPinReply(uint64_t bdaddr, uint8_t* pinData, size_t len) {
+    return m_impl->sendHCIPINReply(bdaddr, pinData, len);
 }
 
 void Esp32Bluetooth::onACLConnectionRequest(const std::function<bool(Bluetooth*, const ACLConnectionRequest&)>& listener) {
@@ -18,19 +18,21 @@ public:
     std::span<uint8_t, 6> macAddress() override;
 
     void onReady(const std::function<void(Bluetooth*)>&) override;
-    void process() override;
+    ProcessResult process() override;
+    void setProcessBudget(const ProcessBudget& budget) override;
 
     // HCI
     void onHCIEvent(const std::function<void(Bluetooth*, const HCIEvent&)>&) override;
     void onHCIConnectionRequest(const std::function<bool(Bluetooth*, const HCIConnectionRequest&)>& listener) override;
 
-    void scan() override;
-    void requestRemoteName(const HCIInquiryResult& result) override;
-    void connect(const HCIInquiryResult& result) override;
-    void auth(uint16_t handle) override;
-    void negativeReply(uint64_t bdaddr) override;
-    void disconnect(uint16_t handle) override;
-    void sendPinReply(uint64_t bdaddr, uint8_t* pinData, size_t len);
+    Completion scan() override;
+    Completion requestRemoteName(const HCIInquiryResult& result) override;
+    Completion connect(const HCIInquiryResult& result) override;
+    Completion auth(uint16_t handle) override;
+    Completion negativeReply(uint64_t bdaddr) override;
+    Completion linkKeyReply(uint64_t bdaddr, std::span<const uint8_t, 16> linkKey) override;
+    Completion disconnect(uint16_t handle) override;
+    Completion sendPinReply(uint64_t bdaddr, uint8_t* pinData, size_t len) override;
 
     // ACL
     void onACLEvent(const std::function<void(Bluetooth*, const ACLEvent&)>& acl) override;
@@ -38,6 +40,8 @@ public:
     void l2cap_connect(uint16_t handle, uint16_t psm, uint16_t mtu) override;
     void l2cap_disconnect(uint16_t handle, uint16_t psm) override;
     void l2send_data(uint16_t handle, uint16_t psm, uint8_t* data, size_t len) override;
+    bool setDataSink(uint16_t handle, uint16_t psm, const DataSink& sink) override;
+    size_t aclQueueDepth(uint16_t handle) override;
 };
 
 }  // namespace wiipp
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <span>
+
+#include "bluetooth.h"
+#include "log.h"
+
+namespace wiipp {
+
+// Reassembles L2CAP frames from ACL start and continuation fragments, per connection
+// handle. A start fragment that already holds the whole frame, the common case, is
+// handed back as is without copying.
+class L2capReassembler {
+public:
+    static constexpr size_t MAX_LINKS = 7;
+    static constexpr size_t MAX_FRAME = 1024;  // Basic L2CAP header plus the largest SDU we accept
+    static constexpr size_t HEADER_SIZE = 4;
+    static_assert(MAX_FRAME >= HEADER_SIZE + L2CAP_MTU);
+
+    // ACL Packet_Boundary_Flag values
+    static constexpr uint8_t START_NON_FLUSHABLE = 0b00;
+    static constexpr uint8_t CONTINUATION = 0b01;
+    static constexpr uint8_t START = 0b10;
+
+private:
+    struct Link {
+        uint16_t handle;
+        bool active;
+        uint16_t expected;  // Frame length including the L2CAP header
+        uint16_t received;
+        std::array<uint8_t, MAX_FRAME> frame;
+    };
+
+    std::array<Link, MAX_LINKS> links{};
+
+    Link* find(uint16_t handle) {
+        for (auto& link : links) {
+            if (link.active && link.handle == handle) {
+                return &link;
+            }
+        }
+        return nullptr;
+    }
+
+    Link* claim(uint16_t handle) {
+        if (Link* link = find(handle)) {
+            return link;
+        }
+        for (auto& link : links) {
+            if (!link.active) {
+                link.handle = handle;
+                link.active = true;
+                return &link;
+            }
+        }
+        return nullptr;
+    }
+
+    static size_t frameLength(std::span<const uint8_t> fragment) {
+        return HEADER_SIZE + (fragment[0] | fragment[1] << 8);
+    }
+
+public:
+    L2capReassembler() = default;
+    L2capReassembler(const L2capReassembler&) = delete;
+    L2capReassembler& operator=(const L2capReassembler&) = delete;
+
+    // Adds the ACL payload of one packet. Returns the complete L2CAP frame, header
+    // included, once the last fragment has arrived and an empty span until then. The
+    // frame stays valid until the next call for the same handle.
+    std::span<const uint8_t> add(uint16_t handle, uint8_t packetBoundaryFlag, std::span<const uint8_t> fragment) {
+        if (packetBoundaryFlag == CONTINUATION) {
+            Link* link = find(handle);
+            if (link == nullptr || link->expected == 0) {
+                log_w("L2CAP continuation without start on handle %d, dropped", handle);
+                return {};
+            }
+            if (link->received + fragment.size() > link->expected) {
+                log_e("L2CAP frame overrun on handle %d, %d of %d bytes", handle,
+                      (int)(link->received + fragment.size()), link->expected);
+                link->expected = 0;
+                return {};
+            }
+            memcpy(link->frame.data() + link->received, fragment.data(), fragment.size());
+            link->received += fragment.size();
+            if (link->received < link->expected) {
+                return {};
+            }
+            link->expected = 0;
+            return std::span<const uint8_t>(link->frame.data(), link->received);
+        }
+
+        if (packetBoundaryFlag != START && packetBoundaryFlag != START_NON_FLUSHABLE) {
+            log_e("unsupported packet_boundary_flag = 0b%02B", packetBoundaryFlag);
+            return {};
+        }
+
+        if (Link* link = find(handle); link && link->expected != 0) {
+            log_w("L2CAP frame on handle %d incomplete, %d of %d bytes", handle, link->received, link->expected);
+            link->expected = 0;
+        }
+
+        if (fragment.size() < HEADER_SIZE) {
+            log_e("ACL start fragment too short for an L2CAP header, %d bytes", (int)fragment.size());
+            return {};
+        }
+
+        size_t expected = frameLength(fragment);
+        if (fragment.size() >= expected) {
+            return fragment.first(expected);
+        }
+        if (expected > MAX_FRAME) {
+            log_e("L2CAP frame of %d bytes exceeds %d", (int)expected, (int)MAX_FRAME);
+            return {};
+        }
+
+        Link* link = claim(handle);
+        if (link == nullptr) {
+            log_e("No reassembly buffer for handle %d", handle);
+            return {};
+        }
+        memcpy(link->frame.data(), fragment.data(), fragment.size());
+        link->expected = expected;
+        link->received = fragment.size();
+        return {};
+    }
+
+    void remove(uint16_t handle) {
+        if (Link* link = find(handle)) {
+            link->active = false;
+            link->expected = 0;
+        }
+    }
+};
+
+}  // namespace wiipp
@@ -1,5 +1,8 @@
+#include <algorithm>
 #include <cstdint>
+#include <cstring>
 
+#include "packet_encoder.h"
 #include "ring_buffer.h"
 
 #define HCI_H4_CMD_PREAMBLE_SIZE (4)
@@ -13,6 +16,7 @@
 // OGF + OCF
 #define HCI_RESET (0x0003 | HCI_GRP_HOST_CONT_BASEBAND_CMDS)
 #define HCI_READ_BD_ADDR (0x0009 | HCI_GRP_INFO_PARAMS_CMDS)
+#define HCI_READ_BUFFER_SIZE (0x0005 | HCI_GRP_INFO_PARAMS_CMDS)
 #define HCI_WRITE_LOCAL_NAME (0x0013 | HCI_GRP_HOST_CONT_BASEBAND_CMDS)
 #define HCI_WRITE_CLASS_OF_DEVICE (0x0024 | HCI_GRP_HOST_CONT_BASEBAND_CMDS)
 #define HCI_WRITE_SCAN_ENABLE (0x001A | HCI_GRP_HOST_CONT_BASEBAND_CMDS)
@@ -21,281 +25,178 @@
 #define HCI_REMOTE_NAME_REQUEST (0x0019 | HCI_GRP_LINK_CONT_CMDS)
 #define HCI_CREATE_CONNECTION (0x0005 | HCI_GRP_LINK_CONT_CMDS)
 #define HCI_AUTHENTICATION (0x0011 | HCI_GRP_LINK_CONT_CMDS)
+#define HCI_LINK_KEY_REPLY (0x000B | HCI_GRP_LINK_CONT_CMDS)
 #define HCI_NEGATIVE_REPLY (0x000C | HCI_GRP_LINK_CONT_CMDS)
 #define HCI_PIN_REPLY (0x000D | HCI_GRP_LINK_CONT_CMDS)
 #define HCI_ACCEPT_CONNECTION (0x0009 | HCI_GRP_LINK_CONT_CMDS)
+#define HCI_REJECT_CONNECTION (0x000A | HCI_GRP_LINK_CONT_CMDS)
 #define HCI_DISCONNECT (0x0006 | HCI_GRP_LINK_CONT_CMDS)
 
 #define BD_ADDR_LEN (6)
 
-#define UINT16_TO_STREAM(p, u16)        \
-    {                                   \
-        *(p)++ = (uint8_t)(u16);        \
-        *(p)++ = (uint8_t)((u16) >> 8); \
-    }
-#define UINT8_TO_STREAM(p, u8) \
-    { *(p)++ = (uint8_t)(u8); }
-#define ARRAY_TO_STREAM(p, a, len)                                \
-    {                                                             \
-        int ijk;                                                  \
-        for (ijk = 0; ijk < len; ijk++) *(p)++ = (uint8_t)a[ijk]; \
-    }
-
-#define U64_ADDR_TO_STREAM(buf, addr)                 \
-    for (size_t i = 0; i < BD_ADDR_LEN; ++i) {        \
-        UINT8_TO_STREAM(buf, (addr >> i * 8) & 0xFF); \
-    }
-
 enum { H4_TYPE_COMMAND = 1, H4_TYPE_ACL = 2, H4_TYPE_SCO = 3, H4_TYPE_EVENT = 4 };
 
-static bool enqueue_cmd_reset(wiipp::RingBuffer& buffer) {
-    if (auto out = buffer.allocate(HCI_H4_CMD_PREAMBLE_SIZE)) {
-        uint8_t* buf = out.data();
-        UINT8_TO_STREAM(buf, H4_TYPE_COMMAND);
-        UINT16_TO_STREAM(buf, HCI_RESET);
-        UINT8_TO_STREAM(buf, 0);
-        return true;
-    }
-    return false;
+using wiipp::encode::BdAddr;
+using wiipp::encode::Bytes;
+using wiipp::encode::U16;
+using wiipp::encode::U24;
+using wiipp::encode::U8;
+
+// H4 command packet, the parameter length is computed from the fields
+template <typename... Params>
+static bool enqueue_cmd(wiipp::RingBuffer& buffer, uint16_t opcode, const Params&... params) {
+    constexpr size_t len = wiipp::encode::size_of<Params...>;
+    static_assert(len <= 255, "HCI command parameters are limited to 255 bytes");
+    return wiipp::encode::enqueue(buffer, U8{H4_TYPE_COMMAND}, U16{opcode}, U8{len}, params...);
 }
 
-static bool enqueue_cmd_read_bd_addr(wiipp::RingBuffer& buffer) {
-    if (auto out = buffer.allocate(HCI_H4_CMD_PREAMBLE_SIZE)) {
-        uint8_t* buf = out.data();
-        UINT8_TO_STREAM(buf, H4_TYPE_COMMAND);
-        UINT16_TO_STREAM(buf, HCI_READ_BD_ADDR);
-        UINT8_TO_STREAM(buf, 0);
-        return true;
-    }
-    return false;
+static bool enqueue_cmd_reset(wiipp::RingBuffer& buffer) { return enqueue_cmd(buffer, HCI_RESET); }
+
+static bool enqueue_cmd_read_bd_addr(wiipp::RingBuffer& buffer) { return enqueue_cmd(buffer, HCI_READ_BD_ADDR); }
+
+static bool enqueue_cmd_read_buffer_size(wiipp::RingBuffer& buffer) {
+    return enqueue_cmd(buffer, HCI_READ_BUFFER_SIZE);
 }
 
+// The name is null terminated unless it is 248 bytes long, longer names are cut
 static bool enqueue_cmd_write_local_name(wiipp::RingBuffer& buffer, uint8_t* name, uint8_t len) {
-    if (auto out = buffer.allocate(HCI_H4_CMD_PREAMBLE_SIZE + 248)) {
-        uint8_t* buf = out.data();
-        // name ends with null. TODO check len<=248
-        UINT8_TO_STREAM(buf, H4_TYPE_COMMAND);
-        UINT16_TO_STREAM(buf, HCI_WRITE_LOCAL_NAME);
-        UINT8_TO_STREAM(buf, 248);
-        ARRAY_TO_STREAM(buf, name, len);
-        for (uint8_t i = len; i < 248; i++) {
-            UINT8_TO_STREAM(buf, 0);
-        }
-        return true;
-    }
-    return false;
+    return enqueue_cmd(buffer, HCI_WRITE_LOCAL_NAME, Bytes<248>{name, len});
 }
 
 static bool enqueue_cmd_write_class_of_device(wiipp::RingBuffer& buffer, uint8_t* cod) {
-    if (auto out = buffer.allocate(HCI_H4_CMD_PREAMBLE_SIZE + 3)) {
-        uint8_t* buf = out.data();
-
-        UINT8_TO_STREAM(buf, H4_TYPE_COMMAND);
-        UINT16_TO_STREAM(buf, HCI_WRITE_CLASS_OF_DEVICE);
-        UINT8_TO_STREAM(buf, 3);
-        for (uint8_t i = 0; i < 3; i++) {
-            UINT8_TO_STREAM(buf, cod[i]);
-        }
-        return true;
-    }
-    return false;
+    return enqueue_cmd(buffer, HCI_WRITE_CLASS_OF_DEVICE, Bytes<3>{cod, 3});
 }
 
 static bool enqueue_cmd_write_scan_enable(wiipp::RingBuffer& buffer, uint8_t mode) {
-    if (auto out = buffer.allocate(HCI_H4_CMD_PREAMBLE_SIZE + 1)) {
-        uint8_t* buf = out.data();
-
-        UINT8_TO_STREAM(buf, H4_TYPE_COMMAND);
-        UINT16_TO_STREAM(buf, HCI_WRITE_SCAN_ENABLE);
-        UINT8_TO_STREAM(buf, 1);
-
-        UINT8_TO_STREAM(buf, mode);
-        return true;
-    }
-    return false;
+    return enqueue_cmd(buffer, HCI_WRITE_SCAN_ENABLE, U8{mode});
 }
 
 static bool enqueue_cmd_inquiry(wiipp::RingBuffer& buffer, uint32_t lap, uint8_t len, uint8_t num) {
-    if (auto out = buffer.allocate(HCI_H4_CMD_PREAMBLE_SIZE + 5)) {
-        uint8_t* buf = out.data();
-
-        UINT8_TO_STREAM(buf, H4_TYPE_COMMAND);
-        UINT16_TO_STREAM(buf, HCI_INQUIRY);
-        UINT8_TO_STREAM(buf, 5);
-
-        UINT8_TO_STREAM(buf, (lap & 0xFF));          // lap 0x33 <- 0x9E8B33
-        UINT8_TO_STREAM(buf, ((lap >> 8) & 0xFF));   // lap 0x8B
-        UINT8_TO_STREAM(buf, ((lap >> 16) & 0xFF));  // lap 0x9E
-        UINT8_TO_STREAM(buf, len);
-        UINT8_TO_STREAM(buf, num);
-        return true;
-    }
-    return false;
+    return enqueue_cmd(buffer, HCI_INQUIRY,
+                       U24{lap},  // LAP, 0x9E8B33 is the general inquiry access code
+                       U8{len},   // Inquiry_Length
+                       U8{num});  // Num_Responses
 }
 
-static bool enqueue_cmd_inquiry_cancel(wiipp::RingBuffer& buffer) {
-    if (auto out = buffer.allocate(HCI_H4_CMD_PREAMBLE_SIZE)) {
-        uint8_t* buf = out.data();
-
-        UINT8_TO_STREAM(buf, H4_TYPE_COMMAND);
-        UINT16_TO_STREAM(buf, HCI_INQUIRY_CANCEL);
-        UINT8_TO_STREAM(buf, 0);
-        return true;
-    }
-    return false;
-}
+static bool enqueue_cmd_inquiry_cancel(wiipp::RingBuffer& buffer) { return enqueue_cmd(buffer, HCI_INQUIRY_CANCEL); }
 
 static bool enqueue_cmd_remote_name_request(wiipp::RingBuffer& buffer, uint64_t bdaddr, uint8_t psrm, uint16_t clkofs) {
-    if (auto out = buffer.allocate(HCI_H4_CMD_PREAMBLE_SIZE + 10)) {
-        uint8_t* buf = out.data();
-
-        UINT8_TO_STREAM(buf, H4_TYPE_COMMAND);
-        UINT16_TO_STREAM(buf, HCI_REMOTE_NAME_REQUEST);
-        UINT8_TO_STREAM(buf, 6 + 1 + 1 + 2);
-
-        U64_ADDR_TO_STREAM(buf, bdaddr);
-
-        UINT8_TO_STREAM(buf, psrm);     // Page_Scan_Repetition_Mode
-        UINT8_TO_STREAM(buf, 0);        // Reserved
-        UINT16_TO_STREAM(buf, clkofs);  // Clock_Offset
-        return true;
-    }
-    return false;
+    return enqueue_cmd(buffer, HCI_REMOTE_NAME_REQUEST,
+                       BdAddr{bdaddr},
+                       U8{psrm},      // Page_Scan_Repetition_Mode
+                       U8{0},         // Reserved
+                       U16{clkofs});  // Clock_Offset
 }
 
 static bool enqueue_cmd_create_connection(wiipp::RingBuffer& buffer, uint64_t bd_addr, uint16_t pt, uint8_t psrm,
                                           uint16_t clkofs, uint8_t ars) {
-    if (auto out = buffer.allocate(HCI_H4_CMD_PREAMBLE_SIZE + 13)) {
-        uint8_t* buf = out.data();
-
-        UINT8_TO_STREAM(buf, H4_TYPE_COMMAND);
-        UINT16_TO_STREAM(buf, HCI_CREATE_CONNECTION);
-        UINT8_TO_STREAM(buf, 6 + 2 + 1 + 1 + 2 + 1);
-
-        U64_ADDR_TO_STREAM(buf, bd_addr);
-        UINT16_TO_STREAM(buf, pt);      // Packet_Type
-        UINT8_TO_STREAM(buf, psrm);     // Page_Scan_Repetition_Mode
-        UINT8_TO_STREAM(buf, 0);        // Reserved
-        UINT16_TO_STREAM(buf, clkofs);  // Clock_Offset
-        UINT8_TO_STREAM(buf, ars);      // Allow_Role_Switch
-        return true;
-    }
-    return false;
+    return enqueue_cmd(buffer, HCI_CREATE_CONNECTION,
+                       BdAddr{bd_addr},
+                       U16{pt},      // Packet_Type
+                       U8{psrm},     // Page_Scan_Repetition_Mode
+                       U8{0},        // Reserved
+                       U16{clkofs},  // Clock_Offset
+                       U8{ars});     // Allow_Role_Switch
 }
 
 static bool enqueue_cmd_auth_request(wiipp::RingBuffer& buffer, uint16_t connection_handle) {
-    if (auto out = buffer.allocate(HCI_H4_CMD_PREAMBLE_SIZE + 2)) {
-        uint8_t* buf = out.data();
-
-        UINT8_TO_STREAM(buf, H4_TYPE_COMMAND);
-        UINT16_TO_STREAM(buf, HCI_AUTHENTICATION);
-        UINT8_TO_STREAM(buf, 2);
-
-        UINT8_TO_STREAM(buf, connection_handle & 0xFF);
-        UINT8_TO_STREAM(buf, (connection_handle >> 8) & 0x0F);
-        return true;
-    }
-    return false;
+    return enqueue_cmd(buffer, HCI_AUTHENTICATION, U16{static_cast<uint16_t>(connection_handle & 0x0FFF)});
 }
 
 static bool enqueue_cmd_negative_reply(wiipp::RingBuffer& buffer, uint64_t bdaddr) {
-    if (auto out = buffer.allocate(HCI_H4_CMD_PREAMBLE_SIZE + 6)) {
-        uint8_t* buf = out.data();
-        UINT8_TO_STREAM(buf, H4_TYPE_COMMAND);
-        UINT16_TO_STREAM(buf, HCI_NEGATIVE_REPLY);
-        UINT8_TO_STREAM(buf, 6);
+    return enqueue_cmd(buffer, HCI_NEGATIVE_REPLY, BdAddr{bdaddr});
+}
 
-        U64_ADDR_TO_STREAM(buf, bdaddr);
-        return true;
-    }
-    return false;
+static bool enqueue_cmd_link_key_reply(wiipp::RingBuffer& buffer, uint64_t bdaddr, const uint8_t* link_key) {
+    return enqueue_cmd(buffer, HCI_LINK_KEY_REPLY, BdAddr{bdaddr}, Bytes<16>{link_key, 16});
 }
 
 static bool enqueue_cmd_pin_reply(wiipp::RingBuffer& buffer, uint64_t bdaddr, uint8_t* pin, size_t len) {
-    if (auto out = buffer.allocate(HCI_H4_CMD_PREAMBLE_SIZE + 23)) {
-        uint8_t* buf = out.data();
-
-        UINT8_TO_STREAM(buf, H4_TYPE_COMMAND);
-        UINT16_TO_STREAM(buf, HCI_PIN_REPLY);
-        UINT8_TO_STREAM(buf, 6 + 1 + 16);  // 23
-
-        U64_ADDR_TO_STREAM(buf, bdaddr);
-        UINT8_TO_STREAM(buf, len);  // Pin length
-
-        for (uint8_t i = 0; i < len; i++) {
-            UINT8_TO_STREAM(buf, pin[i]);
-        }
-
-        for (uint8_t i = 0; i < 16 - len; i++) {
-            UINT8_TO_STREAM(buf, 0);
-        }
-        return true;
-    }
-    return false;
+    return enqueue_cmd(buffer, HCI_PIN_REPLY,
+                       BdAddr{bdaddr},
+                       U8{static_cast<uint8_t>(len)},  // PIN_Code_Length
+                       Bytes<16>{pin, len});           // PIN_Code
 }
 
 static bool enqueue_cmd_accept_connection(wiipp::RingBuffer& buffer, uint64_t bd_addr) {
-    if (auto out = buffer.allocate(HCI_H4_CMD_PREAMBLE_SIZE + 7)) {
-        uint8_t* buf = out.data();
-
-        UINT8_TO_STREAM(buf, H4_TYPE_COMMAND);
-        UINT16_TO_STREAM(buf, HCI_ACCEPT_CONNECTION);
-        UINT8_TO_STREAM(buf, 6 + 1);
-        U64_ADDR_TO_STREAM(buf, bd_addr);
-        UINT8_TO_STREAM(buf, 0);
-        return true;
-    }
-    return false;
+    return enqueue_cmd(buffer, HCI_ACCEPT_CONNECTION, BdAddr{bd_addr}, U8{0});  // Role: become central
 }
 
 static bool enqueue_cmd_reject_connection(wiipp::RingBuffer& buffer, uint64_t bd_addr, uint8_t rejReason) {
-    if (auto out = buffer.allocate(HCI_H4_CMD_PREAMBLE_SIZE + 7)) {
-        uint8_t* buf = out.data();
-
-        UINT8_TO_STREAM(buf, H4_TYPE_COMMAND);
-        UINT16_TO_STREAM(buf, HCI_ACCEPT_CONNECTION);
-        UINT8_TO_STREAM(buf, 6 + 1);
-        U64_ADDR_TO_STREAM(buf, bd_addr);
-        UINT8_TO_STREAM(buf, rejReason);
-        return true;
-    }
-    return false;
+    return enqueue_cmd(buffer, HCI_REJECT_CONNECTION, BdAddr{bd_addr}, U8{rejReason});
 }
 
 static bool enqueue_cmd_disconnect(wiipp::RingBuffer& buffer, uint16_t connection_handle) {
-    if (auto out = buffer.allocate(HCI_H4_CMD_PREAMBLE_SIZE + 3)) {
-        uint8_t* buf = out.data();
-        UINT8_TO_STREAM(buf, H4_TYPE_COMMAND);
-        UINT16_TO_STREAM(buf, HCI_DISCONNECT);
-        UINT8_TO_STREAM(buf, 3);
-
-        UINT16_TO_STREAM(buf, connection_handle);
-        UINT8_TO_STREAM(buf, 0x15);
-        return true;
-    }
-    return false;
+    return enqueue_cmd(buffer, HCI_DISCONNECT, U16{connection_handle},
+                       U8{0x15});  // Remote Device Terminated Connection due to Power Off
 }
 
-// TODO long data is split to multi packets
-static void make_l2cap_single_packet(uint8_t* buf, uint16_t channel_id, uint8_t* data, uint16_t len) {
-    UINT16_TO_STREAM(buf, len);
-    UINT16_TO_STREAM(buf, channel_id);  // 0x0001=Signaling channel
-    ARRAY_TO_STREAM(buf, data, len);
+// ACL header Handle field: 12 bit connection handle, Packet_Boundary_Flag and Broadcast_Flag
+static uint16_t acl_handle_flags(uint16_t connection_handle, uint8_t packet_boundary_flag, uint8_t broadcast_flag) {
+    return (connection_handle & 0x0FFF) | packet_boundary_flag << 12 | broadcast_flag << 14;
 }
 
-static bool enqueue_acl_l2cap_single_packet(wiipp::RingBuffer& buffer, uint16_t connection_handle,
-                                            uint8_t packet_boundary_flag, uint8_t broadcast_flag, uint16_t channel_id,
-                                            uint8_t* data, uint8_t len) {
-    if (auto out = buffer.allocate(HCI_H4_ACL_PREAMBLE_SIZE + len + 4)) {
-        uint8_t* buf = out.data();
-        uint8_t* l2cap_buf = buf + HCI_H4_ACL_PREAMBLE_SIZE;
-        make_l2cap_single_packet(l2cap_buf, channel_id, data, len);
-
-        UINT8_TO_STREAM(buf, H4_TYPE_ACL);
-        UINT8_TO_STREAM(buf, connection_handle & 0xFF);
-        UINT8_TO_STREAM(buf, ((connection_handle >> 8) & 0x0F) | packet_boundary_flag << 4 | broadcast_flag << 6);
-        UINT16_TO_STREAM(buf, len + 4);
-        return true;
+// Enqueues an L2CAP basic frame for `channel_id` as ACL packets of at most `max_acl_len`
+// bytes of payload each, the first flagged `packet_boundary_flag` and the rest as
+// continuations. Either every fragment is queued or none is: the room for all of them is
+// checked before the first is written, so a full buffer never leaves a partial frame.
+static bool enqueue_acl_l2cap_packet(wiipp::RingBuffer& buffer, uint16_t connection_handle,
+                                     uint8_t packet_boundary_flag, uint8_t broadcast_flag, uint16_t channel_id,
+                                     const uint8_t* data, size_t len, uint16_t max_acl_len) {
+    if (max_acl_len <= 4 || len > 0xFFFF) {  // The L2CAP length field is 16 bits
+        return false;
     }
-    return false;
+
+    // The first fragment carries the 4 byte L2CAP header and max_acl_len - 4 bytes of data
+    size_t first_chunk = max_acl_len - 4;
+    size_t fragments = len <= first_chunk ? 1 : 1 + (len - first_chunk + max_acl_len - 1) / max_acl_len;
+    auto fragment_size = [&](size_t i) -> size_t {
+        if (i == 0) {
+            return HCI_H4_ACL_PREAMBLE_SIZE + 4 + std::min(len, first_chunk);
+        }
+        return HCI_H4_ACL_PREAMBLE_SIZE + std::min<size_t>(len - first_chunk - (i - 1) * max_acl_len, max_acl_len);
+    };
+    if (!buffer.canAllocate(fragments, fragment_size)) {
+        return false;
+    }
+
+    size_t sent = 0;
+    for (size_t i = 0; i < fragments; ++i) {
+        bool first = i == 0;
+        uint16_t header_len = first ? 4 : 0;
+        uint16_t chunk = fragment_size(i) - HCI_H4_ACL_PREAMBLE_SIZE - header_len;
+        auto out = buffer.allocate(HCI_H4_ACL_PREAMBLE_SIZE + header_len + chunk);
+        if (!out) {
+            return false;
+        }
+        uint8_t flags = first ? packet_boundary_flag : 0b01;  // 0b01=Continuing fragment
+        uint8_t* buf = out.data();
+        wiipp::encode::write(buf, U8{H4_TYPE_ACL}, U16{acl_handle_flags(connection_handle, flags, broadcast_flag)},
+                             U16{static_cast<uint16_t>(header_len + chunk)});
+        buf += HCI_H4_ACL_PREAMBLE_SIZE;
+        if (first) {
+            wiipp::encode::write(buf, U16{static_cast<uint16_t>(len)}, U16{channel_id});  // 0x0001=Signaling channel
+            buf += 4;
+        }
+        memcpy(buf, data + sent, chunk);
+        sent += chunk;
+    }
+    return true;
+}
+
+// An L2CAP basic frame built from fields. Written straight into a single ACL packet when it
+// fits in `max_acl_len`, fragmented like enqueue_acl_l2cap_packet otherwise.
+template <typename... Fields>
+static bool enqueue_acl_l2cap_fields(wiipp::RingBuffer& buffer, uint16_t connection_handle,
+                                     uint8_t packet_boundary_flag, uint8_t broadcast_flag, uint16_t channel_id,
+                                     uint16_t max_acl_len, const Fields&... fields) {
+    constexpr uint16_t len = wiipp::encode::size_of<Fields...>;
+    if (len + 4 <= max_acl_len) {
+        return wiipp::encode::enqueue(buffer, U8{H4_TYPE_ACL},
+                                      U16{acl_handle_flags(connection_handle, packet_boundary_flag, broadcast_flag)},
+                                      U16{len + 4}, U16{len}, U16{channel_id}, fields...);
+    }
+    auto frame = wiipp::encode::to_array(fields...);
+    return enqueue_acl_l2cap_packet(buffer, connection_handle, packet_boundary_flag, broadcast_flag, channel_id,
+                                    frame.data(), len, max_acl_len);
 }
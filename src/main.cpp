@@ -4,7 +4,9 @@
 #include <span>
 
 #include "esp32_bluetooth.h"
+#include "event_queue.h"
 #include "log.h"
+#include "nvs_storage.h"
 #include "utils.h"
 #include "wiipp.h"
 
@@ -13,8 +15,46 @@
 constexpr int LED = 10;
 wiipp::Bluetooth* bt;
 wiipp::Wii* wii;
+// Logging over serial is slow, so events are logged from a task on the other core
+wiipp::EventQueue* events;
+
+void logEvent(const wiipp::WiiEvent& event) {
+    std::visit(overloaded{
+        [](const wiipp::BalanceBoardConnected& board) {
+            log_i("Balance board connected %04X", board.handle);
+
+        },
+        [](const wiipp::BalanceBoardDisconnected& board) {
+            log_i("Balance board disconnected %04X", board.handle);
+        },
+        [](const wiipp::BalanceBoardData&) {},
+        [](const wiipp::WiimoteConnected& remote) {
+            log_i("Wii remote connected %04X", remote.handle);
+        },
+        [](const wiipp::WiimoteDisconnected& remote) {
+            log_i("Wii remote disconnected %04X", remote.handle);
+        },
+        [](const wiipp::WiimoteData& data) {
+            const auto& dot = data.ir[0];
+            log_d("Buttons %04X, IR %s %u %u", data.buttons, dot.visible ? "at" : "lost", dot.x, dot.y);
+        },
+        [](const wiipp::BalanceBoardMetrics& metrics) {
+            log_d("Weight: %.2f CoP: %.1f %.1f mm, sway path %.1f mm, %.1f mm/s, area %u mm^2",
+                  metrics.weight / 1000.0, metrics.copX / 10.0, metrics.copY / 10.0,
+                  metrics.pathLength / 10.0, metrics.meanVelocity / 10.0, metrics.swayArea);
+        },
+        [](const auto&) {},
+    }, event);
+}
+
+void drainEvents(void*) {
+    while (true) {
+        if (events->drain(logEvent) == 0) {
+            vTaskDelay(pdMS_TO_TICKS(10));
+        }
+    }
+}
 
-uint64_t last{0};
 void setup() {
     Serial.begin(115200);
     pinMode(LED, OUTPUT);
@@ -23,6 +63,7 @@ void setup() {
     bt->onReady([](auto...) {
         log_d("Bluetooth initialized");
     });
+    // The scan LED is quick enough to switch right away
     wii = new wiipp::Wii(bt, [](const wiipp::WiiEvent& event) {
         std::visit(overloaded{
             [](const wiipp::ScanStarted&) {
@@ -31,24 +72,17 @@ void setup() {
             [](const wiipp::ScanStopped&) {
                 digitalWrite(LED, HIGH);
             },
-            [](const wiipp::BalanceBoardConnected& board) {
-                log_i("Balance board connected %04X", board.handle);
-
-            },
-            [](const wiipp::BalanceBoardDisconnected& board) {
-                log_i("Balance board disconnected %04X", board.handle);
-            },
-            [](const wiipp::BalanceBoardData& data) {
-                float totalWeight = data.tr + data.br + data.tl + data.bl;
-                float adjusted = (.999 * totalWeight * (1.0 - .0007 * (data.temperature - data.referenceTemperature)));
-                auto now = millis();
-                if (now -last > 2500) {
-                    log_d("Weight: %.2f %.2f %d %d %d %d", totalWeight/1000, adjusted/1000, data.tr, data.br, data.tl, data.bl);
-                    last = now;
-                }
-            },
+            [](const auto&) {},
         }, event);
-    });
+    }, wiipp::Wii::NO_SAMPLES);
+
+    events = new wiipp::EventQueue(64);
+    wii->subscribe(events, 0.4f);
+    // loop() runs on the application core
+    xTaskCreatePinnedToCore(drainEvents, "events", 4096, nullptr, 1, nullptr, ARDUINO_RUNNING_CORE == 0 ? 1 : 0);
+
+    wii->setStorage(new wiipp::NvsStorage());
+    wii->setMetrics(true);
 
     bt->onReady([](const wiipp::Bluetooth* p) {
         log_d("Bluetooth device ready, starting scan");
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// Host microbenchmarks and checks, selected by name on the native program command line.
+
+namespace wiipp::native {
+
+// FreeRtosRingBuffer (on the host stand-in) against SpscRingBuffer, same thread and across threads.
+void ringBenchmark(double seconds);
+
+// The float conversion BalanceBoard used before the fixed point one, for reference. `calibration`
+// is the 0kg, 17kg and 34kg blocks as read from the board.
+int32_t interpolate(uint16_t value, const std::array<uint16_t, 12>& calibration, size_t sensor);
+
+// 0x34 report conversion: the old float interpolation, one report at a time and
+// decodeBalanceBoardReports over `count` reports. False if the fixed point results are more
+// than 1 g from the float ones, or batch and single report decoding disagree.
+bool decodeBenchmark(double seconds, size_t count);
+
+// Wii remote IR decoding of `count` reports in the basic and extended formats: per dot
+// branches against decodeIr, and decodeIr after decodeInputReport.
+void irBenchmark(double seconds, size_t count);
+
+// Checks of host testable pieces, logs every failure and returns true if all passed.
+bool selfTest();
+
+}  // namespace wiipp::native
@@ -0,0 +1,143 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <vector>
+
+#include "balance_board.h"
+#include "benchmarks.h"
+#include "log.h"
+
+namespace wiipp::native {
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr std::array<uint16_t, 12> RAW_CALIBRATION = {
+    0x0400, 0x0440, 0x0480, 0x04C0,  // 0kg
+    0x0B00, 0x0B40, 0x0B80, 0x0BC0,  // 17kg
+    0x1200, 0x1240, 0x1280, 0x12C0,  // 34kg
+};
+
+struct Samples {
+    std::vector<uint16_t> tr, br, tl, bl;
+    std::vector<uint8_t> temperature, batteryLevel;
+
+    explicit Samples(size_t count)
+        : tr(count), br(count), tl(count), bl(count), temperature(count), batteryLevel(count) {}
+
+    BalanceBoardSamples view() {
+        return {tr.data(), br.data(), tl.data(), bl.data(), temperature.data(), batteryLevel.data()};
+    }
+};
+
+// Runs `decode` over the reports until `seconds` have passed, returns ns per report
+template <typename F>
+double measure(double seconds, size_t count, F decode) {
+    uint64_t rounds = 0;
+    auto start = Clock::now();
+    auto end = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds));
+    while (Clock::now() < end) {
+        decode();
+        rounds++;
+    }
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    return elapsed * 1e9 / (rounds * count);
+}
+
+}  // namespace
+
+int32_t interpolate(uint16_t value, const std::array<uint16_t, 12>& calibration, size_t sensor) {
+    const uint16_t* cal = calibration.data() + sensor;
+    float weight = 0;
+    if (value < cal[0]) {
+        weight = 0;
+    } else if (value < cal[4]) {
+        weight = 17 * (float)(value - cal[0]) / (float)(cal[4] - cal[0]);
+    } else if (cal[8] == cal[4]) {
+        weight = 17;  // Divided by zero before, this is what the fixed point version makes of it
+    } else {
+        weight = 17 + 17 * (float)(value - cal[4]) / (float)(cal[8] - cal[4]);
+    }
+    return weight * 1000;
+}
+
+bool decodeBenchmark(double seconds, size_t count) {
+    std::vector<uint8_t> reports(count * BALANCE_BOARD_REPORT_SIZE);
+    for (size_t i = 0; i < count; ++i) {
+        uint8_t* report = reports.data() + i * BALANCE_BOARD_REPORT_SIZE;
+        report[0] = 0xA1;
+        report[1] = 0x34;
+        for (size_t s = 0; s < 4; ++s) {
+            // Sweep every sensor from below 0kg to above 34kg
+            uint16_t value = 0x0300 + (i * 7 + s * 331) % 0x1100;
+            report[4 + 2 * s] = value >> 8;
+            report[5 + 2 * s] = value & 0xFF;
+        }
+        report[12] = 0x19;
+        report[14] = 0xC0;
+    }
+    auto calibration = BalanceBoardCalibration::fromRaw(RAW_CALIBRATION, 0x19);
+
+    Samples single(count);
+    Samples batch(count);
+    Samples floats(count);
+
+    double floatNs = measure(seconds, count, [&] {
+        for (size_t i = 0; i < count; ++i) {
+            const uint8_t* mem = reports.data() + i * BALANCE_BOARD_REPORT_SIZE + 4;
+            uint16_t values[4];
+            for (size_t s = 0; s < 4; ++s) {
+                values[s] = mem[2 * s] << 8 | mem[2 * s + 1];
+            }
+            floats.tr[i] = interpolate(values[0], RAW_CALIBRATION, 0);
+            floats.br[i] = interpolate(values[1], RAW_CALIBRATION, 1);
+            floats.tl[i] = interpolate(values[2], RAW_CALIBRATION, 2);
+            floats.bl[i] = interpolate(values[3], RAW_CALIBRATION, 3);
+            floats.temperature[i] = mem[8];
+            floats.batteryLevel[i] = mem[10];
+        }
+    });
+    // One report at a time, as BalanceBoard::onData converts live reports
+    double singleNs = measure(seconds, count, [&] {
+        for (size_t i = 0; i < count; ++i) {
+            const uint8_t* mem = reports.data() + i * BALANCE_BOARD_REPORT_SIZE + 4;
+            uint16_t values[4];
+            for (size_t s = 0; s < 4; ++s) {
+                values[s] = mem[2 * s] << 8 | mem[2 * s + 1];
+            }
+            single.tr[i] = BalanceBoardCalibration::grams(values[0], calibration.sensors[0]);
+            single.br[i] = BalanceBoardCalibration::grams(values[1], calibration.sensors[1]);
+            single.tl[i] = BalanceBoardCalibration::grams(values[2], calibration.sensors[2]);
+            single.bl[i] = BalanceBoardCalibration::grams(values[3], calibration.sensors[3]);
+            single.temperature[i] = mem[8];
+            single.batteryLevel[i] = mem[10];
+        }
+    });
+    double batchNs = measure(seconds, count, [&] { decodeBalanceBoardReports(reports, calibration, batch.view()); });
+
+    size_t mismatches = 0;
+    int maxFloatError = 0;
+    for (size_t i = 0; i < count; ++i) {
+        mismatches += single.tr[i] != batch.tr[i] || single.br[i] != batch.br[i] || single.tl[i] != batch.tl[i] ||
+                      single.bl[i] != batch.bl[i] || single.temperature[i] != batch.temperature[i] ||
+                      single.batteryLevel[i] != batch.batteryLevel[i];
+        maxFloatError = std::max({maxFloatError, std::abs(floats.tr[i] - batch.tr[i]),
+                                  std::abs(floats.br[i] - batch.br[i]), std::abs(floats.tl[i] - batch.tl[i]),
+                                  std::abs(floats.bl[i] - batch.bl[i])});
+    }
+
+    log_i("0x34 report decoding, %zu reports:", count);
+    log_i("  float interpolate:   %6.2f ns per report", floatNs);
+    log_i("  fixed point, single: %6.2f ns per report", singleNs);
+    log_i("  fixed point, batch:  %6.2f ns per report", batchNs);
+    if (mismatches != 0 || maxFloatError > 1) {
+        log_e("Batch %s single report decoding (%zu mismatches), at most %d g from float",
+              mismatches ? "differs from" : "matches", mismatches, maxFloatError);
+        return false;
+    }
+    log_i("Batch matches single report decoding, at most %d g from float", maxFloatError);
+    return true;
+}
+
+}  // namespace wiipp::native
@@ -0,0 +1,206 @@
+#include <freertos/ringbuf.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+// A mutex/condition variable model of the FreeRTOS NOSPLIT ring buffer. Items
+// are stored contiguously with an 8 byte header and 4 byte alignment, so the
+// capacity behaves like the one on the device.
+
+namespace {
+
+constexpr size_t HEADER_SIZE = 8;
+
+struct Item {
+    size_t offset;
+    size_t size;
+    size_t end;
+    bool complete;
+    bool read;
+    bool returned;
+};
+
+struct Ringbuf {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<uint8_t> storage;
+    std::deque<Item> items;
+    size_t head{0};
+    size_t tail{0};
+
+    explicit Ringbuf(size_t size) : storage(size) {}
+
+    bool wait(std::unique_lock<std::mutex> &lock, TickType_t ticks, const auto &ready) {
+        if (ticks == 0) {
+            return ready();
+        }
+        if (ticks == portMAX_DELAY) {
+            cv.wait(lock, ready);
+            return true;
+        }
+        return cv.wait_for(lock, std::chrono::milliseconds(ticks), ready);
+    }
+
+    Item *reserve(size_t size) {
+        size_t footprint = HEADER_SIZE + ((size + 3) & ~size_t{3});
+        if (items.empty()) {
+            head = tail = 0;
+        }
+
+        size_t offset;
+        if (!items.empty() && head == tail) {
+            return nullptr;  // Full
+        } else if (tail >= head) {
+            if (footprint <= storage.size() - tail) {
+                offset = tail;
+            } else if (footprint <= head) {
+                offset = 0;  // Wrap, wasting the tail end
+            } else {
+                return nullptr;
+            }
+        } else if (footprint <= head - tail) {
+            offset = tail;
+        } else {
+            return nullptr;
+        }
+
+        tail = (offset + footprint) % storage.size();
+        items.push_back(Item{
+            .offset = offset + HEADER_SIZE,
+            .size = size,
+            .end = tail,
+            .complete = false,
+            .read = false,
+            .returned = false,
+        });
+        return &items.back();
+    }
+
+    // Largest item reserve() would take right now
+    size_t maxItemSize() {
+        size_t free;
+        if (items.empty()) {
+            free = storage.size();
+        } else if (head == tail) {
+            return 0;
+        } else if (tail > head) {
+            free = std::max(storage.size() - tail, head);
+        } else {
+            free = head - tail;
+        }
+        return free > HEADER_SIZE ? (free - HEADER_SIZE) & ~size_t{3} : 0;
+    }
+
+    Item *find(void *data) {
+        for (auto &item : items) {
+            if (storage.data() + item.offset == data) {
+                return &item;
+            }
+        }
+        return nullptr;
+    }
+
+    Item *next() {
+        for (auto &item : items) {
+            if (!item.read) {
+                return item.complete ? &item : nullptr;
+            }
+        }
+        return nullptr;
+    }
+};
+
+}  // namespace
+
+RingbufHandle_t xRingbufferCreate(size_t xBufferSize, RingbufferType_t xBufferType) {
+    if (xBufferType != RINGBUF_TYPE_NOSPLIT) {
+        return nullptr;
+    }
+    return new Ringbuf(xBufferSize);
+}
+
+void vRingbufferDelete(RingbufHandle_t xRingbuffer) { delete static_cast<Ringbuf *>(xRingbuffer); }
+
+BaseType_t xRingbufferSendAcquire(RingbufHandle_t xRingbuffer, void **ppvItem, size_t xItemSize,
+                                  TickType_t xTicksToWait) {
+    auto *rb = static_cast<Ringbuf *>(xRingbuffer);
+    std::unique_lock lock(rb->mutex);
+    Item *item = nullptr;
+    rb->wait(lock, xTicksToWait, [&] { return (item = rb->reserve(xItemSize)) != nullptr; });
+    if (item == nullptr) {
+        return pdFALSE;
+    }
+    *ppvItem = rb->storage.data() + item->offset;
+    return pdTRUE;
+}
+
+BaseType_t xRingbufferSendComplete(RingbufHandle_t xRingbuffer, void *pvItem) {
+    auto *rb = static_cast<Ringbuf *>(xRingbuffer);
+    {
+        std::lock_guard lock(rb->mutex);
+        Item *item = rb->find(pvItem);
+        if (item == nullptr) {
+            return pdFALSE;
+        }
+        item->complete = true;
+    }
+    rb->cv.notify_all();
+    return pdTRUE;
+}
+
+void *xRingbufferReceive(RingbufHandle_t xRingbuffer, size_t *pxItemSize, TickType_t xTicksToWait) {
+    auto *rb = static_cast<Ringbuf *>(xRingbuffer);
+    std::unique_lock lock(rb->mutex);
+    Item *item = nullptr;
+    rb->wait(lock, xTicksToWait, [&] { return (item = rb->next()) != nullptr; });
+    if (item == nullptr) {
+        return nullptr;
+    }
+    item->read = true;
+    *pxItemSize = item->size;
+    return rb->storage.data() + item->offset;
+}
+
+void vRingbufferReturnItem(RingbufHandle_t xRingbuffer, void *pvItem) {
+    auto *rb = static_cast<Ringbuf *>(xRingbuffer);
+    {
+        std::lock_guard lock(rb->mutex);
+        Item *item = rb->find(pvItem);
+        if (item == nullptr) {
+            return;
+        }
+        item->returned = true;
+        while (!rb->items.empty() && rb->items.front().returned) {
+            rb->head = rb->items.front().end;
+            rb->items.pop_front();
+        }
+    }
+    rb->cv.notify_all();
+}
+
+size_t xRingbufferGetCurFreeSize(RingbufHandle_t xRingbuffer) {
+    auto *rb = static_cast<Ringbuf *>(xRingbuffer);
+    std::lock_guard lock(rb->mutex);
+    return rb->maxItemSize();
+}
+
+void vRingbufferGetInfo(RingbufHandle_t xRingbuffer, UBaseType_t *uxFree, UBaseType_t *uxRead, UBaseType_t *uxWrite,
+                        UBaseType_t *uxAcquire, UBaseType_t *uxItemsWaiting) {
+    auto *rb = static_cast<Ringbuf *>(xRingbuffer);
+    std::lock_guard lock(rb->mutex);
+    UBaseType_t waiting = 0;
+    for (auto &item : rb->items) {
+        if (item.complete && !item.read) {
+            waiting++;
+        }
+    }
+    if (uxFree) *uxFree = rb->head;
+    if (uxRead) *uxRead = rb->head;
+    if (uxWrite) *uxWrite = rb->tail;
+    if (uxAcquire) *uxAcquire = rb->tail;
+    if (uxItemsWaiting) *uxItemsWaiting = waiting;
+}
@@ -0,0 +1,5 @@
+#pragma once
+
+// Host stand-in for the Arduino Bluetooth HAL.
+
+bool btStart();
@@ -0,0 +1,21 @@
+#pragma once
+
+// Host stand-in for the ESP-IDF VHCI interface. The controller behind it is
+// simulated in src/native/vhci_controller.cpp.
+
+#include <cstdint>
+
+#include "esp_err.h"
+
+#define CONFIG_BT_ENABLED 1
+#define CONFIG_BLUEDROID_ENABLED 1
+#define CONFIG_CLASSIC_BT_ENABLED 1
+
+typedef struct esp_vhci_host_callback {
+    void (*notify_host_send_available)(void);
+    int (*notify_host_recv)(uint8_t *data, uint16_t len);
+} esp_vhci_host_callback_t;
+
+bool esp_vhci_host_check_send_available(void);
+void esp_vhci_host_send_packet(uint8_t *data, uint16_t len);
+esp_err_t esp_vhci_host_register_callback(const esp_vhci_host_callback_t *callback);
@@ -0,0 +1,8 @@
+#pragma once
+
+// Host stand-in for the ESP-IDF error type, used by the native build.
+
+typedef int esp_err_t;
+
+#define ESP_OK 0
+#define ESP_FAIL -1
@@ -0,0 +1,11 @@
+#pragma once
+
+// Host stand-in for the ESP-IDF high resolution timer.
+
+#include <chrono>
+#include <cstdint>
+
+inline int64_t esp_timer_get_time() {
+    static const auto start = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
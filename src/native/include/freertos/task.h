@@ -0,0 +1,17 @@
+#pragma once
+
+// Host stand-in for the FreeRTOS task helpers used by the ring buffers.
+
+#include <chrono>
+#include <thread>
+
+#include "FreeRTOS.h"
+
+inline TickType_t xTaskGetTickCount() {
+    static const auto start = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+inline void vTaskDelay(TickType_t ticks) { std::this_thread::sleep_for(std::chrono::milliseconds(ticks)); }
+
+#define taskYIELD() std::this_thread::yield()
@@ -0,0 +1,155 @@
+#include <chrono>
+#include <cstdlib>
+#include <vector>
+
+#include "benchmarks.h"
+#include "hid_reports.h"
+#include "ir_camera.h"
+#include "log.h"
+
+namespace wiipp::native {
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr size_t REPORT_SIZE = 23;
+constexpr size_t IR_OFFSET = 7;  // After the buttons and accelerometer of 0x33 and 0x37
+
+// One format at a time with a branch per dot for empty slots, as IR is usually decoded,
+// for reference
+void decodeIrReference(std::span<const uint8_t> ir, IrDots& out) {
+    const uint8_t* in = ir.data();
+    if (ir.size() == IR_EXTENDED_SIZE) {
+        for (size_t i = 0; i < 4; ++i) {
+            const uint8_t* b = in + 3 * i;
+            if (b[0] == 0xFF && b[1] == 0xFF && b[2] == 0xFF) {
+                out[i] = IrDot{.x = 1023, .y = 1023, .size = 0x0F, .visible = false};
+                continue;
+            }
+            out[i] = IrDot{
+                .x = static_cast<uint16_t>(b[0] | (b[2] & 0x30) << 4),
+                .y = static_cast<uint16_t>(b[1] | (b[2] & 0xC0) << 2),
+                .size = static_cast<uint8_t>(b[2] & 0x0F),
+                .visible = true,
+            };
+        }
+        return;
+    }
+    for (size_t i = 0; i < 4; i += 2) {
+        const uint8_t* b = in + 5 * (i / 2);
+        uint16_t x[2] = {static_cast<uint16_t>(b[0] | (b[2] & 0x30) << 4),
+                         static_cast<uint16_t>(b[3] | (b[2] & 0x03) << 8)};
+        uint16_t y[2] = {static_cast<uint16_t>(b[1] | (b[2] & 0xC0) << 2),
+                         static_cast<uint16_t>(b[4] | (b[2] & 0x0C) << 6)};
+        for (size_t k = 0; k < 2; ++k) {
+            if (x[k] == 1023 && y[k] == 1023) {
+                out[i + k] = IrDot{.x = 1023, .y = 1023, .size = 0, .visible = false};
+            } else {
+                out[i + k] = IrDot{.x = x[k], .y = y[k], .size = 0, .visible = true};
+            }
+        }
+    }
+}
+
+// Reports with random dots, about a quarter of the slots empty
+std::vector<uint8_t> makeReports(size_t count, bool extended) {
+    std::vector<uint8_t> reports(count * REPORT_SIZE);
+    srand(1);
+    for (size_t r = 0; r < count; ++r) {
+        uint8_t* report = reports.data() + r * REPORT_SIZE;
+        report[0] = 0xA1;
+        report[1] = extended ? 0x33 : 0x37;
+        report[4] = report[5] = report[6] = 0x80;
+        uint16_t x[4], y[4];
+        uint8_t size[4];
+        for (size_t i = 0; i < 4; ++i) {
+            bool empty = rand() % 4 == 0;
+            x[i] = empty ? 1023 : rand() % 1023;
+            y[i] = empty ? 1023 : rand() % 768;
+            size[i] = empty ? 0x0F : rand() % 16;
+        }
+        uint8_t* ir = report + IR_OFFSET;
+        if (extended) {
+            for (size_t i = 0; i < 4; ++i) {
+                ir[3 * i] = x[i] & 0xFF;
+                ir[3 * i + 1] = y[i] & 0xFF;
+                ir[3 * i + 2] = (y[i] >> 8) << 6 | (x[i] >> 8) << 4 | size[i];
+            }
+        } else {
+            for (size_t i = 0; i < 4; i += 2) {
+                uint8_t* b = ir + 5 * (i / 2);
+                b[0] = x[i] & 0xFF;
+                b[1] = y[i] & 0xFF;
+                b[2] = (y[i] >> 8) << 6 | (x[i] >> 8) << 4 | (y[i + 1] >> 8) << 2 | x[i + 1] >> 8;
+                b[3] = x[i + 1] & 0xFF;
+                b[4] = y[i + 1] & 0xFF;
+            }
+        }
+    }
+    return reports;
+}
+
+// Runs `decode` over the reports until `seconds` have passed, returns ns per report
+template <typename F>
+double measure(double seconds, size_t count, F decode) {
+    uint64_t rounds = 0;
+    auto start = Clock::now();
+    auto end = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds));
+    while (Clock::now() < end) {
+        decode();
+        rounds++;
+    }
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    return elapsed * 1e9 / (rounds * count);
+}
+
+bool same(const IrDot& a, const IrDot& b) {
+    return a.x == b.x && a.y == b.y && a.size == b.size && a.visible == b.visible;
+}
+
+}  // namespace
+
+void irBenchmark(double seconds, size_t count) {
+    for (bool extended : {false, true}) {
+        std::vector<uint8_t> reports = makeReports(count, extended);
+        size_t irSize = extended ? IR_EXTENDED_SIZE : IR_BASIC_SIZE;
+        std::vector<IrDots> reference(count);
+        std::vector<IrDots> kernel(count);
+        std::vector<IrDots> full(count);
+
+        double referenceNs = measure(seconds / 6, count, [&] {
+            for (size_t i = 0; i < count; ++i) {
+                decodeIrReference({reports.data() + i * REPORT_SIZE + IR_OFFSET, irSize}, reference[i]);
+            }
+        });
+        double kernelNs = measure(seconds / 6, count, [&] {
+            for (size_t i = 0; i < count; ++i) {
+                decodeIr({reports.data() + i * REPORT_SIZE + IR_OFFSET, irSize}, kernel[i]);
+            }
+        });
+        // What a Wii remote report costs end to end, report layout lookup included
+        double reportNs = measure(seconds / 6, count, [&] {
+            for (size_t i = 0; i < count; ++i) {
+                InputReport report;
+                if (decodeInputReport({reports.data() + i * REPORT_SIZE, REPORT_SIZE}, &report)) {
+                    decodeIr(report.ir, full[i]);
+                }
+            }
+        });
+
+        size_t mismatches = 0;
+        for (size_t i = 0; i < count; ++i) {
+            for (size_t d = 0; d < 4; ++d) {
+                mismatches += !same(reference[i][d], kernel[i][d]) || !same(kernel[i][d], full[i][d]);
+            }
+        }
+        log_i("%s IR decoding (0x%02X), %zu reports:", extended ? "Extended" : "Basic", extended ? 0x33 : 0x37, count);
+        log_i("  per dot branches:    %6.2f ns per report", referenceNs);
+        log_i("  decodeIr:            %6.2f ns per report", kernelNs);
+        log_i("  whole report:        %6.2f ns per report", reportNs);
+        log_i("decodeIr %s the reference (%zu mismatching dots)", mismatches ? "differs from" : "matches", mismatches);
+    }
+}
+
+}  // namespace wiipp::native
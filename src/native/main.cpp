@@ -0,0 +1,199 @@
+// Host throughput run: wiipp::Wii and Esp32Bluetooth on top of the simulated
+// VHCI controller.
+//
+// Usage: program [boards] [seconds] [report rate Hz per device, 0 = flat out] [ACL buffer size] [remotes]
+//        program ring [seconds]    Ring buffer backend microbenchmark
+//        program decode [seconds] [reports]    0x34 report decoding microbenchmark
+//        program ir [seconds] [remotes] [report rate Hz]    IR decoding, then remotes streaming IR reports
+//        program test    Checks of the ring buffer
+//        program queue [boards] [seconds] [capacity] [newest|oldest]    Events through an EventQueue to another thread
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <thread>
+
+#include "benchmarks.h"
+#include "esp32_bluetooth.h"
+#include "event_queue.h"
+#include "log.h"
+#include "nvs_storage.h"
+#include "utils.h"
+#include "vhci_controller.h"
+#include "wiipp.h"
+
+using Clock = std::chrono::steady_clock;
+
+static double threadCpuSeconds() {
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Streams from the configured devices through Wii for `seconds` and prints the throughput.
+// With a `queue`, events are counted by a consumer thread draining it instead of inside step().
+static int run(const wiipp::native::ControllerConfig& config, double seconds, wiipp::EventQueue* queue = nullptr) {
+    wiipp::native::configureController(config);
+
+    size_t connected = 0;
+    std::atomic<uint64_t> reports{0};
+    uint32_t checksum = 0;
+
+    auto count = [&](const wiipp::WiiEvent& event) {
+        std::visit(overloaded{
+            [&](const wiipp::BalanceBoardConnected&) { connected++; },
+            [&](const wiipp::BalanceBoardDisconnected&) { connected--; },
+            [&](const wiipp::WiimoteConnected&) { connected++; },
+            [&](const wiipp::WiimoteDisconnected&) { connected--; },
+            [&](const wiipp::BalanceBoardData& data) {
+                checksum += data.tr + data.br + data.tl + data.bl;
+                reports.fetch_add(1, std::memory_order_relaxed);
+            },
+            [&](const wiipp::WiimoteData& data) {
+                checksum += data.buttons + data.acceleration[2];
+                for (const auto& dot : data.ir) {
+                    checksum += dot.visible ? dot.x + dot.y + dot.size : 0;
+                }
+                reports.fetch_add(1, std::memory_order_relaxed);
+            },
+            [](const auto&) {},
+        }, event);
+    };
+
+    wiipp::Esp32Bluetooth bt;
+    wiipp::Wii wii(&bt, queue ? wiipp::WiiEventListener([](const wiipp::WiiEvent&) {}) : wiipp::WiiEventListener(count),
+                   queue ? wiipp::Wii::NO_SAMPLES : wiipp::Wii::ALL_SAMPLES);
+    std::atomic<bool> draining{true};
+    std::thread consumer;
+    if (queue) {
+        wii.subscribe(queue);
+        consumer = std::thread([&] {
+            while (draining) {
+                if (queue->drain(count) == 0) {
+                    std::this_thread::sleep_for(std::chrono::microseconds(100));
+                }
+            }
+            queue->drain(count);
+        });
+    }
+    auto stopConsumer = [&] {
+        draining = false;
+        if (consumer.joinable()) {
+            consumer.join();
+        }
+    };
+    wiipp::NvsStorage storage;
+    wii.setStorage(&storage);
+    bt.onReady([&wii](wiipp::Bluetooth*) { wii.sync(); });
+
+    size_t devices = config.boards + config.remotes;
+    auto streaming = [] {
+        auto stats = wiipp::native::controllerStats();
+        return stats.boardsStreaming + stats.remotesStreaming;
+    };
+    auto deadline = Clock::now() + std::chrono::seconds(10);
+    while (streaming() < devices || reports == 0) {
+        wii.step();
+        if (Clock::now() > deadline) {
+            log_e("Only %zu of %zu devices streaming after 10s", streaming(), devices);
+            while (!wiipp::native::stopController()) {
+                wii.step();
+            }
+            stopConsumer();
+            return 1;
+        }
+    }
+
+    log_i("%zu boards and %zu remotes streaming, measuring for %.1fs", config.boards, config.remotes, seconds);
+    uint64_t startReports = reports;
+    wiipp::EventQueueStats startQueue = queue ? queue->stats() : wiipp::EventQueueStats{};
+    auto start = Clock::now();
+    auto end = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds));
+    double cpuStart = threadCpuSeconds();
+    double busyCpu = 0;
+    uint64_t calls = 0;
+    uint64_t packets = 0;
+    size_t maxQueued = 0;
+    while (Clock::now() < end) {
+        double before = threadCpuSeconds();
+        auto result = wii.step();
+        if (result.handled > 0) {
+            busyCpu += threadCpuSeconds() - before;
+            calls++;
+            packets += result.handled;
+            maxQueued = std::max(maxQueued, result.queued);
+        }
+    }
+    double cpu = threadCpuSeconds() - cpuStart;
+    double wall = std::chrono::duration<double>(Clock::now() - start).count();
+    uint64_t handled = reports - startReports;
+
+    while (!wiipp::native::stopController()) {
+        wii.step();
+    }
+    stopConsumer();
+
+    auto stats = wiipp::native::controllerStats();
+    log_i("Reports: %llu in %.2fs, %.0f reports/s (%.0f/s per device)", (unsigned long long)handled, wall,
+          handled / wall, handled / wall / devices);
+    log_i("Loop CPU: %.2fs, %.2fs in process() calls that handled packets, %.0f ns per report", cpu, busyCpu,
+          handled ? busyCpu * 1e9 / handled : 0.0);
+    log_i("process(): %.1f packets per busy call, at most %zu left queued", calls ? double(packets) / calls : 0.0,
+          maxQueued);
+    log_i("Controller: %llu reports sent, %llu host packets, checksum %08X",
+          (unsigned long long)stats.reportsSent, (unsigned long long)stats.hostPackets, checksum);
+    if (queue) {
+        auto queueStats = queue->stats();
+        log_i("Queue: %u events pushed, %u dropped (%u samples), at most %zu of %zu queued",
+              queueStats.pushed - startQueue.pushed, queueStats.dropped - startQueue.dropped,
+              queueStats.droppedByType[wiipp::eventIndex<wiipp::BalanceBoardData>()] -
+                  startQueue.droppedByType[wiipp::eventIndex<wiipp::BalanceBoardData>()],
+              queueStats.maxDepth, queue->capacity());
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1 && strcmp(argv[1], "ring") == 0) {
+        wiipp::native::ringBenchmark(argc > 2 ? strtod(argv[2], nullptr) : 1.0);
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "decode") == 0) {
+        return wiipp::native::decodeBenchmark(argc > 2 ? strtod(argv[2], nullptr) : 1.0,
+                                              argc > 3 ? strtoul(argv[3], nullptr, 10) : 4096)
+                   ? 0
+                   : 1;
+    }
+    if (argc > 1 && strcmp(argv[1], "test") == 0) {
+        return wiipp::native::selfTest() ? 0 : 1;
+    }
+    if (argc > 1 && strcmp(argv[1], "queue") == 0) {
+        bool oldest = argc > 5 && strcmp(argv[5], "oldest") == 0;
+        wiipp::EventQueue queue(argc > 4 ? strtoul(argv[4], nullptr, 10) : 256,
+                                oldest ? wiipp::OverflowPolicy::DropOldest : wiipp::OverflowPolicy::DropNewest);
+        return run(wiipp::native::ControllerConfig{
+                       .boards = argc > 2 ? strtoul(argv[2], nullptr, 10) : 1,
+                   },
+                   argc > 3 ? strtod(argv[3], nullptr) : 5.0, &queue);
+    }
+    if (argc > 1 && strcmp(argv[1], "ir") == 0) {
+        double seconds = argc > 2 ? strtod(argv[2], nullptr) : 5.0;
+        wiipp::native::irBenchmark(std::min(seconds, 1.0), 4096);
+        return run(wiipp::native::ControllerConfig{
+                       .boards = 0,
+                       .reportRateHz = argc > 4 ? static_cast<uint32_t>(strtoul(argv[4], nullptr, 10)) : 100,
+                       .remotes = argc > 3 ? strtoul(argv[3], nullptr, 10) : 4,
+                   },
+                   seconds);
+    }
+
+    return run(wiipp::native::ControllerConfig{
+                   .boards = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1,
+                   .reportRateHz = argc > 3 ? static_cast<uint32_t>(strtoul(argv[3], nullptr, 10)) : 0,
+                   .aclLength = argc > 4 ? static_cast<uint16_t>(strtoul(argv[4], nullptr, 10)) : uint16_t{1021},
+                   .remotes = argc > 5 ? strtoul(argv[5], nullptr, 10) : 0,
+               },
+               argc > 2 ? strtod(argv[2], nullptr) : 5.0);
+}
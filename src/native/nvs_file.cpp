@@ -0,0 +1,119 @@
+#include <nvs.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+// NVS on the host: every namespace lives in one map that is read from a file on first use
+// and written back whole on commit. The file is wiipp_nvs.bin in the working directory,
+// or WIIPP_NVS_FILE. Records are namespace, key and value, each a 32 bit length and bytes.
+
+namespace {
+
+using Entries = std::map<std::string, std::vector<uint8_t>>;
+
+struct NvsFile {
+    std::string path;
+    std::vector<std::string> namespaces;  // Handle - 1 is the index
+    Entries entries;                      // Keyed by namespace '\0' key
+
+    NvsFile() {
+        const char *env = getenv("WIIPP_NVS_FILE");
+        path = env != nullptr ? env : "wiipp_nvs.bin";
+        std::ifstream in(path, std::ios::binary);
+        std::string key;
+        std::vector<uint8_t> value;
+        while (read(in, key) && read(in, value)) {
+            entries[key] = value;
+        }
+    }
+
+    template <typename T>
+    static bool read(std::istream &in, T &out) {
+        uint32_t size;
+        if (!in.read(reinterpret_cast<char *>(&size), sizeof(size))) {
+            return false;
+        }
+        out.resize(size);
+        return static_cast<bool>(in.read(reinterpret_cast<char *>(out.data()), size));
+    }
+
+    static void write(std::ostream &out, const void *data, uint32_t size) {
+        out.write(reinterpret_cast<const char *>(&size), sizeof(size));
+        out.write(static_cast<const char *>(data), size);
+    }
+
+    bool save() {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        for (const auto &[key, value] : entries) {
+            write(out, key.data(), key.size());
+            write(out, value.data(), value.size());
+        }
+        return static_cast<bool>(out);
+    }
+
+    const std::string *space(nvs_handle_t handle) {
+        return handle == 0 || handle > namespaces.size() ? nullptr : &namespaces[handle - 1];
+    }
+};
+
+NvsFile &nvs() {
+    static NvsFile file;
+    return file;
+}
+
+}  // namespace
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t open_mode, nvs_handle_t *out_handle) {
+    nvs().namespaces.emplace_back(name);
+    *out_handle = nvs().namespaces.size();
+    return ESP_OK;
+}
+
+void nvs_close(nvs_handle_t handle) {}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *out_value, size_t *length) {
+    const std::string *space = nvs().space(handle);
+    if (space == nullptr) {
+        return ESP_ERR_NVS_INVALID_HANDLE;
+    }
+    auto itr = nvs().entries.find(*space + '\0' + key);
+    if (itr == nvs().entries.end()) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    if (out_value == nullptr) {
+        *length = itr->second.size();
+        return ESP_OK;
+    }
+    if (*length < itr->second.size()) {
+        return ESP_ERR_NVS_INVALID_LENGTH;
+    }
+    memcpy(out_value, itr->second.data(), itr->second.size());
+    *length = itr->second.size();
+    return ESP_OK;
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t length) {
+    const std::string *space = nvs().space(handle);
+    if (space == nullptr) {
+        return ESP_ERR_NVS_INVALID_HANDLE;
+    }
+    const uint8_t *bytes = static_cast<const uint8_t *>(value);
+    nvs().entries[*space + '\0' + key].assign(bytes, bytes + length);
+    return ESP_OK;
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key) {
+    const std::string *space = nvs().space(handle);
+    if (space == nullptr) {
+        return ESP_ERR_NVS_INVALID_HANDLE;
+    }
+    return nvs().entries.erase(*space + '\0' + key) ? ESP_OK : ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle) {
+    return nvs().space(handle) != nullptr && nvs().save() ? ESP_OK : ESP_FAIL;
+}
@@ -0,0 +1,89 @@
+#include <chrono>
+#include <thread>
+
+#include "benchmarks.h"
+#include "log.h"
+#include "ring_buffer.h"
+
+namespace wiipp::native {
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Packet sizes seen on the rx ring: 0x34 reports, command complete events and
+// the occasional remote name event.
+constexpr size_t SIZES[] = {27, 27, 27, 27, 7, 27, 27, 258};
+
+template <typename Ring>
+double sameThread(double seconds) {
+    Ring ring(1024);
+    uint8_t packet[258] = {};
+    uint64_t count = 0;
+    uint32_t sum = 0;
+    auto end = Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds));
+    auto start = Clock::now();
+    while (Clock::now() < end) {
+        for (int i = 0; i < 1024; ++i) {
+            size_t size = SIZES[count % std::size(SIZES)];
+            if (auto slot = ring.allocate(size)) {
+                memcpy(slot.data(), packet, size);
+            }
+            if (auto item = ring.read(0)) {
+                sum += item[0] + item.size();
+            }
+            count++;
+        }
+    }
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    return elapsed * 1e9 / count + (sum & 0);
+}
+
+template <typename Ring>
+double crossThread(double seconds) {
+    Ring ring(1024);
+    std::atomic<bool> running{true};
+    std::thread producer([&] {
+        uint8_t packet[258] = {};
+        for (uint64_t n = 0; running; ++n) {
+            size_t size = SIZES[n % std::size(SIZES)];
+            packet[0] = n;
+            if (auto slot = ring.allocate(size, 10)) {
+                memcpy(slot.data(), packet, size);
+            }
+        }
+    });
+
+    uint64_t count = 0;
+    uint32_t sum = 0;
+    auto start = Clock::now();
+    auto end = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds));
+    while (Clock::now() < end) {
+        if (auto item = ring.read(0)) {
+            sum += item[0];
+            count++;
+        } else {
+            std::this_thread::yield();
+        }
+    }
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    running = false;
+    while (auto item = ring.read(0)) {
+    }
+    producer.join();
+    return count / elapsed + (sum & 0);
+}
+
+}  // namespace
+
+void ringBenchmark(double seconds) {
+    log_i("Ring buffer, allocate+commit+read+return on one thread:");
+    log_i("  FreeRTOS stand-in: %6.1f ns per item", sameThread<FreeRtosRingBuffer>(seconds));
+    log_i("  SPSC:              %6.1f ns per item", sameThread<SpscRingBuffer>(seconds));
+    log_i("Ring buffer, producer thread to consumer thread:");
+    log_i("  FreeRTOS stand-in: %6.2f M items/s", crossThread<FreeRtosRingBuffer>(seconds) / 1e6);
+    log_i("  SPSC:              %6.2f M items/s", crossThread<SpscRingBuffer>(seconds) / 1e6);
+    log_i("The FreeRTOS numbers come from the mutex based host stand-in, not the ESP32 implementation.");
+}
+
+}  // namespace wiipp::native
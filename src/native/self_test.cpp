@@ -0,0 +1,404 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <vector>
+
+#include "balance_board.h"
+#include "benchmarks.h"
+#include "command_flow.h"
+#include "hid_reports.h"
+#include "ir_camera.h"
+#include "log.h"
+#include "lowlevel_bt.h"
+#include "memory_access.h"
+#include "ring_buffer.h"
+
+namespace wiipp::native {
+
+namespace {
+
+struct Checks {
+    size_t run{0};
+    size_t failed{0};
+
+    void expect(bool ok, const char* what) {
+        run++;
+        if (!ok) {
+            failed++;
+            log_e("FAILED: %s", what);
+        }
+    }
+};
+
+// Writes `size` bytes of `fill` and reads them back, true if both worked and they match
+bool roundTrip(SpscRingBuffer& ring, size_t size, uint8_t fill, int ms = 0) {
+    if (auto slot = ring.allocate(size, ms)) {
+        memset(slot.data(), fill, size);
+    } else {
+        return false;
+    }
+    auto item = ring.read(0);
+    if (!item || item.size() != size) {
+        return false;
+    }
+    for (size_t i = 0; i < size; ++i) {
+        if (item[i] != fill) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void ringChecks(Checks& checks) {
+    {
+        // An item over half the ring has to wrap on an empty ring
+        SpscRingBuffer ring(1024);
+        checks.expect(roundTrip(ring, 508, 0x11), "ring: 508 bytes from the start");
+        checks.expect(roundTrip(ring, 600, 0x22, 200), "ring: 600 bytes wrapping on an empty ring");
+        checks.expect(roundTrip(ring, 1020, 0x33), "ring: a whole ring item after a wrap");
+        checks.expect(ring.pending() == 0, "ring: empty after the wraps");
+    }
+    {
+        // Odd sizes up to the whole ring, several queued at once, read back in order
+        SpscRingBuffer ring(1024);
+        std::deque<std::vector<uint8_t>> expected;
+        bool ok = true;
+        uint32_t seed = 1;
+        for (int n = 0; n < 20000 && ok; ++n) {
+            seed = seed * 1103515245 + 12345;
+            size_t size = 1 + (seed >> 8) % (n % 16 == 0 ? 1020 : 300);
+            if (auto slot = ring.allocate(size)) {
+                std::vector<uint8_t> item(size);
+                for (size_t i = 0; i < size; ++i) {
+                    item[i] = static_cast<uint8_t>(n + i);
+                }
+                memcpy(slot.data(), item.data(), size);
+                expected.push_back(std::move(item));
+            }
+            if ((seed >> 4) % 3 == 0 || expected.size() > 3) {
+                while (!expected.empty()) {
+                    auto item = ring.read(0);
+                    ok = item && item.size() == expected.front().size() &&
+                         memcmp(item.data(), expected.front().data(), item.size()) == 0;
+                    expected.pop_front();
+                    if (!ok) {
+                        break;
+                    }
+                }
+            }
+        }
+        checks.expect(ok, "ring: mixed sizes come back in order");
+    }
+}
+
+void commandFlowChecks(Checks& checks) {
+    // HCI_Reset and Create_Connection, as queued on txBuffer
+    const uint8_t reset[] = {0x01, 0x03, 0x0C, 0x00};
+    const uint8_t connect[] = {0x01, 0x05, 0x04, 0x0D, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66};
+    CommandFlow flow;
+    flow.sent(reset, sizeof(reset));
+    checks.expect(!flow.canSend(), "command flow: no credit left after the first command");
+    flow.completed(0x0C03, 2);
+    flow.sent(connect, sizeof(connect));
+    flow.sent(reset, sizeof(reset));
+    checks.expect(!flow.canSend(), "command flow: both credits used");
+    checks.expect(flow.expired(0x0405, 0x665544332211, 0xFFFFFFFFFFFF) && flow.outstanding() == 1,
+                  "command flow: expiry drops only the expired command");
+    checks.expect(flow.canSend(), "command flow: an expired command gives its credit back");
+    checks.expect(flow.expired(0x0C03, 0, 0) && flow.outstanding() == 0, "command flow: both expired");
+    checks.expect(!flow.expired(0x0C03, 0, 0), "command flow: expiring twice does nothing");
+}
+
+// The fixed point conversion against the old float one over every raw value, one report
+// per value through decodeBalanceBoardReports and each value through grams() directly.
+// Calibrations only a few raw units per 17kg wide are left out, extrapolated that steeply
+// the float loses more than a gram at the top of the range itself.
+void gramsChecks(Checks& checks) {
+    const std::array<uint16_t, 12> calibrations[] = {
+        // Typical boards
+        {0x0400, 0x0440, 0x0480, 0x04C0, 0x0B00, 0x0B40, 0x0B80, 0x0BC0, 0x1200, 0x1240, 0x1280, 0x12C0},
+        {0x0A5E, 0x0DFE, 0x00C2, 0x1C1A, 0x1165, 0x14F0, 0x07A2, 0x230B, 0x1874, 0x1C02, 0x0E86, 0x2A08},
+        // Degenerate: 0kg and 17kg equal, 17kg and 34kg equal, all three equal, all at the top
+        {0x0800, 0x0800, 0x0800, 0x0800, 0x0800, 0x1000, 0x0800, 0xFFFF, 0x1000, 0x1000, 0x0800, 0xFFFF},
+        {0xFFFF, 0x0000, 0x0000, 0x8000, 0xFFFF, 0x0000, 0x8000, 0x8000, 0xFFFF, 0x0000, 0xFFFF, 0x8000},
+    };
+    constexpr size_t VALUES = 0x10000;
+    std::vector<uint8_t> reports(VALUES * BALANCE_BOARD_REPORT_SIZE);
+    for (size_t value = 0; value < VALUES; ++value) {
+        uint8_t* report = reports.data() + value * BALANCE_BOARD_REPORT_SIZE;
+        report[0] = 0xA1;
+        report[1] = 0x34;
+        for (size_t s = 0; s < 4; ++s) {
+            report[4 + 2 * s] = value >> 8;
+            report[5 + 2 * s] = value & 0xFF;
+        }
+    }
+    std::vector<uint16_t> out[4];
+    std::vector<uint8_t> temperature(VALUES), batteryLevel(VALUES);
+    for (auto& sensor : out) {
+        sensor.resize(VALUES);
+    }
+    BalanceBoardSamples samples{out[0].data(), out[1].data(), out[2].data(), out[3].data(), temperature.data(),
+                                batteryLevel.data()};
+
+    for (size_t c = 0; c < std::size(calibrations); ++c) {
+        auto calibration = BalanceBoardCalibration::fromRaw(calibrations[c], 0);
+        decodeBalanceBoardReports(reports, calibration, samples);
+        int32_t maxError = 0;
+        int32_t maxDecodeError = 0;
+        for (size_t s = 0; s < 4; ++s) {
+            for (size_t value = 0; value < VALUES; ++value) {
+                int32_t expected = interpolate(value, calibrations[c], s);
+                int32_t grams = BalanceBoardCalibration::grams(value, calibration.sensors[s]);
+                maxError = std::max(maxError, std::abs(grams - expected));
+                // Samples are 16 bits, past 65kg they wrap like the float ones did
+                int16_t wrapped = static_cast<int16_t>(out[s][value] - static_cast<uint16_t>(expected));
+                maxDecodeError = std::max<int32_t>(maxDecodeError, std::abs(wrapped));
+            }
+        }
+        if (maxError > 1 || maxDecodeError > 1) {
+            log_e("Calibration %zu: grams() up to %d g and decoded reports up to %d g from float", c, maxError,
+                  maxDecodeError);
+        }
+        checks.expect(maxError <= 1, "grams: within 1 g of the float conversion");
+        checks.expect(maxDecodeError <= 1, "grams: decoded reports within 1 g of the float conversion");
+    }
+}
+
+// Core buttons and the accelerometer bits shared with them
+void inputReportChecks(Checks& checks) {
+    InputReport report;
+    // Every bit set in the button bytes: accelerometer and unused bits masked off the buttons,
+    // x gets two low bits and y and z one each
+    const uint8_t all[] = {0xA1, 0x31, 0xFF, 0xFF, 0x80, 0x81, 0x82};
+    checks.expect(decodeInputReport(all, &report) && report.kind == ReportKind::Data && report.id == 0x31,
+                  "input report: 0x31 decodes");
+    checks.expect(report.buttons == CORE_BUTTONS, "input report: buttons masked to the core buttons");
+    checks.expect(report.acceleration[0] == (0x80 << 2 | 0x03) && report.acceleration[1] == (0x81 << 2 | 0x02) &&
+                      report.acceleration[2] == (0x82 << 2 | 0x02),
+                  "input report: all low accelerometer bits");
+
+    // Only the x bit 0 and the z bit, plus the A button
+    const uint8_t some[] = {0xA1, 0x31, 0x20, 0x48, 0x10, 0x20, 0x30};
+    decodeInputReport(some, &report);
+    checks.expect(report.buttons == 0x0008, "input report: A alone");
+    checks.expect(report.acceleration[0] == (0x10 << 2 | 0x01) && report.acceleration[1] == 0x20 << 2 &&
+                      report.acceleration[2] == (0x30 << 2 | 0x02),
+                  "input report: x bit 0 and z bit 1 only");
+
+    // Only the y bit and x bit 1, plus Home and Up
+    const uint8_t others[] = {0xA1, 0x31, 0x48, 0xA0, 0x00, 0x00, 0x00};
+    decodeInputReport(others, &report);
+    checks.expect(report.buttons == 0x0880, "input report: Up and Home");
+    checks.expect(report.acceleration[0] == 0x02 && report.acceleration[1] == 0x02 && report.acceleration[2] == 0,
+                  "input report: x bit 1 and y bit 1 only");
+
+    std::vector<uint8_t> ir(19, 0x00);
+    ir[0] = 0xA1;
+    ir[1] = 0x33;
+    ir[2] = 0x60;  // Both x bits, nothing else
+    checks.expect(decodeInputReport(ir, &report) && report.buttons == 0 && report.acceleration[0] == 0x03 &&
+                      report.ir.data() == ir.data() + 7 && report.ir.size() == IR_EXTENDED_SIZE &&
+                      report.extension.empty(),
+                  "input report: 0x33 with its IR bytes");
+    const uint8_t core[] = {0xA1, 0x30, 0x7F, 0xFF};
+    checks.expect(decodeInputReport(core, &report) && report.buttons == CORE_BUTTONS &&
+                      report.acceleration == std::array<uint16_t, 3>{},
+                  "input report: no acceleration in 0x30");
+
+    checks.expect(!decodeInputReport(std::span<const uint8_t>(all, 6), &report), "input report: too short");
+    const uint8_t output[] = {0xA2, 0x31, 0x00, 0x00, 0x00, 0x00, 0x00};
+    checks.expect(!decodeInputReport(output, &report), "input report: not an input report");
+    const uint8_t unknown[] = {0xA1, 0x23, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+    checks.expect(!decodeInputReport(unknown, &report), "input report: unknown ID");
+}
+
+// Reads the next item from `ring` and compares it with `expected`
+bool nextItemIs(SpscRingBuffer& ring, std::vector<uint8_t> expected) {
+    auto item = ring.read(0);
+    return item && item.size() == expected.size() && memcmp(item.data(), expected.data(), item.size()) == 0;
+}
+
+// The field encoder against the bytes the hand written UINT8_TO_STREAM packets used to produce
+void encoderChecks(Checks& checks) {
+    SpscRingBuffer ring(1024);
+    uint64_t addr = 0x665544332211;
+
+    enqueue_cmd_reset(ring);
+    checks.expect(nextItemIs(ring, {0x01, 0x03, 0x0C, 0x00}), "encoder: reset");
+    enqueue_cmd_read_buffer_size(ring);
+    checks.expect(nextItemIs(ring, {0x01, 0x05, 0x10, 0x00}), "encoder: read buffer size");
+    enqueue_cmd_read_bd_addr(ring);
+    checks.expect(nextItemIs(ring, {0x01, 0x09, 0x10, 0x00}), "encoder: read BD_ADDR");
+    uint8_t cod[] = {0x04, 0x05, 0x00};
+    enqueue_cmd_write_class_of_device(ring, cod);
+    checks.expect(nextItemIs(ring, {0x01, 0x24, 0x0C, 0x03, 0x04, 0x05, 0x00}), "encoder: write class of device");
+    enqueue_cmd_write_scan_enable(ring, 0x02);
+    checks.expect(nextItemIs(ring, {0x01, 0x1A, 0x0C, 0x01, 0x02}), "encoder: write scan enable");
+    enqueue_cmd_inquiry_cancel(ring);
+    checks.expect(nextItemIs(ring, {0x01, 0x02, 0x04, 0x00}), "encoder: inquiry cancel");
+    enqueue_cmd_inquiry(ring, 0x9E8B33, 0x10, 0x00);
+    checks.expect(nextItemIs(ring, {0x01, 0x01, 0x04, 0x05, 0x33, 0x8B, 0x9E, 0x10, 0x00}), "encoder: inquiry");
+    enqueue_cmd_remote_name_request(ring, addr, 0x01, 0x1234);
+    checks.expect(nextItemIs(ring, {0x01, 0x19, 0x04, 0x0A, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x01, 0x00, 0x34,
+                                    0x12}),
+                  "encoder: remote name request");
+    enqueue_cmd_create_connection(ring, addr, 0x0008, 0x01, 0x1234, 0x00);
+    checks.expect(nextItemIs(ring, {0x01, 0x05, 0x04, 0x0D, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x08, 0x00, 0x01,
+                                    0x00, 0x34, 0x12, 0x00}),
+                  "encoder: create connection");
+    enqueue_cmd_auth_request(ring, 0x1081);  // Flag bits above the 12 bit handle are masked off
+    checks.expect(nextItemIs(ring, {0x01, 0x11, 0x04, 0x02, 0x81, 0x00}), "encoder: authentication request");
+    uint8_t pin[] = {0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0xFF};
+    enqueue_cmd_pin_reply(ring, addr, pin, sizeof(pin));
+    checks.expect(nextItemIs(ring, {0x01, 0x0D, 0x04, 0x17, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x06, 0xAA, 0xBB,
+                                    0xCC, 0xDD, 0xEE, 0xFF, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}),
+                  "encoder: PIN reply");
+    enqueue_cmd_accept_connection(ring, addr);
+    checks.expect(nextItemIs(ring, {0x01, 0x09, 0x04, 0x07, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x00}),
+                  "encoder: accept connection");
+    enqueue_cmd_reject_connection(ring, addr, 0x0F);  // The old packet carried the Accept opcode 0x0409
+    checks.expect(nextItemIs(ring, {0x01, 0x0A, 0x04, 0x07, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x0F}),
+                  "encoder: reject connection");
+    enqueue_cmd_negative_reply(ring, addr);
+    checks.expect(nextItemIs(ring, {0x01, 0x0C, 0x04, 0x06, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66}),
+                  "encoder: negative reply");
+    uint8_t linkKey[16];
+    for (size_t i = 0; i < sizeof(linkKey); ++i) {
+        linkKey[i] = static_cast<uint8_t>(0xA0 + i);
+    }
+    enqueue_cmd_link_key_reply(ring, addr, linkKey);
+    std::vector<uint8_t> linkKeyCommand = {0x01, 0x0B, 0x04, 0x16, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66};
+    linkKeyCommand.insert(linkKeyCommand.end(), linkKey, linkKey + 16);
+    checks.expect(nextItemIs(ring, linkKeyCommand), "encoder: link key reply");
+    enqueue_cmd_disconnect(ring, 0x0081);
+    checks.expect(nextItemIs(ring, {0x01, 0x06, 0x04, 0x03, 0x81, 0x00, 0x15}), "encoder: disconnect");
+    uint8_t name[] = {'w', 'i', 'i', 0};
+    enqueue_cmd_write_local_name(ring, name, sizeof(name));
+    std::vector<uint8_t> nameCommand(4 + 248, 0);
+    memcpy(nameCommand.data(), "\x01\x13\x0C\xF8wii", 7);
+    checks.expect(nextItemIs(ring, nameCommand), "encoder: write local name");
+
+    // A 30 byte frame at the 27 byte default ACL length: 23 bytes after the L2CAP header,
+    // then a continuation with the other 7
+    std::vector<uint8_t> frame(30);
+    for (size_t i = 0; i < frame.size(); ++i) {
+        frame[i] = static_cast<uint8_t>(i);
+    }
+    enqueue_acl_l2cap_packet(ring, 0x0081, 0b10, 0b00, 0x0041, frame.data(), frame.size(), 27);
+    std::vector<uint8_t> first = {0x02, 0x81, 0x20, 0x1B, 0x00, 0x1E, 0x00, 0x41, 0x00};
+    first.insert(first.end(), frame.begin(), frame.begin() + 23);
+    std::vector<uint8_t> second = {0x02, 0x81, 0x10, 0x07, 0x00};
+    second.insert(second.end(), frame.begin() + 23, frame.end());
+    checks.expect(nextItemIs(ring, first), "encoder: first ACL fragment");
+    checks.expect(nextItemIs(ring, second), "encoder: continuing ACL fragment");
+    checks.expect(ring.pending() == 0, "encoder: two fragments");
+
+    enqueue_acl_l2cap_fields(ring, 0x0081, 0b10, 0b00, 0x0001, 27, U8{0x02}, U8{0x05}, U16{4}, U16{0x0011},
+                             U16{0x0040});
+    checks.expect(nextItemIs(ring, {0x02, 0x81, 0x20, 0x0C, 0x00, 0x08, 0x00, 0x01, 0x00, 0x02, 0x05, 0x04, 0x00,
+                                    0x11, 0x00, 0x40, 0x00}),
+                  "encoder: L2CAP connection request");
+
+    // A frame that only partly fits is not queued at all
+    SpscRingBuffer small(128);
+    std::vector<uint8_t> large(200);
+    checks.expect(!enqueue_acl_l2cap_packet(small, 0x0081, 0b10, 0b00, 0x0041, large.data(), large.size(), 27) &&
+                      small.pending() == 0,
+                  "encoder: no partial frame when the queue is short");
+    checks.expect(!enqueue_acl_l2cap_packet(ring, 0x0081, 0b10, 0b00, 0x0041, large.data(), 0x10000, 27) &&
+                      ring.pending() == 0,
+                  "encoder: frames over the L2CAP length limit are refused");
+}
+
+// Only keeps what MemoryAccess sends
+struct RecordingBluetooth : Bluetooth {
+    std::vector<std::vector<uint8_t>> sent;
+    std::array<uint8_t, 6> mac{};
+
+    std::span<uint8_t, 6> macAddress() override { return mac; }
+    void onReady(const std::function<void(Bluetooth*)>&) override {}
+    ProcessResult process() override { return {}; }
+    void setProcessBudget(const ProcessBudget&) override {}
+    void onHCIEvent(const std::function<void(Bluetooth*, const HCIEvent&)>&) override {}
+    void onHCIConnectionRequest(const std::function<bool(Bluetooth*, const HCIConnectionRequest&)>&) override {}
+    Completion scan() override { return {}; }
+    Completion requestRemoteName(const HCIInquiryResult&) override { return {}; }
+    Completion connect(const HCIInquiryResult&) override { return {}; }
+    Completion auth(uint16_t) override { return {}; }
+    Completion negativeReply(uint64_t) override { return {}; }
+    Completion linkKeyReply(uint64_t, std::span<const uint8_t, 16>) override { return {}; }
+    Completion disconnect(uint16_t) override { return {}; }
+    Completion sendPinReply(uint64_t, uint8_t*, size_t) override { return {}; }
+    void onACLEvent(const std::function<void(Bluetooth*, const ACLEvent&)>&) override {}
+    void onACLConnectionRequest(const std::function<bool(Bluetooth*, const ACLConnectionRequest&)>&) override {}
+    void l2cap_connect(uint16_t, uint16_t, uint16_t) override {}
+    void l2cap_disconnect(uint16_t, uint16_t) override {}
+    void l2send_data(uint16_t, uint16_t, uint8_t* data, size_t len) override { sent.emplace_back(data, data + len); }
+    bool setDataSink(uint16_t, uint16_t, const DataSink&) override { return false; }
+    size_t aclQueueDepth(uint16_t) override { return 0; }
+};
+
+// 0x21 reply with `size` bytes for the low 16 bits of `address`
+std::vector<uint8_t> readReply(uint16_t address, uint8_t size) {
+    std::vector<uint8_t> report(23, 0x00);
+    report[0] = 0xA1;
+    report[1] = 0x21;
+    report[4] = static_cast<uint8_t>((size - 1) << 4);
+    report[5] = address >> 8;
+    report[6] = address & 0xFF;
+    return report;
+}
+
+void memoryChecks(Checks& checks) {
+    RecordingBluetooth bt;
+    MemoryAccess memory;
+    memory.attach(&bt, 0x0081);
+    int readError = -1;
+    int writes = 0;
+    memory.write(MemoryAccess::REGISTERS, 0xA400F0, {0x55}, [&](uint8_t, std::span<const uint8_t>) { writes++; });
+    memory.read(MemoryAccess::REGISTERS, 0xA400FA, 6, [&](uint8_t error, std::span<const uint8_t>) {
+        readError = error;
+    });
+    memory.write(MemoryAccess::REGISTERS, 0xA400FB, {0x00}, [&](uint8_t, std::span<const uint8_t>) { writes++; });
+    checks.expect(bt.sent.size() == 2, "memory: a read holds back what follows");
+
+    const uint8_t ack[] = {0xA1, 0x22, 0x00, 0x00, 0x16, 0x00};
+    memory.receive(ack);
+    checks.expect(writes == 1 && bt.sent.size() == 2, "memory: a write ack does not end the read");
+
+    memory.receive(readReply(0x00F0, 6));
+    checks.expect(readError == MemoryAccess::ERROR_BAD_REPLY, "memory: a reply for another address fails the read");
+    checks.expect(bt.sent.size() == 3, "memory: the next request goes out after a failed read");
+    memory.receive(ack);
+    checks.expect(writes == 2, "memory: the write after the failed read completes");
+
+    readError = -1;
+    memory.read(MemoryAccess::REGISTERS, 0xA40024, 16, [&](uint8_t error, std::span<const uint8_t>) {
+        readError = error;
+    });
+    memory.write(MemoryAccess::REGISTERS, 0xA400FB, {0x00});
+    memory.poll(1000);
+    memory.poll(1000 + MemoryAccess::TIMEOUT_MICROS - 1);
+    checks.expect(readError == -1, "memory: no timeout before the deadline");
+    memory.poll(1000 + MemoryAccess::TIMEOUT_MICROS);
+    checks.expect(readError == MemoryAccess::ERROR_TIMEOUT, "memory: an unanswered read times out");
+    checks.expect(bt.sent.size() == 5, "memory: the request behind a timed out one goes out");
+}
+
+}  // namespace
+
+bool selfTest() {
+    Checks checks;
+    ringChecks(checks);
+    gramsChecks(checks);
+    inputReportChecks(checks);
+    commandFlowChecks(checks);
+    encoderChecks(checks);
+    memoryChecks(checks);
+    log_i("%zu of %zu checks passed", checks.run - checks.failed, checks.run);
+    return checks.failed == 0;
+}
+
+}  // namespace wiipp::native
@@ -0,0 +1,633 @@
+#include "vhci_controller.h"
+
+#include <esp32-hal-bt.h>
+#include <esp_bt.h>
+#include <esp_mac.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace wiipp::native {
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+using Packet = std::vector<uint8_t>;
+
+constexpr uint8_t HOST_MAC[6] = {0x24, 0x0A, 0xC4, 0x12, 0x34, 0x56};
+constexpr char BOARD_NAME[] = "Nintendo RVL-WBC-01";
+constexpr char REMOTE_NAME[] = "Nintendo RVL-CNT-01";
+constexpr uint8_t BOARD_TEMPERATURE = 0x19;
+constexpr uint8_t BOARD_BATTERY = 0xC0;
+constexpr uint8_t COMMAND_PACKETS = 4;  // Num_HCI_Command_Packets
+
+struct Channel {
+    uint16_t psm;
+    uint16_t localCid;  // Board side
+    uint16_t hostCid;
+};
+
+// A balance board, or a Wii remote when `remote` is set
+struct SimBoard {
+    uint64_t bdaddr;
+    uint16_t handle;
+    bool remote;
+    bool connected;
+    bool streaming;
+    uint8_t reportingMode;
+    uint8_t irFormat;  // Written to 0xB00033
+    std::vector<Channel> channels;
+    Packet rxFrame;  // Host L2CAP frame being reassembled
+    uint16_t calibration[12];
+    uint8_t linkKey[16];  // Handed out on PIN pairing, the same every run so stored keys stay valid
+    uint32_t sample;
+    Clock::time_point nextReport;
+
+    const Channel* channel(uint16_t psm) const {
+        for (auto& c : channels) {
+            if (c.psm == psm) {
+                return &c;
+            }
+        }
+        return nullptr;
+    }
+
+    uint8_t memory(uint32_t address) const {
+        static constexpr uint8_t extensionId[] = {0x00, 0x00, 0xA4, 0x20, 0x04, 0x02};
+        if (address >= 0xA400FA && address < 0xA40100) {
+            return extensionId[address - 0xA400FA];
+        }
+        if (address >= 0xA40024 && address < 0xA4003C) {
+            uint32_t offset = address - 0xA40024;
+            uint16_t value = calibration[offset / 2];
+            return offset % 2 == 0 ? value >> 8 : value & 0xFF;
+        }
+        if (address == 0xA40060) {
+            return BOARD_TEMPERATURE;
+        }
+        return 0x00;
+    }
+};
+
+class Controller {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<Packet> inbound;
+    std::thread thread;
+    std::atomic<bool> running{false};
+    std::atomic<bool> stopped{false};
+
+    const esp_vhci_host_callback_t* callback{nullptr};
+    std::vector<SimBoard> boards;
+    uint8_t identifier{0x80};
+
+public:
+    ControllerConfig config;
+    std::atomic<size_t> boardsStreaming{0};
+    std::atomic<size_t> remotesStreaming{0};
+    std::atomic<uint64_t> reportsSent{0};
+    std::atomic<uint64_t> hostPackets{0};
+
+    void start(const esp_vhci_host_callback_t* cb) {
+        callback = cb;
+        boards.clear();
+        for (size_t i = 0; i < config.boards + config.remotes; ++i) {
+            bool remote = i >= config.boards;
+            SimBoard board{
+                .bdaddr = (remote ? 0x00191D010000ull : 0x00191D000000ull) | (i + 1),
+                .handle = static_cast<uint16_t>(0x000B + i),
+                .remote = remote,
+                .connected = false,
+                .streaming = false,
+                .reportingMode = 0x30,
+                .irFormat = 0,
+            };
+            for (size_t k = 0; k < sizeof(board.linkKey); ++k) {
+                board.linkKey[k] = static_cast<uint8_t>(0xA0 + 16 * i + k);
+            }
+            for (size_t s = 0; s < 4; ++s) {
+                uint16_t zero = 0x0400 + 0x40 * s + 0x10 * i;
+                board.calibration[s] = zero;              // 0kg
+                board.calibration[s + 4] = zero + 0x0700;  // 17kg
+                board.calibration[s + 8] = zero + 0x0E00;  // 34kg
+            }
+            boards.push_back(board);
+        }
+        running = true;
+        thread = std::thread([this] { run(); });
+    }
+
+    bool stop() {
+        running = false;
+        cv.notify_all();
+        if (!stopped) {
+            return false;
+        }
+        if (thread.joinable()) {
+            thread.join();
+        }
+        return true;
+    }
+
+    void send(uint8_t* data, uint16_t len) {
+        {
+            std::lock_guard lock(mutex);
+            inbound.emplace_back(data, data + len);
+        }
+        hostPackets++;
+        cv.notify_all();
+    }
+
+private:
+    void run() {
+        while (running) {
+            Packet packet;
+            {
+                std::unique_lock lock(mutex);
+                cv.wait_until(lock, nextDue(), [this] { return !running || !inbound.empty(); });
+                if (!inbound.empty()) {
+                    packet = std::move(inbound.front());
+                    inbound.pop_front();
+                }
+            }
+            if (!packet.empty()) {
+                handlePacket(packet);
+            }
+            pumpReports();
+        }
+        stopped = true;
+    }
+
+    Clock::time_point nextDue() const {
+        auto due = Clock::now() + std::chrono::milliseconds(100);
+        for (auto& board : boards) {
+            if (board.streaming && board.nextReport < due) {
+                due = board.nextReport;
+            }
+        }
+        return due;
+    }
+
+    // Host bound packets
+
+    void deliver(const Packet& packet) {
+        // Like the real controller this blocks while the host buffer is full.
+        callback->notify_host_recv(const_cast<uint8_t*>(packet.data()), packet.size());
+    }
+
+    void event(uint8_t code, const Packet& params) {
+        Packet packet{0x04, code, static_cast<uint8_t>(params.size())};
+        packet.insert(packet.end(), params.begin(), params.end());
+        deliver(packet);
+    }
+
+    void commandComplete(uint16_t opcode, uint8_t status, const Packet& params = {}) {
+        Packet data{COMMAND_PACKETS, static_cast<uint8_t>(opcode & 0xFF), static_cast<uint8_t>(opcode >> 8), status};
+        data.insert(data.end(), params.begin(), params.end());
+        event(0x0E, data);
+    }
+
+    void commandStatus(uint16_t opcode, uint8_t status) {
+        event(0x0F, {status, COMMAND_PACKETS, static_cast<uint8_t>(opcode & 0xFF), static_cast<uint8_t>(opcode >> 8)});
+    }
+
+    void acl(uint16_t handle, uint16_t cid, const Packet& payload) {
+        Packet frame{
+            static_cast<uint8_t>(payload.size() & 0xFF),
+            static_cast<uint8_t>(payload.size() >> 8),
+            static_cast<uint8_t>(cid & 0xFF),
+            static_cast<uint8_t>(cid >> 8),
+        };
+        frame.insert(frame.end(), payload.begin(), payload.end());
+
+        for (size_t offset = 0; offset < frame.size(); offset += config.aclLength) {
+            uint16_t len = std::min<size_t>(frame.size() - offset, config.aclLength);
+            uint8_t flags = offset == 0 ? 0b10 : 0b01;
+            Packet packet{
+                0x02,
+                static_cast<uint8_t>(handle & 0xFF),
+                static_cast<uint8_t>(((handle >> 8) & 0x0F) | flags << 4),
+                static_cast<uint8_t>(len & 0xFF),
+                static_cast<uint8_t>(len >> 8),
+            };
+            packet.insert(packet.end(), frame.begin() + offset, frame.begin() + offset + len);
+            deliver(packet);
+        }
+    }
+
+    static void appendAddr(Packet& packet, uint64_t bdaddr) {
+        for (size_t i = 0; i < 6; ++i) {
+            packet.push_back((bdaddr >> i * 8) & 0xFF);
+        }
+    }
+
+    static uint64_t readAddr(const uint8_t* data) {
+        uint64_t bdaddr = 0;
+        for (size_t i = 0; i < 6; ++i) {
+            bdaddr |= uint64_t{data[i]} << i * 8;
+        }
+        return bdaddr;
+    }
+
+    SimBoard* byAddr(uint64_t bdaddr) {
+        for (auto& board : boards) {
+            if (board.bdaddr == bdaddr) {
+                return &board;
+            }
+        }
+        return nullptr;
+    }
+
+    SimBoard* byHandle(uint16_t handle) {
+        for (auto& board : boards) {
+            if (board.handle == handle) {
+                return &board;
+            }
+        }
+        return nullptr;
+    }
+
+    // Host packets
+
+    void handlePacket(const Packet& packet) {
+        switch (packet[0]) {
+            case 0x01:
+                handleCommand(packet[1] | packet[2] << 8, packet.data() + 4);
+                break;
+            case 0x02:
+                handleACL(packet);
+                break;
+        }
+    }
+
+    void handleCommand(uint16_t opcode, const uint8_t* params) {
+        switch (opcode) {
+            case 0x0C03:  // Reset
+                for (auto& board : boards) {
+                    board.connected = board.streaming = false;
+                    board.channels.clear();
+                }
+                boardsStreaming = 0;
+                remotesStreaming = 0;
+                commandComplete(opcode, 0x00);
+                // A NOP Command Complete, without status, like controllers send once they are ready
+                event(0x0E, {COMMAND_PACKETS, 0x00, 0x00});
+                break;
+            case 0x1009: {  // Read BD_ADDR
+                Packet addr(HOST_MAC, HOST_MAC + 6);
+                std::reverse(addr.begin(), addr.end());
+                commandComplete(opcode, 0x00, addr);
+                break;
+            }
+            case 0x1005:  // Read buffer size, ACL aclLength bytes x 9 packets, SCO 255 x 4
+                commandComplete(opcode, 0x00,
+                                {static_cast<uint8_t>(config.aclLength & 0xFF), static_cast<uint8_t>(config.aclLength >> 8),
+                                 0xFF, 0x09, 0x00, 0x04, 0x00});
+                break;
+            case 0x0C13:  // Write local name
+            case 0x0C24:  // Write class of device
+            case 0x0C1A:  // Write scan enable
+            case 0x0402:  // Inquiry cancel
+                commandComplete(opcode, 0x00);
+                break;
+            case 0x0401:  // Inquiry
+                commandStatus(opcode, 0x00);
+                for (auto& board : boards) {
+                    Packet result{0x01};
+                    appendAddr(result, board.bdaddr);
+                    result.insert(result.end(), {0x01, 0x00, 0x00, 0x04, 0x25, 0x00, 0x12, 0x34});
+                    event(0x02, result);
+                }
+                event(0x01, {0x00});
+                break;
+            case 0x0419: {  // Remote name request
+                commandStatus(opcode, 0x00);
+                Packet name{0x00};
+                appendAddr(name, readAddr(params));
+                SimBoard* board = byAddr(readAddr(params));
+                if (board != nullptr && board->remote) {
+                    name.insert(name.end(), REMOTE_NAME, REMOTE_NAME + sizeof(REMOTE_NAME));
+                } else {
+                    name.insert(name.end(), BOARD_NAME, BOARD_NAME + sizeof(BOARD_NAME));
+                }
+                name.resize(1 + 6 + 248, 0x00);
+                event(0x07, name);
+                break;
+            }
+            case 0x0405: {  // Create connection
+                commandStatus(opcode, 0x00);
+                uint64_t bdaddr = readAddr(params);
+                SimBoard* board = byAddr(bdaddr);
+                Packet complete{static_cast<uint8_t>(board ? 0x00 : 0x04)};
+                uint16_t handle = board ? board->handle : 0;
+                complete.insert(complete.end(), {static_cast<uint8_t>(handle & 0xFF), static_cast<uint8_t>(handle >> 8)});
+                appendAddr(complete, bdaddr);
+                complete.insert(complete.end(), {0x01, 0x00});
+                if (board) {
+                    board->connected = true;
+                }
+                event(0x03, complete);
+                break;
+            }
+            case 0x0411: {  // Authentication requested
+                commandStatus(opcode, 0x00);
+                uint16_t handle = params[0] | params[1] << 8;
+                if (SimBoard* board = byHandle(handle)) {
+                    Packet request;
+                    appendAddr(request, board->bdaddr);
+                    event(0x17, request);  // Link key request
+                }
+                break;
+            }
+            case 0x040B: {  // Link key reply
+                Packet addr;
+                appendAddr(addr, readAddr(params));
+                commandComplete(opcode, 0x00, addr);
+                if (SimBoard* board = byAddr(readAddr(params))) {
+                    bool valid = memcmp(params + 6, board->linkKey, sizeof(board->linkKey)) == 0;
+                    event(0x06, {static_cast<uint8_t>(valid ? 0x00 : 0x05), static_cast<uint8_t>(board->handle & 0xFF),
+                                 static_cast<uint8_t>(board->handle >> 8)});
+                }
+                break;
+            }
+            case 0x040C: {  // Link key negative reply
+                Packet addr;
+                appendAddr(addr, readAddr(params));
+                commandComplete(opcode, 0x00, addr);
+                event(0x16, addr);  // PIN code request
+                break;
+            }
+            case 0x040D: {  // PIN code reply
+                Packet addr;
+                appendAddr(addr, readAddr(params));
+                commandComplete(opcode, 0x00, addr);
+                if (SimBoard* board = byAddr(readAddr(params))) {
+                    Packet notification = addr;  // Link key notification, combination key
+                    notification.insert(notification.end(), board->linkKey, board->linkKey + sizeof(board->linkKey));
+                    notification.push_back(0x00);
+                    event(0x18, notification);
+                    event(0x06, {0x00, static_cast<uint8_t>(board->handle & 0xFF),
+                                 static_cast<uint8_t>(board->handle >> 8)});
+                }
+                break;
+            }
+            case 0x0406: {  // Disconnect
+                commandStatus(opcode, 0x00);
+                uint16_t handle = params[0] | params[1] << 8;
+                if (SimBoard* board = byHandle(handle)) {
+                    if (board->streaming) {
+                        (board->remote ? remotesStreaming : boardsStreaming)--;
+                    }
+                    board->connected = board->streaming = false;
+                    board->channels.clear();
+                }
+                event(0x05, {0x00, static_cast<uint8_t>(handle & 0xFF), static_cast<uint8_t>(handle >> 8), 0x16});
+                break;
+            }
+            default:
+                commandComplete(opcode, 0x01);  // Unknown HCI command
+                break;
+        }
+    }
+
+    void handleACL(const Packet& packet) {
+        uint16_t handle = ((packet[2] & 0x0F) << 8) | packet[1];
+        uint8_t packetBoundaryFlag = (packet[2] >> 4) & 0x03;
+
+        // Number Of Completed Packets, the packet has left the controller buffer
+        event(0x13, {0x01, static_cast<uint8_t>(handle & 0xFF), static_cast<uint8_t>(handle >> 8), 0x01, 0x00});
+
+        SimBoard* board = byHandle(handle);
+        if (board == nullptr || !board->connected) {
+            return;
+        }
+
+        if (packetBoundaryFlag != 0b01) {
+            board->rxFrame.clear();
+        }
+        board->rxFrame.insert(board->rxFrame.end(), packet.begin() + 5, packet.end());
+        if (board->rxFrame.size() < 4 || board->rxFrame.size() < 4u + (board->rxFrame[0] | board->rxFrame[1] << 8)) {
+            return;
+        }
+        Packet frame = std::move(board->rxFrame);
+        board->rxFrame.clear();
+
+        uint16_t cid = frame[2] | frame[3] << 8;
+        const uint8_t* data = frame.data() + 4;
+
+        if (cid == 0x0001) {
+            handleSignaling(*board, data);
+            return;
+        }
+
+        const Channel* interrupt = board->channel(0x0013);
+        if (interrupt && cid == interrupt->localCid && data[0] == 0xA2) {
+            handleOutputReport(*board, *interrupt, data);
+        }
+    }
+
+    void handleSignaling(SimBoard& board, const uint8_t* data) {
+        uint8_t code = data[0];
+        uint8_t id = data[1];
+        switch (code) {
+            case 0x02: {  // Connection request
+                uint16_t psm = data[4] | data[5] << 8;
+                uint16_t hostCid = data[6] | data[7] << 8;
+                uint16_t localCid = 0x0040 + psm;
+                board.channels.push_back(Channel{.psm = psm, .localCid = localCid, .hostCid = hostCid});
+                acl(board.handle, 0x0001,
+                    {0x03, id, 0x08, 0x00, static_cast<uint8_t>(localCid & 0xFF), static_cast<uint8_t>(localCid >> 8),
+                     static_cast<uint8_t>(hostCid & 0xFF), static_cast<uint8_t>(hostCid >> 8), 0x00, 0x00, 0x00, 0x00});
+                acl(board.handle, 0x0001,
+                    {0x04, identifier++, 0x08, 0x00, static_cast<uint8_t>(hostCid & 0xFF),
+                     static_cast<uint8_t>(hostCid >> 8), 0x00, 0x00, 0x01, 0x02, 0xB9, 0x00});
+                break;
+            }
+            case 0x04: {  // Configuration request
+                uint16_t localCid = data[4] | data[5] << 8;
+                for (auto& c : board.channels) {
+                    if (c.localCid == localCid) {
+                        acl(board.handle, 0x0001,
+                            {0x05, id, 0x06, 0x00, static_cast<uint8_t>(c.hostCid & 0xFF),
+                             static_cast<uint8_t>(c.hostCid >> 8), 0x00, 0x00, 0x00, 0x00});
+                    }
+                }
+                break;
+            }
+            case 0x06: {  // Disconnection request
+                acl(board.handle, 0x0001, {0x07, id, 0x04, 0x00, data[4], data[5], data[6], data[7]});
+                break;
+            }
+        }
+    }
+
+    void handleOutputReport(SimBoard& board, const Channel& interrupt, const uint8_t* data) {
+        switch (data[1]) {
+            case 0x11:  // LEDs, a board answers with a status report announcing the extension
+                if (board.remote) {
+                    break;
+                }
+                [[fallthrough]];
+            case 0x15:  // Status request
+                acl(board.handle, interrupt.hostCid,
+                    {0xA1, 0x20, 0x00, 0x00, static_cast<uint8_t>(board.remote ? 0x00 : 0x02), 0x00, 0x00,
+                     BOARD_BATTERY});
+                break;
+            case 0x12: {  // Reporting mode
+                bool supported = board.remote ? data[3] == 0x33 || data[3] == 0x36 || data[3] == 0x37 : data[3] == 0x34;
+                if (!supported) {
+                    break;
+                }
+                board.reportingMode = data[3];
+                if (!board.streaming) {
+                    board.streaming = true;
+                    board.nextReport = Clock::now();
+                    (board.remote ? remotesStreaming : boardsStreaming)++;
+                }
+                break;
+            }
+            case 0x16: {  // Write memory
+                uint32_t address = data[3] << 16 | data[4] << 8 | data[5];
+                if (address == 0xB00033) {
+                    board.irFormat = data[7];
+                }
+                acl(board.handle, interrupt.hostCid, {0xA1, 0x22, 0x00, 0x00, 0x16, 0x00});
+                break;
+            }
+            case 0x17: {  // Read memory, answered in chunks of 16 bytes
+                uint32_t address = data[3] << 16 | data[4] << 8 | data[5];
+                uint16_t size = data[6] << 8 | data[7];
+                for (uint16_t offset = 0; offset < size; offset += 16) {
+                    uint16_t chunk = std::min<uint16_t>(16, size - offset);
+                    uint32_t chunkAddress = address + offset;
+                    Packet reply{0xA1, 0x21, 0x00, 0x00, static_cast<uint8_t>((chunk - 1) << 4),
+                                 static_cast<uint8_t>((chunkAddress >> 8) & 0xFF),
+                                 static_cast<uint8_t>(chunkAddress & 0xFF)};
+                    for (uint16_t i = 0; i < 16; ++i) {
+                        reply.push_back(i < chunk ? board.memory(chunkAddress + i) : 0x00);
+                    }
+                    acl(board.handle, interrupt.hostCid, reply);
+                }
+                break;
+            }
+        }
+    }
+
+    // Reports
+
+    // Two dots of a sensor bar drifting across the view, the other two slots empty, in
+    // whichever IR format the camera was set to
+    static Packet remoteReport(const SimBoard& board) {
+        uint8_t mode = board.reportingMode;
+        uint16_t buttons = board.sample / 50 % 2 ? 0x0008 : 0x0000;  // A
+        Packet report{0xA1, mode, static_cast<uint8_t>(buttons >> 8), static_cast<uint8_t>(buttons & 0xFF)};
+        if (mode != 0x36) {
+            report.insert(report.end(), {0x80, 0x80, 0x9A});
+        }
+
+        int32_t drift = static_cast<int32_t>(board.sample % 400) - 200;
+        uint16_t x[4] = {static_cast<uint16_t>(312 + drift), static_cast<uint16_t>(712 + drift), 1023, 1023};
+        uint16_t y[4] = {static_cast<uint16_t>(384 + drift / 2), static_cast<uint16_t>(384 + drift / 2), 1023, 1023};
+        if (board.irFormat == 3) {
+            for (size_t i = 0; i < 4; ++i) {
+                uint8_t size = x[i] == 1023 ? 0x0F : 0x03;
+                report.insert(report.end(), {static_cast<uint8_t>(x[i] & 0xFF), static_cast<uint8_t>(y[i] & 0xFF),
+                                             static_cast<uint8_t>((y[i] >> 8) << 6 | (x[i] >> 8) << 4 | size)});
+            }
+        } else {
+            for (size_t i = 0; i < 4; i += 2) {
+                report.insert(report.end(),
+                              {static_cast<uint8_t>(x[i] & 0xFF), static_cast<uint8_t>(y[i] & 0xFF),
+                               static_cast<uint8_t>((y[i] >> 8) << 6 | (x[i] >> 8) << 4 | (y[i + 1] >> 8) << 2 |
+                                                    x[i + 1] >> 8),
+                               static_cast<uint8_t>(x[i + 1] & 0xFF), static_cast<uint8_t>(y[i + 1] & 0xFF)});
+            }
+        }
+        // Extension bytes of 0x36 and 0x37, nothing plugged in
+        report.resize(mode == 0x33 ? 19 : 23, 0x00);
+        return report;
+    }
+
+    void pumpReports() {
+        auto now = Clock::now();
+        for (auto& board : boards) {
+            if (!board.streaming || board.nextReport > now) {
+                continue;
+            }
+            const Channel* interrupt = board.channel(0x0013);
+            if (interrupt == nullptr) {
+                continue;
+            }
+
+            if (board.remote) {
+                acl(board.handle, interrupt->hostCid, remoteReport(board));
+                board.sample++;
+                reportsSent++;
+                if (config.reportRateHz > 0) {
+                    board.nextReport += std::chrono::microseconds(1000000 / config.reportRateHz);
+                }
+                continue;
+            }
+
+            Packet report{0xA1, 0x34, 0x00, 0x00};
+            // Sway around a 17kg load per sensor, diagonally opposite sensors move together
+            int32_t sway = static_cast<int32_t>(board.sample % 200) - 100;
+            for (size_t s = 0; s < 4; ++s) {
+                uint16_t value = board.calibration[s + 4] + (s == 0 || s == 3 ? sway : -sway);
+                report.push_back(value >> 8);
+                report.push_back(value & 0xFF);
+            }
+            report.insert(report.end(), {BOARD_TEMPERATURE, 0x00, BOARD_BATTERY});
+            report.resize(4 + 19, 0x00);
+            acl(board.handle, interrupt->hostCid, report);
+
+            board.sample++;
+            reportsSent++;
+            if (config.reportRateHz > 0) {
+                board.nextReport += std::chrono::microseconds(1000000 / config.reportRateHz);
+            }
+        }
+    }
+};
+
+Controller g_controller;
+
+}  // namespace
+
+void configureController(const ControllerConfig& config) { g_controller.config = config; }
+
+ControllerStats controllerStats() {
+    return ControllerStats{
+        .boardsStreaming = g_controller.boardsStreaming,
+        .remotesStreaming = g_controller.remotesStreaming,
+        .reportsSent = g_controller.reportsSent,
+        .hostPackets = g_controller.hostPackets,
+    };
+}
+
+bool stopController() { return g_controller.stop(); }
+
+}  // namespace wiipp::native
+
+bool btStart() { return true; }
+
+esp_err_t esp_read_mac(uint8_t* mac, esp_mac_type_t type) {
+    memcpy(mac, wiipp::native::HOST_MAC, 6);
+    return ESP_OK;
+}
+
+bool esp_vhci_host_check_send_available(void) { return true; }
+
+void esp_vhci_host_send_packet(uint8_t* data, uint16_t len) { wiipp::native::g_controller.send(data, len); }
+
+esp_err_t esp_vhci_host_register_callback(const esp_vhci_host_callback_t* callback) {
+    wiipp::native::g_controller.start(callback);
+    return ESP_OK;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Scripted stand-in for the ESP32 Bluetooth controller behind esp_vhci_host_*.
+// It answers the HCI init sequence, reports the configured number of balance
+// boards and Wii remotes on inquiry, walks through connection, pairing and L2CAP
+// setup, serves the calibration memory reads and then pumps 0x34 reports for
+// every board and IR reports in the mode the host asked for for every remote.
+
+namespace wiipp::native {
+
+struct ControllerConfig {
+    size_t boards{1};
+    uint32_t reportRateHz{0};  // Per device, 0 pumps reports as fast as the host drains them
+    uint16_t aclLength{1021};  // ACL buffer size reported to the host, longer L2CAP frames are fragmented both ways
+    size_t remotes{0};
+};
+
+struct ControllerStats {
+    size_t boardsStreaming;
+    size_t remotesStreaming;
+    uint64_t reportsSent;
+    uint64_t hostPackets;
+};
+
+// Must be called before the controller thread is started by esp_vhci_host_register_callback.
+void configureController(const ControllerConfig& config);
+ControllerStats controllerStats();
+
+// Asks the controller thread to stop, returns true once it has. The controller may be
+// blocked handing a packet to the host, so keep processing until this returns true.
+bool stopController();
+
+}  // namespace wiipp::native
@@ -0,0 +1,50 @@
+#include "nvs_storage.h"
+
+#include "log.h"
+
+namespace wiipp {
+
+NvsStorage::NvsStorage(const char* name) {
+    esp_err_t err = nvs_open(name, NVS_READWRITE, &handle);
+    open = err == ESP_OK;
+    if (!open) {
+        log_e("Cannot open NVS namespace %s: %d", name, err);
+    }
+}
+
+NvsStorage::~NvsStorage() {
+    if (open) {
+        nvs_close(handle);
+    }
+}
+
+size_t NvsStorage::load(const char* key, std::span<uint8_t> out) {
+    size_t size = out.size();
+    if (!open || nvs_get_blob(handle, key, out.data(), &size) != ESP_OK) {
+        return 0;
+    }
+    return size;
+}
+
+bool NvsStorage::store(const char* key, std::span<const uint8_t> value) {
+    if (!open) {
+        return false;
+    }
+    esp_err_t err = nvs_set_blob(handle, key, value.data(), value.size());
+    if (err == ESP_OK) {
+        err = nvs_commit(handle);
+    }
+    if (err != ESP_OK) {
+        log_e("Cannot store %s: %d", key, err);
+        return false;
+    }
+    return true;
+}
+
+void NvsStorage::erase(const char* key) {
+    if (open && nvs_erase_key(handle, key) == ESP_OK) {
+        nvs_commit(handle);
+    }
+}
+
+}  // namespace wiipp
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <nvs.h>
+
+#include "storage.h"
+
+namespace wiipp {
+
+// Storage in an NVS namespace. The NVS flash partition must already be initialized, the
+// Arduino core does that on start up.
+class NvsStorage : public Storage {
+    nvs_handle_t handle{0};
+    bool open{false};
+
+public:
+    explicit NvsStorage(const char* name = "wiipp");
+    ~NvsStorage();
+    NvsStorage(const NvsStorage&) = delete;
+    NvsStorage& operator=(const NvsStorage&) = delete;
+
+    size_t load(const char* key, std::span<uint8_t> out) override;
+    bool store(const char* key, std::span<const uint8_t> value) override;
+    void erase(const char* key) override;
+};
+
+}  // namespace wiipp
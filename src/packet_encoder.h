@@ -0,0 +1,97 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+
+#include "ring_buffer.h"
+
+// Packets described as a list of fixed size fields. The packet size is known at compile
+// time, and the fields are written straight into the acquired ring slot:
+//
+//     enqueue(buffer, U8{H4_TYPE_COMMAND}, U16{HCI_INQUIRY}, U8{5}, U24{lap}, U8{len}, U8{num});
+
+namespace wiipp::encode {
+
+struct U8 {
+    static constexpr size_t SIZE = 1;
+    uint8_t value;
+
+    void write(uint8_t*& buf) const { *buf++ = value; }
+};
+
+struct U16 {
+    static constexpr size_t SIZE = 2;
+    uint16_t value;
+
+    void write(uint8_t*& buf) const {
+        *buf++ = value & 0xFF;
+        *buf++ = value >> 8;
+    }
+};
+
+// Three byte little endian value, a LAP or a class of device
+struct U24 {
+    static constexpr size_t SIZE = 3;
+    uint32_t value;
+
+    void write(uint8_t*& buf) const {
+        *buf++ = value & 0xFF;
+        *buf++ = (value >> 8) & 0xFF;
+        *buf++ = (value >> 16) & 0xFF;
+    }
+};
+
+struct BdAddr {
+    static constexpr size_t SIZE = 6;
+    uint64_t value;
+
+    void write(uint8_t*& buf) const {
+        for (size_t i = 0; i < SIZE; ++i) {
+            *buf++ = (value >> i * 8) & 0xFF;
+        }
+    }
+};
+
+// A fixed size field holding up to N bytes of `data`, zero padded
+template <size_t N>
+struct Bytes {
+    static constexpr size_t SIZE = N;
+    const uint8_t* data;
+    size_t len;
+
+    void write(uint8_t*& buf) const {
+        size_t n = std::min(len, N);
+        memcpy(buf, data, n);
+        memset(buf + n, 0, N - n);
+        buf += N;
+    }
+};
+
+template <typename... Fields>
+constexpr size_t size_of = (Fields::SIZE + ... + 0);
+
+template <typename... Fields>
+void write(uint8_t* buf, const Fields&... fields) {
+    (fields.write(buf), ...);
+}
+
+// Acquires a slot of exactly the packet size and writes the fields into it
+template <typename... Fields>
+bool enqueue(wiipp::RingBuffer& buffer, const Fields&... fields) {
+    if (auto out = buffer.allocate(size_of<Fields...>)) {
+        write(out.data(), fields...);
+        return true;
+    }
+    return false;
+}
+
+template <typename... Fields>
+std::array<uint8_t, size_of<Fields...>> to_array(const Fields&... fields) {
+    std::array<uint8_t, size_of<Fields...>> out;
+    write(out.data(), fields...);
+    return out;
+}
+
+}  // namespace wiipp::encode
@@ -1,28 +1,53 @@
 #pragma once
+#include <freertos/FreeRTOS.h>
 #include <freertos/ringbuf.h>
+#include <freertos/task.h>
 
+#include <atomic>
+#include <cstring>
 #include <memory>
+#include <span>
+#include <stdexcept>
+#include <type_traits>
+
+#include "log.h"
+
+// RingBuffer is the lock-free SpscRingBuffer by default. Build with
+// -DWIIPP_FREERTOS_RINGBUF to use the FreeRTOS xRingbuffer backend instead.
 
 namespace wiipp {
 
+// A slot in a ring buffer, either acquired for writing or received for reading.
+// The slot is handed back to the ring (committed or returned) when the RingData
+// is destroyed, so views into it must not outlive it.
 class RingData {
     uint8_t* m_data;
     size_t m_size;
-    std::function<void(uint8_t*)> m_completion;
+    void* m_ring;
+    void (*m_done)(void* ring, uint8_t* data);
 
 public:
-    RingData(uint8_t* data, size_t size, std::function<void(uint8_t*)> completion)
-        : m_data(data), m_size(size), m_completion(completion) {}
+    RingData(uint8_t* data, size_t size, void* ring, void (*done)(void*, uint8_t*))
+        : m_data(data), m_size(size), m_ring(ring), m_done(done) {}
     RingData(RingData&) = delete;
     RingData& operator=(const RingData&) = delete;
-    RingData(RingData&&) = default;
+    RingData(RingData&& other) : m_data(other.m_data), m_size(other.m_size), m_ring(other.m_ring), m_done(other.m_done) {
+        other.m_data = nullptr;
+    }
 
-    ~RingData() { m_completion(m_data); }
+    ~RingData() {
+        if (m_data != nullptr) {
+            m_done(m_ring, m_data);
+        }
+    }
 
     const uint8_t& operator[](size_t idx) const { return m_data[idx]; }
 
     size_t size() const { return m_size; }
     uint8_t* data() const { return m_data; }
+    std::span<const uint8_t> view(size_t offset = 0) const {
+        return offset < m_size ? std::span<const uint8_t>(m_data + offset, m_size - offset) : std::span<const uint8_t>();
+    }
 
     size_t size() { return m_size; }
     uint8_t* data() { return m_data; }
@@ -31,30 +56,35 @@ public:
     operator bool() const { return m_data != nullptr; }
 };
 
-class RingBuffer {
+class FreeRtosRingBuffer {
     RingbufHandle_t buf;
 
+    static void complete(void* ring, uint8_t* data) { xRingbufferSendComplete(ring, data); }
+    static void release(void* ring, uint8_t* data) { vRingbufferReturnItem(ring, data); }
+
 public:
-    RingBuffer(size_t size) : buf(xRingbufferCreate(size, RINGBUF_TYPE_NOSPLIT)) {
+    FreeRtosRingBuffer(size_t size) : buf(xRingbufferCreate(size, RINGBUF_TYPE_NOSPLIT)) {
         if (!buf) {
             throw std::runtime_error("Failed to create ring buffer");
         }
     }
 
-    RingBuffer(RingBuffer&) = delete;
-    RingBuffer& operator=(const RingBuffer&) = delete;
+    FreeRtosRingBuffer(FreeRtosRingBuffer&) = delete;
+    FreeRtosRingBuffer& operator=(const FreeRtosRingBuffer&) = delete;
 
-    ~RingBuffer() { vRingbufferDelete(buf); }
+    ~FreeRtosRingBuffer() { vRingbufferDelete(buf); }
 
     const RingData read(int ms) {
         size_t rxSize;
         uint8_t* rxData = (uint8_t*)xRingbufferReceive(buf, &rxSize, pdMS_TO_TICKS(ms));
 
-        return RingData(rxData, rxSize, [this](uint8_t* data) {
-            if (data != nullptr) {
-                vRingbufferReturnItem(buf, (void*)data);
-            }
-        });
+        return RingData(rxData, rxData ? rxSize : 0, buf, release);
+    }
+
+    size_t pending() {
+        UBaseType_t waiting;
+        vRingbufferGetInfo(buf, nullptr, nullptr, nullptr, nullptr, &waiting);
+        return waiting;
     }
 
     void clear() {
@@ -69,14 +99,254 @@ public:
         log_d("Buffer flushed");
     }
 
+    // Whether `count` items of `sizeOf(i)` bytes would all fit right now. NOSPLIT items take
+    // an 8 byte header and 4 byte alignment. Only checked against the largest free stretch,
+    // which is on the safe side of where the items will actually go.
+    template <typename F>
+    bool canAllocate(size_t count, F sizeOf) {
+        size_t total = 0;
+        for (size_t i = 0; i < count; ++i) {
+            total += 8 + ((sizeOf(i) + 3) & ~size_t{3});
+        }
+        return total <= xRingbufferGetCurFreeSize(buf) + 8;
+    }
+
     RingData allocate(size_t size, int ms = 0) {
         uint8_t* data;
         auto res = xRingbufferSendAcquire(buf, (void**)&data, size, ms);
         if (res != pdTRUE) {
-            return RingData(nullptr, 0, [](auto...) {});
+            return RingData(nullptr, 0, buf, complete);
+        }
+        return RingData(data, size, buf, complete);
+    }
+};
+
+// Single producer, single consumer ring of variable length items. allocate() may only be
+// called from one task and read()/pending()/clear() from one (possibly other) task, with at
+// most one slot outstanding on each side. Acquire and commit are plain atomic loads and
+// stores, there is no critical section and no per item allocation.
+//
+// Items are stored contiguously as a 4 byte length header followed by the payload padded
+// to 4 bytes. An item that does not fit before the end of the storage is preceded by a
+// wrap marker and placed at the start instead.
+class SpscRingBuffer {
+    static constexpr uint32_t WRAP = 0xFFFFFFFF;
+    static constexpr size_t HEADER_SIZE = sizeof(uint32_t);
+
+    std::unique_ptr<uint8_t[]> m_storage;
+    size_t m_capacity;
+    size_t m_mask;
+
+    // Free running byte counters, the storage offset is the counter masked by capacity-1
+    alignas(32) std::atomic<size_t> m_head{0};  // Written by the consumer
+    alignas(32) std::atomic<size_t> m_tail{0};  // Written by the producer
+
+    size_t m_pendingTail{0};  // Producer only, tail after the acquired slot
+    bool m_acquired{false};
+    size_t m_pendingHead{0};  // Consumer only, head after the received slot
+    bool m_received{false};
+
+    static size_t footprint(size_t size) { return HEADER_SIZE + ((size + 3) & ~size_t{3}); }
+
+    uint32_t header(size_t offset) const {
+        uint32_t value;
+        memcpy(&value, m_storage.get() + offset, HEADER_SIZE);
+        return value;
+    }
+
+    void setHeader(size_t offset, uint32_t value) { memcpy(m_storage.get() + offset, &value, HEADER_SIZE); }
+
+    static void complete(void* ring, uint8_t*) {
+        auto* self = static_cast<SpscRingBuffer*>(ring);
+        self->m_acquired = false;
+        self->m_tail.store(self->m_pendingTail, std::memory_order_release);
+    }
+
+    static void release(void* ring, uint8_t*) {
+        auto* self = static_cast<SpscRingBuffer*>(ring);
+        self->m_received = false;
+        self->m_head.store(self->m_pendingHead, std::memory_order_release);
+    }
+
+    // Items queued between the two counters. The producer can move head past tail while it
+    // restarts an empty ring at a boundary, which reads as empty too.
+    static bool empty(size_t head, size_t tail) {
+        return static_cast<std::make_signed_t<size_t>>(tail - head) <= 0;
+    }
+
+    uint8_t* tryAcquire(size_t size) {
+        size_t need = footprint(size);
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        size_t head = m_head.load(std::memory_order_acquire);
+        size_t offset = tail & m_mask;
+        size_t contiguous = m_capacity - offset;
+
+        // An empty ring restarts at the next boundary when the item does not fit before the
+        // end, otherwise an item over half the capacity could never wrap. Only an empty ring
+        // is moved, so the consumer has nothing received and does not store head meanwhile.
+        if (need > contiguous && head == tail &&
+            m_head.compare_exchange_strong(head, tail + contiguous, std::memory_order_acq_rel)) {
+            tail += contiguous;
+            head = tail;
+            offset = 0;
+            contiguous = m_capacity;
+        }
+        size_t free = m_capacity - (tail - head);
+
+        if (need <= contiguous) {
+            if (need > free) {
+                return nullptr;
+            }
+        } else {
+            if (contiguous + need > free) {
+                return nullptr;
+            }
+            setHeader(offset, WRAP);
+            tail += contiguous;
+            offset = 0;
+        }
+
+        setHeader(offset, size);
+        m_pendingTail = tail + need;
+        m_acquired = true;
+        return m_storage.get() + offset + HEADER_SIZE;
+    }
+
+    uint8_t* tryReceive(size_t* size) {
+        // Tail first, a tail published after a restart at a boundary comes with the moved head
+        size_t tail = m_tail.load(std::memory_order_acquire);
+        size_t head = m_head.load(std::memory_order_acquire);
+        if (empty(head, tail)) {
+            return nullptr;
+        }
+        size_t offset = head & m_mask;
+        uint32_t len = header(offset);
+        if (len == WRAP) {
+            head += m_capacity - offset;
+            offset = 0;
+            len = header(offset);
+        }
+        *size = len;
+        m_pendingHead = head + footprint(len);
+        m_received = true;
+        return m_storage.get() + offset + HEADER_SIZE;
+    }
+
+    // Retries `attempt` until it succeeds or `ms` milliseconds have passed. Spins briefly
+    // before sleeping a tick, as there is no semaphore to wait on.
+    template <typename F>
+    static uint8_t* retry(int ms, F attempt) {
+        if (uint8_t* data = attempt()) {
+            return data;
+        }
+        if (ms == 0) {
+            return nullptr;
+        }
+        bool forever = (TickType_t)ms == portMAX_DELAY;
+        TickType_t start = xTaskGetTickCount();
+        for (int spin = 0;; ++spin) {
+            if (uint8_t* data = attempt()) {
+                return data;
+            }
+            if (!forever && xTaskGetTickCount() - start >= pdMS_TO_TICKS(ms)) {
+                return nullptr;
+            }
+            if (spin < 256) {
+                taskYIELD();
+            } else {
+                vTaskDelay(1);
+            }
         }
-        return RingData(data, size, [this](uint8_t* data) { xRingbufferSendComplete(buf, data); });
+    }
+
+public:
+    SpscRingBuffer(size_t size) : m_storage(new uint8_t[size]), m_capacity(size), m_mask(size - 1) {
+        if (size < 2 * HEADER_SIZE || (size & (size - 1)) != 0) {
+            throw std::runtime_error("Ring buffer size must be a power of two");
+        }
+    }
+
+    SpscRingBuffer(SpscRingBuffer&) = delete;
+    SpscRingBuffer& operator=(const SpscRingBuffer&) = delete;
+
+    const RingData read(int ms) {
+        if (m_received) {
+            return RingData(nullptr, 0, this, release);
+        }
+        size_t size = 0;
+        uint8_t* data = retry(ms, [this, &size] { return tryReceive(&size); });
+        return RingData(data, data ? size : 0, this, release);
+    }
+
+    size_t pending() {
+        size_t tail = m_tail.load(std::memory_order_acquire);
+        size_t head = m_head.load(std::memory_order_acquire);
+        size_t count = 0;
+        while (!empty(head, tail)) {
+            size_t offset = head & m_mask;
+            uint32_t len = header(offset);
+            if (len == WRAP) {
+                head += m_capacity - offset;
+                continue;
+            }
+            head += footprint(len);
+            count++;
+        }
+        return count;
+    }
+
+    void clear() {
+        size_t tail = m_tail.load(std::memory_order_acquire);
+        size_t head = m_head.load(std::memory_order_acquire);
+        // Compare and swap, so a head the producer moved ahead is not set back
+        if (!empty(head, tail)) {
+            m_head.compare_exchange_strong(head, tail, std::memory_order_acq_rel);
+        }
+        log_d("Buffer flushed");
+    }
+
+    // Whether `count` items of `sizeOf(i)` bytes would all fit right now, for a producer that
+    // has to queue all of them or none. Lays them out the way tryAcquire() would. The consumer
+    // only makes room, so they still fit when allocated one by one right after.
+    template <typename F>
+    bool canAllocate(size_t count, F sizeOf) const {
+        if (m_acquired) {
+            return false;
+        }
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        size_t head = m_head.load(std::memory_order_acquire);
+        for (size_t i = 0; i < count; ++i) {
+            size_t need = footprint(sizeOf(i));
+            size_t offset = tail & m_mask;
+            size_t contiguous = m_capacity - offset;
+            if (need > contiguous && head == tail) {
+                tail += contiguous;
+                head = tail;
+                contiguous = m_capacity;
+            }
+            size_t free = m_capacity - (tail - head);
+            size_t used = need <= contiguous ? need : contiguous + need;
+            if (used > free) {
+                return false;
+            }
+            tail += used;
+        }
+        return true;
+    }
+
+    RingData allocate(size_t size, int ms = 0) {
+        if (m_acquired || footprint(size) > m_capacity) {
+            return RingData(nullptr, 0, this, complete);
+        }
+        uint8_t* data = retry(ms, [this, size] { return tryAcquire(size); });
+        return RingData(data, data ? size : 0, this, complete);
     }
 };
 
+#ifdef WIIPP_FREERTOS_RINGBUF
+using RingBuffer = FreeRtosRingBuffer;
+#else
+using RingBuffer = SpscRingBuffer;
+#endif
+
 }  // namespace wiipp